@@ -0,0 +1,110 @@
+/*
+** Publish/subscribe broker using the uv_msg_pubsub.c module
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <uv.h>
+#include "uv_msg_framing.c"
+#include "uv_send_message.c"
+#include "uv_msg_pubsub.c"
+
+#define DEFAULT_PORT 7000
+
+#ifdef _WIN32
+# define PIPENAME "\\\\?\\pipe\\some.name"
+#elif defined (__android__)
+# define PIPENAME "/data/local/tmp/some.name"
+#else
+# define PIPENAME "/tmp/some.name"
+#endif
+
+pubsub_t broker;
+
+/****************************************************************************/
+
+void on_close(uv_handle_t *handle) {
+   free(handle);
+}
+
+void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+   buf->base = (char*) malloc(suggested_size);
+   buf->len = suggested_size;
+}
+
+void free_buffer(uv_handle_t* handle, void* ptr) {
+   free(ptr);
+}
+
+void on_msg_received(uv_msg_t *client, void *msg, int size) {
+
+   if (size < 0) {
+      if (size != UV_EOF) {
+         fprintf(stderr, "Read error: %s\n", uv_err_name(size));
+      }
+      pubsub_remove(&broker, client);
+      uv_msg_close(client, on_close);
+      return;
+   }
+
+   if (pubsub_on_message(&broker, client, msg, size) == UV_EPROTO) {
+      fprintf(stderr, "Invalid message (%d bytes)\n", size);
+   }
+
+}
+
+void on_new_connection(uv_stream_t *server, int status) {
+
+   if (status < 0) {
+      fprintf(stderr, "New connection error %s\n", uv_strerror(status));
+      return;
+   }
+
+   uv_msg_t *client = malloc(sizeof(uv_msg_t));
+
+#ifdef USE_PIPE_EXAMPLE
+   uv_msg_init(server->loop, client, UV_NAMED_PIPE);
+#else
+   uv_msg_init(server->loop, client, UV_TCP);
+#endif
+
+   if (uv_accept(server, (uv_stream_t*) client) == 0) {
+      uv_msg_read_start(client, alloc_buffer, on_msg_received, free_buffer);
+   } else {
+      uv_msg_close(client, on_close);
+   }
+
+}
+
+int main() {
+   int rc;
+   uv_loop_t *loop = uv_default_loop();
+
+   pubsub_init(&broker);
+   /* do not queue more than 1MB for slow subscribers */
+   broker.max_backlog = 1024 * 1024;
+
+   uv_msg_t* socket = malloc(sizeof(uv_msg_t));
+
+#ifdef USE_PIPE_EXAMPLE
+   rc = uv_msg_init(loop, socket, UV_NAMED_PIPE);
+   rc = uv_pipe_bind((uv_pipe_t*)socket, PIPENAME);
+#else
+   rc = uv_msg_init(loop, socket, UV_TCP);
+   struct sockaddr_in addr;
+   uv_ip4_addr("0.0.0.0", DEFAULT_PORT, &addr);
+   rc = uv_tcp_bind((uv_tcp_t*)socket, (const struct sockaddr*)&addr, 0);
+#endif
+   if (rc) {
+      fprintf(stderr, "Bind error %s\n", uv_strerror(rc));
+      return 1;
+   }
+
+   rc = uv_listen((uv_stream_t*) socket, 128, on_new_connection);
+   if (rc) {
+      fprintf(stderr, "Listen error %s\n", uv_strerror(rc));
+      return 1;
+   }
+
+   return uv_run(loop, UV_RUN_DEFAULT);
+}
@@ -51,7 +51,7 @@ void on_msg_received(uv_msg_t *client, void *msg, int size) {
       if (size != UV_EOF) {
          fprintf(stderr, "Read error: %s\n", uv_err_name(size));
       }
-      uv_close((uv_handle_t*) client, NULL);
+      uv_msg_close(client, on_close);
       return;
    }
 
@@ -80,7 +80,7 @@ void on_new_connection(uv_stream_t *server, int status) {
       /* new client connected! start reading messages on this stream (asynchronously) */
       uv_msg_read_start(client, alloc_buffer, on_msg_received, free_buffer);
    } else {
-      uv_close((uv_handle_t*) client, on_close);
+      uv_msg_close(client, on_close);
    }
 
 }
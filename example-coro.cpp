@@ -0,0 +1,71 @@
+/*
+** This example code must be run with the echo-server running.
+** It uses the C++20 coroutine interface from uv_msg.hpp
+*/
+#include <cstdio>
+#include <cstring>
+#include <uv.h>
+#include "uv_msg.hpp"
+
+#define DEFAULT_PORT 7000
+
+#ifdef _WIN32
+# define PIPENAME "\\\\?\\pipe\\some.name"
+#elif defined (__android__)
+# define PIPENAME "/data/local/tmp/some.name"
+#else
+# define PIPENAME "/tmp/some.name"
+#endif
+
+/****************************************************************************/
+
+uvmsg::task session(uv_loop_t *loop) {
+   uvmsg::connection conn;
+   int rc;
+
+#ifdef USE_PIPE_EXAMPLE
+   rc = conn.init(loop, UV_NAMED_PIPE);
+   if (rc == 0) rc = co_await conn.connect(PIPENAME);
+#else
+   struct sockaddr_in dest;
+   uv_ip4_addr("127.0.0.1", DEFAULT_PORT, &dest);
+   rc = conn.init(loop, UV_TCP);
+   if (rc == 0) rc = co_await conn.connect((const struct sockaddr*) &dest);
+#endif
+   if (rc) {
+      fprintf(stderr, "Connection error: %s\n", uv_strerror(rc));
+      co_return;
+   }
+
+   const char *texts[] = { "Hello World!", "Is it working?", "Yeaaah!" };
+
+   for (const char *text : texts) {
+      rc = co_await conn.send(std::span(text, strlen(text) + 1));
+      if (rc < 0) {
+         fprintf(stderr, "message write failed: %s\n", uv_strerror(rc));
+         co_return;
+      }
+      puts("message sent");
+   }
+
+   for (int i = 0; i < 3; i++) {
+      uvmsg::message msg = co_await conn.read();
+      if (!msg) {
+         if (msg.error() != UV_EOF) {
+            fprintf(stderr, "Read error: %s\n", uv_err_name(msg.error()));
+         }
+         co_return;
+      }
+      printf("new message received (%zu bytes): %s\n", msg.size(), msg.data().data());
+   }
+
+   /* the connection is closed when it goes out of scope */
+}
+
+int main() {
+   uv_loop_t *loop = uv_default_loop();
+
+   session(loop);
+
+   return uv_run(loop, UV_RUN_DEFAULT);
+}
@@ -61,7 +61,7 @@ void on_msg_received(uv_msg_t *client, void *msg, int size) {
       if (size != UV_EOF) {
          fprintf(stderr, "Read error: %s\n", uv_err_name(size));
       }
-      uv_close((uv_handle_t*) client, NULL);
+      uv_msg_close(client, NULL);
       return;
    }
 
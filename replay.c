@@ -0,0 +1,179 @@
+/*
+** Replays the received traffic from a capture file made with uv_msg_capture.c
+**
+** The recorded reads are written to one end of a socket pair, with the same
+** chunk sizes and timing as they were received, and the other end reads them
+** using the message framing. Use --max-speed to ignore the recorded timing
+** and measure the reading throughput.
+**
+** Usage: replay <capture file> [--max-speed]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <uv.h>
+#include "uv_msg_framing.c"
+#include "uv_msg_capture.c"
+
+#define MAX_WRITE_QUEUE  (1024 * 1024)
+
+uv_loop_t *loop;
+uv_pipe_t writer;
+uv_msg_t reader;
+uv_timer_t timer;
+uv_shutdown_t shutdown_req;
+
+msg_capture_record_t *records;
+int num_records;
+int next_record = 0;
+int max_speed = 0;
+size_t queued = 0;
+int writing = 1;
+
+uint64_t start_time;
+uint64_t num_msgs = 0;
+uint64_t num_bytes = 0;
+
+/****************************************************************************/
+
+void write_next(void);
+
+void on_shutdown(uv_shutdown_t *req, int status) {
+   uv_close((uv_handle_t*) req->handle, NULL);
+}
+
+void write_done(void) {
+   /* the reader gets EOF only after all the queued records were written */
+   if (writing && next_record == num_records && queued == 0) {
+      writing = 0;
+      uv_shutdown(&shutdown_req, (uv_stream_t*) &writer, on_shutdown);
+   }
+}
+
+void on_write(uv_write_t *req, int status) {
+   queued -= (size_t) req->data;
+   free(req);
+   if (status < 0) {
+      fprintf(stderr, "Write error: %s\n", uv_err_name(status));
+      if (writing) {
+         writing = 0;
+         uv_close((uv_handle_t*) &writer, NULL);
+      }
+      return;
+   }
+   if (max_speed) write_next();
+   write_done();
+}
+
+void on_timer(uv_timer_t *handle) {
+   write_next();
+}
+
+void write_record(msg_capture_record_t *record) {
+   uv_write_t *req = malloc(sizeof(uv_write_t));
+   uv_buf_t buf = uv_buf_init(record->data, record->size);
+   req->data = (void*) (size_t) record->size;
+   queued += record->size;
+   uv_write(req, (uv_stream_t*) &writer, &buf, 1, on_write);
+}
+
+void write_next(void) {
+
+   if (max_speed) {
+      while (next_record < num_records && queued < MAX_WRITE_QUEUE) {
+         write_record(&records[next_record++]);
+      }
+   } else {
+      uint64_t elapsed = (uv_hrtime() - start_time) / 1000;
+      while (next_record < num_records && records[next_record].time <= elapsed) {
+         write_record(&records[next_record++]);
+      }
+      if (next_record < num_records) {
+         uint64_t wait = (records[next_record].time - elapsed) / 1000;
+         uv_timer_start(&timer, on_timer, wait, 0);
+         return;
+      }
+   }
+
+   write_done();
+
+}
+
+/****************************************************************************/
+
+void alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+   buf->base = (char*) malloc(suggested_size);
+   buf->len = suggested_size;
+}
+
+void free_buffer(uv_handle_t* handle, void* ptr) {
+   free(ptr);
+}
+
+void on_msg_received(uv_msg_t *socket, void *msg, int size) {
+
+   if (size < 0) {
+      double secs = (uv_hrtime() - start_time) / 1e9;
+      if (size != UV_EOF) {
+         fprintf(stderr, "Read error: %s\n", uv_err_name(size));
+      }
+      printf("%llu messages, %llu bytes in %.3f seconds\n",
+             (unsigned long long) num_msgs, (unsigned long long) num_bytes, secs);
+      if (secs > 0) {
+         printf("%.1f MB/s, %.0f messages/s\n", num_bytes / secs / 1e6, num_msgs / secs);
+      }
+      uv_timer_stop(&timer);
+      uv_close((uv_handle_t*) &timer, NULL);
+      uv_msg_close(socket, NULL);
+      return;
+   }
+
+   num_msgs++;
+   num_bytes += size;
+
+}
+
+/****************************************************************************/
+
+int main(int argc, char **argv) {
+   uv_os_sock_t fds[2];
+   int rc;
+
+   if (argc < 2) {
+      fprintf(stderr, "Usage: %s <capture file> [--max-speed]\n", argv[0]);
+      return 1;
+   }
+   if (argc > 2 && strcmp(argv[2], "--max-speed") == 0) max_speed = 1;
+
+   num_records = msg_capture_load(argv[1], UV_MSG_CAPTURE_READ, &records);
+   if (num_records < 0) {
+      fprintf(stderr, "Could not load the capture file: %s\n", uv_strerror(num_records));
+      return 1;
+   }
+   printf("%d reads loaded\n", num_records);
+
+   loop = uv_default_loop();
+
+   rc = uv_socketpair(SOCK_STREAM, 0, fds, UV_NONBLOCK_PIPE, UV_NONBLOCK_PIPE);
+   if (rc) {
+      fprintf(stderr, "Socket pair error: %s\n", uv_strerror(rc));
+      return 1;
+   }
+
+   uv_pipe_init(loop, &writer, 0);
+   uv_pipe_open(&writer, fds[0]);
+
+   uv_msg_init(loop, &reader, UV_NAMED_PIPE);
+   uv_pipe_open(&reader.pipe, fds[1]);
+   uv_msg_read_start(&reader, alloc_buffer, on_msg_received, free_buffer);
+
+   uv_timer_init(loop, &timer);
+
+   start_time = uv_hrtime();
+   write_next();
+
+   uv_run(loop, UV_RUN_DEFAULT);
+
+   msg_capture_free(records, num_records);
+   return 0;
+}
@@ -0,0 +1,167 @@
+/*
+** Tests for the C++20 coroutine interface (uv_msg.hpp)
+**
+** The uv_msg_framing.c file is compiled as C and linked:
+**
+**   gcc -c ../uv_msg_framing.c -o uv_msg_framing.o
+**   g++ -std=c++20 test-coro.cpp uv_msg_framing.o -o test-coro -luv
+*/
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <uv.h>
+#include "../uv_msg.hpp"
+
+#define NUM_MESSAGES  100
+
+uv_loop_t loop;
+
+char messages[3][100];
+int num_sent;
+int num_received;
+int second_reader_rc;
+int final_error;
+
+void fill_messages() {
+   for (int i = 0; i < 3; i++) {
+      memset(messages[i], 'A' + i, sizeof(messages[i]));
+      messages[i][sizeof(messages[i]) - 1] = 0;
+   }
+}
+
+/* Sending *******************************************************************/
+
+uvmsg::task writer(uvmsg::connection &conn) {
+   int rc;
+
+   /* an empty message is not sent */
+   rc = co_await conn.send(std::span<const char>());
+   assert(rc == UV_EINVAL);
+
+   for (int i = 0; i < NUM_MESSAGES; i++) {
+      int prio = i % 2 ? UV_MSG_PRIO_NORMAL : UV_MSG_PRIO_BULK;
+      rc = co_await conn.send(std::span<const char>(messages[i % 3], sizeof(messages[i % 3])), prio);
+      assert(rc == 0);
+      num_sent++;
+   }
+
+   /* the reader receives UV_EOF */
+   conn.close();
+}
+
+/* Reading *******************************************************************/
+
+uvmsg::task second_reader(uvmsg::connection &conn) {
+   /* only one coroutine can read at a time */
+   uvmsg::message msg = co_await conn.read();
+   assert(!msg);
+   second_reader_rc = msg.error();
+}
+
+uvmsg::task reader(uvmsg::connection &conn) {
+   for (;;) {
+      uvmsg::message msg = co_await conn.read();
+      if (!msg) {
+         final_error = msg.error();
+         break;
+      }
+      assert(msg.size() == sizeof(messages[0]));
+      assert(memcmp(msg.data().data(), messages[num_received % 3], msg.size()) == 0);
+      num_received++;
+      if (num_received == 1) {
+         /* the buffer can be taken from the message */
+         char *buf = msg.release();
+         assert(buf && !msg.data().data());
+         free(buf);
+      }
+   }
+
+   conn.close();
+}
+
+/* Pausing *******************************************************************/
+
+int num_drained;
+
+uvmsg::task first_message(uvmsg::connection &conn) {
+   /* starts the reading, then leaves the messages waiting */
+   uvmsg::message msg = co_await conn.read();
+   assert(msg);
+   num_drained++;
+}
+
+uvmsg::task drain(uvmsg::connection &conn) {
+   for (;;) {
+      uvmsg::message msg = co_await conn.read();
+      if (!msg) {
+         final_error = msg.error();
+         break;
+      }
+      assert(memcmp(msg.data().data(), messages[num_drained % 3], msg.size()) == 0);
+      num_drained++;
+   }
+   conn.close();
+}
+
+/* Main **********************************************************************/
+
+int main() {
+   uv_os_sock_t fds[2];
+   uvmsg::connection sender, receiver;
+
+   fill_messages();
+   assert(uv_loop_init(&loop) == 0);
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+
+   assert(sender.init(&loop, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open(&sender.get()->pipe, fds[0]) == 0);
+   assert(receiver.init(&loop, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open(&receiver.get()->pipe, fds[1]) == 0);
+
+   /* a moved connection keeps the socket */
+   uvmsg::connection moved(std::move(receiver));
+   assert(!receiver && moved);
+
+   reader(moved);
+   second_reader(moved);
+   assert(second_reader_rc == UV_EINVAL);
+
+   writer(sender);
+
+   assert(uv_run(&loop, UV_RUN_DEFAULT) == 0);
+
+   assert(num_sent == NUM_MESSAGES);
+   assert(num_received == NUM_MESSAGES);
+   assert(final_error == UV_EOF);
+   assert(!sender && !moved);
+
+   /* the messages not read pause the socket through the library, which also
+      holds the reading with its delivery budget */
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(sender.init(&loop, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open(&sender.get()->pipe, fds[0]) == 0);
+   assert(receiver.init(&loop, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open(&receiver.get()->pipe, fds[1]) == 0);
+   assert(uv_msg_set_read_budget(receiver.get(), 8, 0) == 0);
+   num_sent = 0;
+   final_error = 0;
+   first_message(receiver);
+   writer(sender);
+   assert(uv_run(&loop, UV_RUN_DEFAULT) == 0);
+   assert(num_sent == NUM_MESSAGES);
+   assert(receiver.get()->read_paused == 1);
+   assert(!uv_is_active((uv_handle_t*) receiver.get()));
+
+   /* reading again resumes it */
+   drain(receiver);
+   assert(uv_run(&loop, UV_RUN_DEFAULT) == 0);
+   assert(num_drained == NUM_MESSAGES);
+   assert(final_error == UV_EOF);
+   assert(!receiver);
+
+   /* all the handles were released */
+   assert(uv_loop_close(&loop) == 0);
+
+   puts("C++ coroutine interface tests PASS!");
+   return 0;
+}
@@ -38,7 +38,20 @@ void print_bytes(char *oper, unsigned char *data, int size) {
 }
 
 #define TESTING_UV_MSG_FRAMING
+#ifndef UV_MSG_USDT
+/* the tracepoints are counted */
+int probe_frame_parsed, probe_frame_delivered, probe_buffer_alloc, probe_buffer_realloc,
+    probe_buffer_free, probe_buffer_move, probe_write_queued, probe_write_completed;
+#define UV_MSG_PROBE2(name, a, b)     (probe_##name++)
+#define UV_MSG_PROBE3(name, a, b, c)  (probe_##name++)
+#endif
 #include "../uv_msg_framing.c"
+#include "../uv_send_message.c"
+#include "../uv_msg_pubsub.c"
+#ifndef _WIN32
+#include "../uv_msg_journal.c"
+#include "../uv_msg_capture.c"
+#endif
 
 /* Common ********************************************************************/
 
@@ -49,7 +62,7 @@ void on_close(uv_handle_t *handle) {
 }
 
 void on_walk(uv_handle_t *handle, void *arg) {
-   uv_close(handle, on_close);
+   if (!uv_is_closing(handle)) uv_close(handle, on_close);
 }
 
 /* Reader Thread *************************************************************/
@@ -81,7 +94,7 @@ void on_msg_received(uv_msg_t *client, void *msg, int size) {
       if (size != UV_EOF) {
          fprintf(stderr, "Read error: %s\n", uv_err_name(size));
       }
-      uv_close((uv_handle_t*) client, on_close);
+      uv_msg_close(client, on_close);
       return;
    }
 
@@ -107,7 +120,7 @@ void on_new_connection(uv_stream_t *server, int status) {
    if (uv_accept(server, (uv_stream_t*) client) == 0) {
       uv_msg_read_start(client, alloc_buffer, on_msg_received, free_buffer);
    } else {
-      uv_close((uv_handle_t*) client, on_close);
+      uv_msg_close(client, on_close);
    }
 }
 
@@ -229,6 +242,7 @@ void cleanup() {
    /* cleanup */
    puts("cleaning up main thread");
    uv_async_send(&stop_reader);
+   uv_msg_close(sendersocket, on_close);
    uv_walk(client_loop, on_walk, NULL);
    uv_run(client_loop, UV_RUN_DEFAULT);
    uv_loop_close(client_loop);
@@ -578,8 +592,2657 @@ void test_coalesced_and_fragmented_messages() {
 
 }
 
+/* Datagrams *****************************************************************/
+
+#define UDP_PORT 7358
+
+uv_msg_t udp_receiver;
+uv_msg_t udp_sender;
+int udp_received;
+
+void udp_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+   buf->base = (char*) malloc(suggested_size);
+   buf->len = suggested_size;
+}
+
+void on_udp_msg_received(uv_msg_t *socket, void *msg, int size) {
+   printf("udp msg_received called. size=%d\n", size);
+   assert(size > 0);
+   assert(socket->addr != NULL);
+   check_msg(msg, size, 'A' + udp_received % 3);
+   udp_received++;
+   if( udp_received == 6 ) uv_stop(client_loop);
+}
+
+void on_udp_msg_sent(uv_write_t *req, int status) {
+   assert(status == 0);
+   free(req);
+}
+
+void test_udp_datagrams() {
+   struct sockaddr_in addr;
+   char *stream_buffer, *ptr;
+   int msg_size = 100, entire_msg_size = msg_size + 4, i;
+
+   stream_buffer = malloc(3 * entire_msg_size);
+   for (i = 0; i < 3; i++) {
+      create_test_msg(stream_buffer + i * entire_msg_size, msg_size, 'A' + i);
+   }
+
+   uv_ip4_addr("127.0.0.1", UDP_PORT, &addr);
+
+   assert(uv_msg_init(client_loop, &udp_receiver, UV_UDP) == 0);
+   assert(uv_udp_bind((uv_udp_t*)&udp_receiver, (const struct sockaddr*)&addr, 0) == 0);
+   assert(uv_msg_read_start(&udp_receiver, udp_alloc_buffer, on_udp_msg_received, free_buffer) == 0);
+
+   assert(uv_msg_init(client_loop, &udp_sender, UV_UDP) == 0);
+   assert(uv_udp_connect((uv_udp_t*)&udp_sender, (const struct sockaddr*)&addr) == 0);
+   assert(uv_msg_set_udp_packing(&udp_sender, 1400) == 0);
+
+   /* the first message is sent alone, the other 5 are packed in the next datagram */
+   for (i = 0; i < 6; i++) {
+      uv_msg_send_t *req = malloc(sizeof(uv_msg_send_t));
+      ptr = stream_buffer + (i % 3) * entire_msg_size;
+      assert(uv_msg_send(req, &udp_sender, ptr + 4, msg_size, on_udp_msg_sent) == 0);
+   }
+   assert(udp_sender.udp_queue != NULL);
+
+   udp_received = 0;
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   assert(udp_received == 6);
+   assert(udp_sender.udp_queue == NULL);
+
+   free(stream_buffer);
+
+   puts("UDP tests PASS!");
+
+}
+
+/* Priorities ****************************************************************/
+
+char prio_order[8];
+int prio_received;
+
+void on_prio_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   prio_order[prio_received++] = ((char*)msg)[0];
+   if( prio_received == 5 ) uv_stop(client_loop);
+}
+
+void test_send_priorities() {
+   uv_msg_send_t invalid_req;
+   char *stream_buffer;
+   int msg_size = 100, entire_msg_size = msg_size + 4, i;
+   static const int prio[5] = { UV_MSG_PRIO_BULK, UV_MSG_PRIO_BULK, UV_MSG_PRIO_BULK, UV_MSG_PRIO_NORMAL, UV_MSG_PRIO_HIGH };
+   static const char letter[5] = { 'C', 'C', 'C', 'B', 'A' };
+
+   stream_buffer = malloc(5 * entire_msg_size);
+
+   /* an invalid priority is rejected, also when nothing is queued */
+   create_test_msg(stream_buffer, msg_size, 'X');
+   assert(uv_msg_send_prio(&invalid_req, &udp_sender, UV_MSG_PRIORITIES, stream_buffer + 4, msg_size, on_udp_msg_sent) == UV_EINVAL);
+   assert(uv_msg_send_prio(&invalid_req, &udp_sender, -1, stream_buffer + 4, msg_size, on_udp_msg_sent) == UV_EINVAL);
+
+   /* only one message handed to the transport at a time */
+   assert(uv_msg_set_max_inflight(&udp_sender, 1) == 0);
+   udp_receiver.msg_read_cb = on_prio_msg_received;
+
+   for (i = 0; i < 5; i++) {
+      uv_msg_send_t *req = malloc(sizeof(uv_msg_send_t));
+      char *ptr = stream_buffer + i * entire_msg_size;
+      create_test_msg(ptr, msg_size, letter[i]);
+      assert(uv_msg_send_prio(req, &udp_sender, prio[i], ptr + 4, msg_size, on_udp_msg_sent) == 0);
+   }
+   assert(udp_sender.queued == 4);
+
+   prio_received = 0;
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   /* the first message was already sent when the others were queued */
+   assert(prio_received == 5);
+   assert(memcmp(prio_order, "CABCC", 5) == 0);
+   assert(udp_sender.queued == 0);
+   assert(udp_sender.inflight == 0);
+
+   uv_msg_set_max_inflight(&udp_sender, 0);
+   free(stream_buffer);
+
+   puts("Priority tests PASS!");
+
+}
+
+/* Adaptive Corking **********************************************************/
+
+#define AUTOCORK_PORT 7359
+
+uv_tcp_t cork_server;
+uv_msg_t cork_client;
+uv_msg_t cork_conn;
+int cork_received;
+
+void on_cork_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   check_msg(msg, size, 'A' + cork_received % 3);
+   cork_received++;
+   if( cork_received == 3 ) uv_stop(client_loop);
+}
+
+void on_cork_connection(uv_stream_t *server, int status) {
+   assert(status == 0);
+   assert(uv_msg_init(client_loop, &cork_conn, UV_TCP) == 0);
+   assert(uv_accept(server, (uv_stream_t*) &cork_conn) == 0);
+   assert(uv_msg_read_start(&cork_conn, udp_alloc_buffer, on_cork_msg_received, free_buffer) == 0);
+}
+
+void on_cork_connect(uv_connect_t *connect, int status) {
+   assert(status == 0);
+   uv_stop(client_loop);
+}
+
+void test_autocork() {
+   struct sockaddr_in addr;
+   uv_connect_t connect;
+   char *stream_buffer;
+   int msg_size = 100, entire_msg_size = msg_size + 4, i;
+
+   stream_buffer = malloc(3 * entire_msg_size);
+   for (i = 0; i < 3; i++) {
+      create_test_msg(stream_buffer + i * entire_msg_size, msg_size, 'A' + i);
+   }
+
+   uv_ip4_addr("127.0.0.1", AUTOCORK_PORT, &addr);
+   assert(uv_tcp_init(client_loop, &cork_server) == 0);
+   assert(uv_tcp_bind(&cork_server, (const struct sockaddr*)&addr, 0) == 0);
+   assert(uv_listen((uv_stream_t*) &cork_server, DEFAULT_BACKLOG, on_cork_connection) == 0);
+
+   assert(uv_msg_init(client_loop, &cork_client, UV_TCP) == 0);
+   assert(uv_tcp_connect(&connect, (uv_tcp_t*)&cork_client, (const struct sockaddr*)&addr, on_cork_connect) == 0);
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+
+   assert(uv_msg_set_autocork(&cork_client, 1) == 0);
+
+   /* the first message goes alone, the next ones of the same iteration are corked */
+   for (i = 0; i < 3; i++) {
+      uv_msg_send_t *req = malloc(sizeof(uv_msg_send_t));
+      assert(uv_msg_send(req, &cork_client, stream_buffer + i * entire_msg_size + 4, msg_size, on_udp_msg_sent) == 0);
+      assert(cork_client.corked == (i > 0));
+   }
+   assert(cork_client.burst == 3);
+
+   cork_received = 0;
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   /* uncorked at the end of the loop iteration */
+   assert(cork_received == 3);
+   assert(cork_client.corked == 0);
+   assert(cork_client.burst == 0);
+   assert(cork_client.burst_avg > 0);
+
+   uv_msg_close(&cork_client, NULL);
+   uv_msg_close(&cork_conn, NULL);
+   uv_close((uv_handle_t*) &cork_server, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   free(stream_buffer);
+
+   puts("Autocork tests PASS!");
+
+}
+
+/* Zero Copy *****************************************************************/
+
+#ifdef __linux__
+
+#define ZEROCOPY_PORT 7360
+#define ZEROCOPY_SIZE (128 * 1024)
+#define ZEROCOPY_MESSAGES 20
+
+uv_tcp_t zc_server;
+uv_msg_t zc_client;
+uv_msg_t zc_conn;
+int zc_received;
+int zc_sent;
+int zc_freed;
+int zc_closed;
+
+void on_zc_msg_received(uv_msg_t *socket, void *msg, int size) {
+   char *data = msg;
+   /* the end of the stream after the close */
+   if( size < 0 ) return;
+   if( zc_received == 0 ){
+      assert(size == ZEROCOPY_SIZE);
+      assert(data[0] == 'Z' && data[size - 1] == 'Z');
+   } else if( size == ZEROCOPY_SIZE ){
+      assert(data[0] == 'Z' && data[size - 1] == 'Z');
+   } else {
+      assert(size == 100);
+      check_msg(msg, size, 'A');
+   }
+   zc_received++;
+}
+
+void on_zc_connection(uv_stream_t *server, int status) {
+   assert(status == 0);
+   assert(uv_msg_init(client_loop, &zc_conn, UV_TCP) == 0);
+   assert(uv_accept(server, (uv_stream_t*) &zc_conn) == 0);
+   assert(uv_msg_read_start(&zc_conn, udp_alloc_buffer, on_zc_msg_received, free_buffer) == 0);
+}
+
+void on_zc_connect(uv_connect_t *connect, int status) {
+   assert(status == 0);
+   uv_stop(client_loop);
+}
+
+void on_zc_sent(send_message_t *req, int status) {
+   assert(status == 0);
+   zc_sent++;
+}
+
+void on_zc_free(void *ptr) {
+   zc_freed++;
+   free(ptr);
+}
+
+void on_zc_closed(uv_handle_t *handle) {
+   /* after the last message was released */
+   assert(zc_freed == 2 + ZEROCOPY_MESSAGES);
+   assert(zc_sent == 3 + ZEROCOPY_MESSAGES);
+   zc_closed++;
+}
+
+void test_zerocopy() {
+   struct sockaddr_in addr;
+   uv_connect_t connect;
+   char *big, small[104];
+   int rc, i;
+
+   uv_ip4_addr("127.0.0.1", ZEROCOPY_PORT, &addr);
+   assert(uv_tcp_init(client_loop, &zc_server) == 0);
+   assert(uv_tcp_bind(&zc_server, (const struct sockaddr*)&addr, 0) == 0);
+   assert(uv_listen((uv_stream_t*) &zc_server, DEFAULT_BACKLOG, on_zc_connection) == 0);
+
+   assert(uv_msg_init(client_loop, &zc_client, UV_TCP) == 0);
+   assert(uv_tcp_connect(&connect, (uv_tcp_t*)&zc_client, (const struct sockaddr*)&addr, on_zc_connect) == 0);
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+
+   rc = uv_msg_set_zerocopy(&zc_client, 64 * 1024);
+   if (rc == 0) {
+      big = malloc(ZEROCOPY_SIZE);
+      memset(big, 'Z', ZEROCOPY_SIZE);
+      create_test_msg(small, 100, 'A');
+      zc_received = zc_sent = zc_freed = 0;
+
+      /* the memory is released only after the kernel reports the completion */
+      assert(send_message(&zc_client, big, ZEROCOPY_SIZE, on_zc_free, on_zc_sent, NULL) == 0);
+      assert(zc_sent == 0 && zc_freed == 0);
+      assert(zc_client.zc_seq == 1);
+      /* a normal write after it is not reordered */
+      assert(send_message(&zc_client, small + 4, 100, UV_MSG_TRANSIENT, on_zc_sent, NULL) == 0);
+
+      while (zc_received < 2 || zc_sent < 2) {
+         if (uv_run(client_loop, UV_RUN_ONCE) == 0) break;
+      }
+      assert(zc_received == 2);
+      assert(zc_sent == 2);
+      assert(zc_freed == 1);
+      assert(zc_client.zc_queue == NULL);
+      /* the error queue is watched only while there are messages waiting */
+      assert(!uv_is_active((uv_handle_t*) zc_client.zc_poll));
+
+      /* many messages are matched with the notification ranges */
+      for (i = 0; i < ZEROCOPY_MESSAGES; i++) {
+         char *copy = malloc(ZEROCOPY_SIZE);
+         memset(copy, 'Z', ZEROCOPY_SIZE);
+         assert(send_message(&zc_client, copy, ZEROCOPY_SIZE, on_zc_free, on_zc_sent, NULL) == 0);
+      }
+      while (zc_received < 2 + ZEROCOPY_MESSAGES || zc_sent < 2 + ZEROCOPY_MESSAGES) {
+         if (uv_run(client_loop, UV_RUN_ONCE) == 0) break;
+      }
+      assert(zc_received == 2 + ZEROCOPY_MESSAGES);
+      assert(zc_sent == 2 + ZEROCOPY_MESSAGES);
+      assert(zc_freed == 1 + ZEROCOPY_MESSAGES);
+      assert(zc_client.zc_queue == NULL);
+      assert(!uv_is_active((uv_handle_t*) zc_client.zc_poll));
+
+      /* closed before the completion: the memory is kept until the kernel
+         reports it, and then the close callback is called */
+      big = malloc(ZEROCOPY_SIZE);
+      memset(big, 'Z', ZEROCOPY_SIZE);
+      assert(send_message(&zc_client, big, ZEROCOPY_SIZE, on_zc_free, on_zc_sent, NULL) == 0);
+      assert(zc_client.zc_queue != NULL);
+      zc_closed = 0;
+      uv_msg_close(&zc_client, on_zc_closed);
+      while (!zc_closed || zc_received < 3 + ZEROCOPY_MESSAGES) {
+         if (uv_run(client_loop, UV_RUN_ONCE) == 0) break;
+      }
+      assert(zc_closed == 1);
+      assert(zc_received == 3 + ZEROCOPY_MESSAGES);
+      assert(zc_client.zc_poll == NULL);
+   } else {
+      printf("zerocopy not supported: %s\n", uv_strerror(rc));
+      uv_msg_close(&zc_client, NULL);
+   }
+   uv_timer_stop(&timer);
+
+   uv_msg_close(&zc_conn, NULL);
+   uv_close((uv_handle_t*) &zc_server, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   puts("Zerocopy tests PASS!");
+
+}
+
+#endif
+
+/* Shared Memory *************************************************************/
+
+#ifndef _WIN32
+
+#define SHM_PIPENAME "/tmp/uv_msg_test.sock"
+#define SHM_MESSAGES 1000
+
+uv_pipe_t shm_server;
+uv_msg_t shm_client;
+uv_msg_t shm_conn;
+int shm_received;
+
+int shm_msg_size(int i) {
+   return 2 + (i * 37) % 120;  /* check_msg() works up to 127 bytes */
+}
+
+void on_shm_echo(uv_msg_t *socket, void *msg, int size) {
+   assert(size > 0);
+   send_message(socket, msg, size, UV_MSG_TRANSIENT, 0, 0);
+}
+
+void on_shm_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == shm_msg_size(shm_received));
+   check_msg(msg, size, 'A' + shm_received % 3);
+   shm_received++;
+   if( shm_received == SHM_MESSAGES ) uv_stop(client_loop);
+}
+
+void on_shm_connection(uv_stream_t *server, int status) {
+   assert(status == 0);
+   assert(uv_msg_init(client_loop, &shm_conn, UV_MSG_SHM) == 0);
+   assert(uv_accept(server, (uv_stream_t*) &shm_conn) == 0);
+   assert(uv_msg_read_start(&shm_conn, udp_alloc_buffer, on_shm_echo, free_buffer) == 0);
+}
+
+void on_shm_connect(uv_connect_t *connect, int status) {
+   char *buffer = malloc(4 + 128);
+   int i;
+
+   assert(status == 0);
+   assert(uv_msg_read_start(&shm_client, udp_alloc_buffer, on_shm_msg_received, free_buffer) == 0);
+
+   for (i = 0; i < SHM_MESSAGES; i++) {
+      create_test_msg(buffer, shm_msg_size(i), 'A' + i % 3);
+      assert(send_message(&shm_client, buffer + 4, shm_msg_size(i), UV_MSG_TRANSIENT, 0, 0) == 0);
+   }
+
+   free(buffer);
+}
+
+void test_shm_messages() {
+   uv_connect_t connect;
+
+   unlink(SHM_PIPENAME);
+   assert(uv_pipe_init(client_loop, &shm_server, 0) == 0);
+   assert(uv_pipe_bind(&shm_server, SHM_PIPENAME) == 0);
+   assert(uv_listen((uv_stream_t*) &shm_server, DEFAULT_BACKLOG, on_shm_connection) == 0);
+
+   /* a small ring, so the sender has to wait for free space */
+   assert(uv_msg_init(client_loop, &shm_client, UV_MSG_SHM) == 0);
+   assert(uv_msg_set_shm_size(&shm_client, 8192) == 0);
+   uv_pipe_connect(&connect, (uv_pipe_t*) &shm_client, SHM_PIPENAME, on_shm_connect);
+
+   shm_received = 0;
+   uv_timer_start(&timer, timer_cb, 5000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   assert(shm_received == SHM_MESSAGES);
+
+   uv_msg_close(&shm_client, NULL);
+   uv_msg_close(&shm_conn, NULL);
+   uv_close((uv_handle_t*) &shm_server, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   puts("Shared memory tests PASS!");
+
+}
+
+int shm_errors;
+
+void on_shm_peer_msg(uv_msg_t *socket, void *msg, int size) {
+   assert(size == UV_EPROTO);
+   shm_errors++;
+   uv_stop(client_loop);
+}
+
+/* creates a ring as a peer would, with the given header */
+struct uv_msg_ring_s * create_shm_ring(const char *name, uint32_t size) {
+   size_t len = sizeof(struct uv_msg_ring_s) + 8192;
+   struct uv_msg_ring_s *ring;
+   int fd;
+
+   shm_unlink(name);
+   fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+   assert(fd >= 0);
+   assert(ftruncate(fd, len) == 0);
+   ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   assert(ring != MAP_FAILED);
+   memset(ring, 0, len);
+   ring->size = size;
+   return ring;
+}
+
+/* sends the handshake with the name to a new socket. returns if it failed */
+int shm_peer_handshake(const char *name, const char *extra) {
+   char hello[1 + UV_MSG_SHM_NAME_LEN] = {0};
+   uv_os_sock_t fds[2];
+   uv_msg_t socket;
+
+   hello[0] = 'H';
+   strcpy(hello + 1, name);
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &socket, UV_MSG_SHM) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &socket, fds[0]) == 0);
+   assert(uv_msg_read_start(&socket, udp_alloc_buffer, on_shm_peer_msg, free_buffer) == 0);
+   assert(write(fds[1], hello, sizeof hello) == sizeof hello);
+   if (extra) assert(write(fds[1], extra, strlen(extra)) == (int) strlen(extra));
+
+   shm_errors = 0;
+   uv_timer_start(&timer, timer_cb, 200, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   uv_msg_close(&socket, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   close(fds[1]);
+   return shm_errors;
+}
+
+void test_shm_peer_checks() {
+   struct uv_msg_ring_s *ring;
+   size_t len = sizeof(struct uv_msg_ring_s) + 8192;
+   int fd;
+
+   /* the names not created by the library are not opened nor unlinked */
+   ring = create_shm_ring("/uvtest_other", 8192);
+   assert(shm_peer_handshake("/uvtest_other", NULL) == 1);
+   fd = shm_open("/uvtest_other", O_RDWR, 0600);
+   assert(fd >= 0);
+   close(fd);
+   shm_unlink("/uvtest_other");
+   munmap(ring, len);
+
+   /* the size of the ring must be a power of 2 */
+   ring = create_shm_ring("/uvmsgtest_size", 5000);
+   assert(shm_peer_handshake("/uvmsgtest_size", NULL) == 1);
+   munmap(ring, len);
+
+   /* a record larger than the ring */
+   ring = create_shm_ring("/uvmsgtest_record", 8192);
+   *(uint32_t*) (ring->data + 8) = 100000;
+   ring->tail = ring->head = 8;
+   ring->head += 64;
+   assert(shm_peer_handshake("/uvmsgtest_record", "W") == 1);
+   munmap(ring, len);
+
+   /* a head too far from the tail */
+   ring = create_shm_ring("/uvmsgtest_head", 8192);
+   ring->head = 3 * 8192;
+   assert(shm_peer_handshake("/uvmsgtest_head", "W") == 1);
+   munmap(ring, len);
+
+   puts("Shared memory peer check tests PASS!");
+
+}
+
+/* Message Ownership *********************************************************/
+
+#ifndef _WIN32
+
+#define OW_MESSAGES  12
+#define OW_RATE      8    /* messages per second */
+
+uv_msg_t ow_sender;
+uv_msg_t ow_receiver;
+uv_msg_send_t ow_reqs[OW_MESSAGES];
+int ow_msg_allocs;
+int ow_other_allocs;
+int ow_received;
+int ow_stop_at;
+
+void ow_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+   if( suggested_size == 100 ) ow_msg_allocs++; else ow_other_allocs++;
+   buf->base = (char*) malloc(suggested_size);
+   buf->len = suggested_size;
+}
+
+void ow_free_buffer(uv_handle_t* handle, void* ptr) {
+   free(ptr);
+}
+
+void on_ow_sent(uv_write_t *req, int status) {
+   assert(status == 0);
+}
+
+void on_ow_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   check_msg(msg, size, 'A' + ow_received % 3);
+   /* the buffer belongs to the application */
+   free(msg);
+   ow_received++;
+   if( ow_received == ow_stop_at ) uv_stop(client_loop);
+}
+
+void test_ownership() {
+   uv_os_sock_t fds[2];
+   char msgs[3][104];
+   uint64_t start;
+   int i;
+
+   for (i = 0; i < 3; i++) create_test_msg(msgs[i], 100, 'A' + i);
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &ow_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &ow_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &ow_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &ow_receiver, fds[1]) == 0);
+   assert(uv_msg_set_ownership(&ow_receiver, 1) == 0);
+   assert(uv_msg_read_start(&ow_receiver, ow_alloc_buffer, on_ow_msg_received, ow_free_buffer) == 0);
+
+   /* the messages arrive together, but each one is read directly on its own
+      buffer, without a read buffer */
+   ow_msg_allocs = ow_other_allocs = ow_received = 0;
+   ow_stop_at = 3;
+   for (i = 0; i < 3; i++) {
+      assert(uv_msg_send(&ow_reqs[i], &ow_sender, msgs[i] + 4, 100, on_ow_sent) == 0);
+   }
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(ow_received == 3);
+   assert(ow_msg_allocs == 3 && ow_other_allocs == 0);
+   assert(ow_receiver.buf == NULL && ow_receiver.frame == NULL);
+
+   /* the messages read on their own buffers wait for tokens too */
+   assert(uv_msg_set_recv_rate(&ow_receiver, OW_RATE, 0) == 0);
+   ow_received = 0;
+   ow_stop_at = OW_RATE;
+   for (i = 0; i < OW_MESSAGES; i++) {
+      assert(uv_msg_send(&ow_reqs[i], &ow_sender, msgs[i % 3] + 4, 100, on_ow_sent) == 0);
+   }
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(ow_received == OW_RATE);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(ow_receiver.rate_paused == 1);
+   assert(!uv_is_active((uv_handle_t*) &ow_receiver));
+   start = uv_now(client_loop);
+   ow_stop_at = OW_MESSAGES;
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(ow_received == OW_MESSAGES);
+   /* the first one can take the tokens refilled while the others were delivered */
+   assert(uv_now(client_loop) - start >= (OW_MESSAGES - OW_RATE - 1) * 1000 / OW_RATE - 20);
+   assert(uv_msg_set_recv_rate(&ow_receiver, 0, 0) == 0);
+
+   /* with read-ahead the messages read together are copied to their buffers */
+   assert(uv_msg_set_read_ahead(&ow_receiver, UV_MSG_READ_AHEAD_ALL) == 0);
+   ow_msg_allocs = ow_other_allocs = ow_received = 0;
+   ow_stop_at = 3;
+   for (i = 0; i < 3; i++) {
+      assert(uv_msg_send(&ow_reqs[i], &ow_sender, msgs[i] + 4, 100, on_ow_sent) == 0);
+   }
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(ow_received == 3);
+   assert(ow_msg_allocs == 3 && ow_other_allocs >= 1);
+
+   uv_msg_close(&ow_sender, NULL);
+   uv_msg_close(&ow_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   puts("Ownership tests PASS!");
+
+}
+
+#endif
+
+/* Read-ahead ****************************************************************/
+
+#define READ_AHEAD_MESSAGES 10
+
+uv_pipe_t ra_writer;
+uv_msg_t ra_reader;
+int ra_reads;
+int ra_received;
+
+void on_ra_capture(uv_msg_t *socket, int type, const char *data, int size) {
+   if( type != UV_MSG_CAPTURE_READ ) return;
+   ra_reads++;
+   if( ra_reads == 1 ) uv_stop(client_loop);
+}
+
+void on_ra_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   check_msg(msg, size, 'A' + ra_received % 3);
+   ra_received++;
+   if( ra_received == READ_AHEAD_MESSAGES ) uv_stop(client_loop);
+}
+
+void test_read_ahead() {
+   uv_os_sock_t fds[2];
+   char *stream_buffer;
+   int msg_size = 100, entire_msg_size = msg_size + 4, i;
+
+   stream_buffer = malloc(READ_AHEAD_MESSAGES * entire_msg_size);
+   for (i = 0; i < READ_AHEAD_MESSAGES; i++) {
+      create_test_msg(stream_buffer + i * entire_msg_size, msg_size, 'A' + i % 3);
+   }
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_pipe_init(client_loop, &ra_writer, 0) == 0);
+   assert(uv_pipe_open(&ra_writer, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &ra_reader, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &ra_reader, fds[1]) == 0);
+   assert(uv_msg_set_capture(&ra_reader, on_ra_capture, NULL) == 0);
+   assert(uv_msg_set_read_ahead(&ra_reader, -2) == UV_EINVAL);
+   assert(uv_msg_set_read_ahead(&ra_reader, UV_MSG_READ_AHEAD_ALL) == 0);
+   assert(uv_msg_read_start(&ra_reader, udp_alloc_buffer, on_ra_msg_received, free_buffer) == 0);
+
+   ra_reads = 0;
+   ra_received = 0;
+
+   /* the first read ends in the middle of the first message */
+   send_data((uv_stream_t*) &ra_writer, stream_buffer, 50);
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(ra_reads == 1);
+   assert(ra_received == 0);
+
+   /* the rest of the first message and all the others come in a single read */
+   send_data((uv_stream_t*) &ra_writer, stream_buffer + 50, READ_AHEAD_MESSAGES * entire_msg_size - 50);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(ra_received == READ_AHEAD_MESSAGES);
+   assert(ra_reads == 2);
+
+   uv_msg_close(&ra_reader, NULL);
+   uv_close((uv_handle_t*) &ra_writer, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   free(stream_buffer);
+
+   puts("Read-ahead tests PASS!");
+
+}
+
+#endif
+
+/* Flow Control **************************************************************/
+
+#ifndef _WIN32
+
+#define CREDIT_MESSAGES 20
+#define CREDIT_WINDOW 4
+
+uv_msg_t cr_sender;
+uv_msg_t cr_receiver;
+int cr_received;
+int cr_max_pending;
+
+void on_cr_msg_received(uv_msg_t *socket, void *msg, int size) {
+   /* the sender never has more than the window in flight */
+   int pending = CREDIT_MESSAGES - cr_received - cr_sender.queued;
+   if( pending > cr_max_pending ) cr_max_pending = pending;
+   assert(size == 100);
+   check_msg(msg, size, 'A' + cr_received % 3);
+   cr_received++;
+   if( cr_received == CREDIT_MESSAGES ) uv_stop(client_loop);
+}
+
+void on_cr_sender_read(uv_msg_t *socket, void *msg, int size) {
+   assert(0 && "no messages expected on the sender");
+}
+
+void test_credits() {
+   uv_os_sock_t fds[2];
+   char *stream_buffer;
+   int msg_size = 100, entire_msg_size = msg_size + 4, i;
+
+   stream_buffer = malloc(3 * entire_msg_size);
+   for (i = 0; i < 3; i++) {
+      create_test_msg(stream_buffer + i * entire_msg_size, msg_size, 'A' + i);
+   }
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &cr_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &cr_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &cr_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &cr_receiver, fds[1]) == 0);
+
+   assert(uv_msg_set_credits(&cr_sender, CREDIT_WINDOW, 64 * 1024) == 0);
+   assert(uv_msg_set_credits(&cr_receiver, CREDIT_WINDOW, 64 * 1024) == 0);
+   assert(uv_msg_read_start(&cr_sender, udp_alloc_buffer, on_cr_sender_read, free_buffer) == 0);
+   assert(uv_msg_read_start(&cr_receiver, udp_alloc_buffer, on_cr_msg_received, free_buffer) == 0);
+
+   /* nothing is sent before the receiver grants the credits */
+   for (i = 0; i < CREDIT_MESSAGES; i++) {
+      uv_msg_send_t *req = malloc(sizeof(uv_msg_send_t));
+      assert(uv_msg_send(req, &cr_sender, stream_buffer + (i % 3) * entire_msg_size + 4, msg_size, on_udp_msg_sent) == 0);
+   }
+   assert(cr_sender.queued == CREDIT_MESSAGES);
+
+   cr_received = 0;
+   cr_max_pending = 0;
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   assert(cr_received == CREDIT_MESSAGES);
+   assert(cr_max_pending <= CREDIT_WINDOW);
+   assert(cr_sender.queued == 0);
+
+   uv_msg_close(&cr_sender, NULL);
+   uv_msg_close(&cr_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   free(stream_buffer);
+
+   puts("Flow control tests PASS!");
+
+}
+
+#endif
+
+/* Message Batching **********************************************************/
+
+#ifndef _WIN32
+
+#define BATCH_MESSAGES 20
+#define BATCH_BIG_MSG  10   /* this one is too big to be batched */
+
+uv_msg_t bt_sender;
+uv_msg_t bt_receiver;
+int bt_received;
+int bt_sent;
+int bt_first_is_batch = -1;
+
+void on_bt_capture(uv_msg_t *socket, int type, const char *data, int size) {
+   if( type != UV_MSG_CAPTURE_READ || bt_first_is_batch >= 0 ) return;
+   bt_first_is_batch = (((unsigned char*)data)[0] & 0x80) && data[4] == 'B';
+}
+
+void on_bt_msg_received(uv_msg_t *socket, void *msg, int size) {
+   if( bt_received == BATCH_BIG_MSG ){
+      char *data = msg;
+      assert(size == 1000);
+      assert(data[0] == 'B' && data[998] == 'B' && data[999] == 0);
+   } else {
+      assert(size == 100);
+      check_msg(msg, size, 'A' + bt_received % 3);
+   }
+   bt_received++;
+   if( bt_received == BATCH_MESSAGES ) uv_stop(client_loop);
+}
+
+void on_bt_msg_sent(uv_write_t *req, int status) {
+   assert(status == 0);
+   bt_sent++;
+   free(req);
+}
+
+void test_batching() {
+   uv_os_sock_t fds[2];
+   char *stream_buffer, *big;
+   int msg_size = 100, entire_msg_size = msg_size + 4, i;
+
+   stream_buffer = malloc(3 * entire_msg_size);
+   for (i = 0; i < 3; i++) {
+      create_test_msg(stream_buffer + i * entire_msg_size, msg_size, 'A' + i);
+   }
+   big = malloc(1004);
+   create_test_msg(big, 1000, 'B');
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &bt_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &bt_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &bt_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &bt_receiver, fds[1]) == 0);
+
+   /* the batch must fit at least 2 messages */
+   assert(uv_msg_set_batching(&bt_sender, 500, 600) == UV_EINVAL);
+   assert(uv_msg_set_batching(&bt_sender, 500, 0) == 0);
+   assert(uv_msg_set_capture(&bt_receiver, on_bt_capture, NULL) == 0);
+   assert(uv_msg_read_start(&bt_receiver, udp_alloc_buffer, on_bt_msg_received, free_buffer) == 0);
+
+   for (i = 0; i < BATCH_MESSAGES; i++) {
+      uv_msg_send_t *req = malloc(sizeof(uv_msg_send_t));
+      if( i == BATCH_BIG_MSG ){
+         assert(uv_msg_send(req, &bt_sender, big + 4, 1000, on_bt_msg_sent) == 0);
+      } else {
+         assert(uv_msg_send(req, &bt_sender, stream_buffer + (i % 3) * entire_msg_size + 4, msg_size, on_bt_msg_sent) == 0);
+      }
+   }
+   /* the big message flushed the first ones. the others wait for the end of the tick */
+   assert(bt_sender.batch != NULL);
+
+   bt_received = 0;
+   bt_sent = 0;
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   assert(bt_received == BATCH_MESSAGES);
+   assert(bt_sent == BATCH_MESSAGES);
+   assert(bt_first_is_batch == 1);
+
+   uv_msg_close(&bt_sender, NULL);
+   uv_msg_close(&bt_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   free(stream_buffer);
+   free(big);
+
+   puts("Batching tests PASS!");
+
+}
+
+#endif
+
+/* Connection Migration ******************************************************/
+
+#ifndef _WIN32
+
+uv_loop_t mg_loop;
+uv_timer_t mg_timer;
+uv_msg_t mg_reader;
+uv_msg_t mg_reader2;
+int mg_received;
+int mg_closed;
+int mg_sent;
+
+void on_mg_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   check_msg(msg, size, 'A' + mg_received);
+   /* the data member is kept */
+   assert(socket->data == &mg_received);
+   mg_received++;
+   uv_stop(((uv_handle_t*)socket)->loop);
+}
+
+void on_mg_sent(uv_write_t *req, int status) {
+   assert(status == 0);
+   mg_sent++;
+}
+
+void on_mg_closed(uv_handle_t *handle) {
+   mg_closed++;
+}
+
+void on_mg_timeout(uv_timer_t *handle) {
+   uv_stop(handle->loop);
+}
+
+void test_migration() {
+   uv_msg_migration_t *migration;
+   uv_msg_send_t req;
+   uv_os_sock_t fds[2];
+   char *stream_buffer;
+   int entire_msg_size = 104, i;
+
+   stream_buffer = malloc(3 * entire_msg_size);
+   for (i = 0; i < 3; i++) {
+      create_test_msg(stream_buffer + i * entire_msg_size, 100, 'A' + i);
+   }
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &mg_reader, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &mg_reader, fds[1]) == 0);
+   assert(uv_msg_read_start(&mg_reader, udp_alloc_buffer, on_mg_msg_received, free_buffer) == 0);
+   mg_reader.data = &mg_received;
+
+   /* the first message and part of the second one */
+   mg_received = 0;
+   assert(write(fds[0], stream_buffer, entire_msg_size + 50) == entire_msg_size + 50);
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(mg_received == 1);
+   assert(mg_reader.filled == 50);
+
+   /* not while a write waits for its callback */
+   mg_sent = 0;
+   assert(uv_msg_send(&req, &mg_reader, stream_buffer + 4, 100, on_mg_sent) == 0);
+   assert(uv_stream_get_write_queue_size((uv_stream_t*) &mg_reader) == 0);
+   assert(uv_msg_export(&mg_reader, on_mg_closed, &migration) == UV_EBUSY);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(mg_sent == 1);
+
+   /* move the connection to another loop */
+   mg_closed = 0;
+   assert(uv_msg_export(&mg_reader, on_mg_closed, &migration) == 0);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(mg_closed == 1);
+
+   assert(uv_loop_init(&mg_loop) == 0);
+   assert(uv_msg_import(&mg_loop, &mg_reader2, migration) == 0);
+   assert(mg_reader2.filled == 50);
+
+   /* the rest of the second message and the third one */
+   assert(write(fds[0], stream_buffer + entire_msg_size + 50, 2 * entire_msg_size - 50) == 2 * entire_msg_size - 50);
+   uv_timer_init(&mg_loop, &mg_timer);
+   uv_timer_start(&mg_timer, on_mg_timeout, 2000, 0);
+   while (mg_received < 3 && uv_is_active((uv_handle_t*) &mg_timer)) {
+      uv_run(&mg_loop, UV_RUN_DEFAULT);
+   }
+   assert(mg_received == 3);
+
+   uv_close((uv_handle_t*) &mg_timer, NULL);
+   uv_msg_close(&mg_reader2, NULL);
+   uv_run(&mg_loop, UV_RUN_DEFAULT);
+   assert(uv_loop_close(&mg_loop) == 0);
+   close(fds[0]);
+   free(stream_buffer);
+
+   puts("Migration tests PASS!");
+
+}
+
+/* two loops on their own threads. the sockets start on the first one, where
+   they receive 5, 10, 15 and 20 messages on each round */
+
+#define BL_SOCKETS  4
+
+uv_msg_balancer_t bl_balancer;
+uv_loop_t bl_loops[2];
+uv_timer_t bl_writer_timer;
+uv_timer_t bl_stop_timers[2];
+uv_pipe_t bl_writers[BL_SOCKETS];
+uv_msg_t bl_sockets[BL_SOCKETS];
+uv_msg_t bl_moved[2][BL_SOCKETS];
+int bl_closed[BL_SOCKETS];
+int bl_arrived[2];
+int bl_received[2];
+char bl_frame[104];
+
+void on_bl_msg_received(uv_msg_t *socket, void *msg, int size) {
+   if (size < 0) return;
+   assert(size == 100);
+   check_msg(msg, size, 'B');
+   bl_received[((uv_handle_t*)socket)->loop == &bl_loops[1]]++;
+}
+
+void on_bl_closed(uv_handle_t *handle) {
+   int i;
+   for (i = 0; i < BL_SOCKETS; i++) {
+      if (handle == (uv_handle_t*) &bl_sockets[i]) bl_closed[i] = 1;
+   }
+}
+
+void on_bl_arrive(uv_loop_t *loop, uv_msg_migration_t *migration) {
+   int n = loop == &bl_loops[1];
+   assert(bl_arrived[n] < BL_SOCKETS);
+   assert(uv_msg_import(loop, &bl_moved[n][bl_arrived[n]++], migration) == 0);
+}
+
+void on_bl_written(uv_write_t *req, int status) {
+   free(req);
+}
+
+void on_bl_write_timer(uv_timer_t *handle) {
+   int i, j;
+   for (i = 0; i < BL_SOCKETS; i++) {
+      for (j = 0; j < (i + 1) * 5; j++) {
+         uv_write_t *req = malloc(sizeof(uv_write_t));
+         uv_buf_t buf = uv_buf_init(bl_frame, sizeof(bl_frame));
+         assert(uv_write(req, (uv_stream_t*) &bl_writers[i], &buf, 1, on_bl_written) == 0);
+      }
+   }
+}
+
+void on_bl_stop(uv_timer_t *handle) {
+   uv_msg_balancer_leave(&bl_balancer, handle->loop);
+   uv_stop(handle->loop);
+}
+
+void bl_thread_a(void *arg) {
+   uv_os_sock_t fds[2];
+   int i;
+
+   assert(uv_msg_balancer_join(&bl_balancer, &bl_loops[0]) == 0);
+   for (i = 0; i < BL_SOCKETS; i++) {
+      assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+      assert(uv_pipe_init(&bl_loops[0], &bl_writers[i], 0) == 0);
+      assert(uv_pipe_open(&bl_writers[i], fds[0]) == 0);
+      assert(uv_msg_init(&bl_loops[0], &bl_sockets[i], UV_NAMED_PIPE) == 0);
+      assert(uv_pipe_open((uv_pipe_t*) &bl_sockets[i], fds[1]) == 0);
+      assert(uv_msg_read_start(&bl_sockets[i], udp_alloc_buffer, on_bl_msg_received, free_buffer) == 0);
+      assert(uv_msg_balancer_add(&bl_balancer, &bl_sockets[i]) == 0);
+   }
+   uv_timer_init(&bl_loops[0], &bl_writer_timer);
+   uv_timer_start(&bl_writer_timer, on_bl_write_timer, 5, 5);
+   uv_timer_init(&bl_loops[0], &bl_stop_timers[0]);
+   uv_timer_start(&bl_stop_timers[0], on_bl_stop, 800, 0);
+   uv_run(&bl_loops[0], UV_RUN_DEFAULT);
+}
+
+void bl_thread_b(void *arg) {
+   uv_sem_t *joined = arg;
+
+   assert(uv_msg_balancer_join(&bl_balancer, &bl_loops[1]) == 0);
+   uv_timer_init(&bl_loops[1], &bl_stop_timers[1]);
+   uv_timer_start(&bl_stop_timers[1], on_bl_stop, 800, 0);
+   uv_sem_post(joined);
+   uv_run(&bl_loops[1], UV_RUN_DEFAULT);
+}
+
+void test_balancer() {
+   uv_thread_t threads[2];
+   uv_sem_t joined;
+   int i, j;
+
+   create_test_msg(bl_frame, 100, 'B');
+   assert(uv_loop_init(&bl_loops[0]) == 0);
+   assert(uv_loop_init(&bl_loops[1]) == 0);
+   assert(uv_msg_balancer_init(&bl_balancer, 50, 20, on_bl_arrive, on_bl_closed) == 0);
+   assert(uv_sem_init(&joined, 0) == 0);
+
+   /* the busy loop moves its busiest socket to the idle one, where it keeps
+      receiving the messages */
+   assert(uv_thread_create(&threads[1], bl_thread_b, &joined) == 0);
+   uv_sem_wait(&joined);
+   assert(uv_thread_create(&threads[0], bl_thread_a, NULL) == 0);
+   uv_thread_join(&threads[0]);
+   uv_thread_join(&threads[1]);
+   uv_sem_destroy(&joined);
+
+   assert(bl_arrived[1] >= 1);
+   assert(bl_closed[BL_SOCKETS - 1] == 1);
+   assert(bl_received[1] > 0);
+   assert(bl_received[0] > 0);
+
+   /* the loops are released on this thread */
+   for (i = 0; i < BL_SOCKETS; i++) {
+      if (!uv_is_closing((uv_handle_t*) &bl_sockets[i])) uv_msg_close(&bl_sockets[i], NULL);
+      uv_close((uv_handle_t*) &bl_writers[i], NULL);
+   }
+   for (i = 0; i < 2; i++) {
+      for (j = 0; j < bl_arrived[i]; j++) {
+         if (!uv_is_closing((uv_handle_t*) &bl_moved[i][j])) uv_msg_close(&bl_moved[i][j], NULL);
+      }
+      uv_close((uv_handle_t*) &bl_stop_timers[i], NULL);
+   }
+   uv_close((uv_handle_t*) &bl_writer_timer, NULL);
+   for (i = 0; i < 2; i++) {
+      uv_run(&bl_loops[i], UV_RUN_DEFAULT);
+      assert(uv_loop_close(&bl_loops[i]) == 0);
+   }
+   uv_msg_balancer_free(&bl_balancer);
+   /* the client loop did not run while the threads did */
+   uv_update_time(client_loop);
+
+   puts("Load balancer tests PASS!");
+
+}
+
+#endif
+
+/* Memory Limits *************************************************************/
+
+#ifndef _WIN32
+
+uv_msg_t ml_reader;
+int ml_errors;
+
+void on_ml_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == UV_ENOBUFS);
+   ml_errors++;
+}
+
+void test_memory_limit() {
+   uv_msg_send_t req;
+   uv_os_sock_t fds[2];
+   char partial[54];
+
+   /* a big message that is not complete keeps its read buffer */
+   *(int*)partial = htonl(100000);
+   memset(partial + 4, 'M', 50);
+
+   assert(uv_msg_set_memory_limit(client_loop, 2000, 1000) == UV_EINVAL);
+   assert(uv_msg_set_memory_limit(client_loop, 1000, 0) == 0);
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &ml_reader, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &ml_reader, fds[1]) == 0);
+   assert(uv_msg_read_start(&ml_reader, udp_alloc_buffer, on_ml_msg_received, free_buffer) == 0);
+
+   /* above the soft limit the reading is paused */
+   ml_errors = 0;
+   assert(write(fds[0], partial, sizeof partial) == sizeof partial);
+   uv_timer_start(&timer, timer_cb, 300, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(ml_reader.memory_used > 1000);
+   assert(ml_reader.memory_state == UV_MSG_MEMORY_PAUSED);
+   assert(!uv_is_active((uv_handle_t*) &ml_reader));
+
+   /* and resumed when the limit is removed */
+   assert(uv_msg_set_memory_limit(client_loop, 0, 0) == 0);
+   assert(ml_reader.memory_state == 0);
+   assert(uv_is_active((uv_handle_t*) &ml_reader));
+
+   /* above the hard limit the sends are rejected and the socket using more
+      memory receives an error */
+   assert(uv_msg_set_memory_limit(client_loop, 1000, 50000) == 0);
+   uv_timer_start(&timer, timer_cb, 300, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(ml_errors == 1);
+   assert(ml_reader.memory_state == UV_MSG_MEMORY_SHED);
+   assert(uv_msg_send(&req, &ml_reader, partial + 4, 50, NULL) == UV_ENOBUFS);
+
+   assert(uv_msg_set_memory_limit(client_loop, 0, 0) == 0);
+   assert(ml_errors == 1);
+   uv_msg_close(&ml_reader, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   close(fds[0]);
+
+   puts("Memory limit tests PASS!");
+
+}
+
+#endif
+
+/* Delivery Budget ***********************************************************/
+
+#ifndef _WIN32
+
+#define RB_MESSAGES  25
+#define RB_BUDGET    3
+
+uv_msg_t rb_reader;
+uv_check_t rb_check;
+int rb_iterations;
+int rb_iteration[RB_MESSAGES];
+int rb_received;
+int rb_burst;
+int rb_eof;
+
+void on_rb_check(uv_check_t *handle) {
+   rb_iterations++;
+}
+
+void on_rb_msg_received(uv_msg_t *socket, void *msg, int size) {
+   if( size == UV_EOF ){
+      rb_eof = 1;
+      uv_stop(client_loop);
+      return;
+   }
+   assert(size == 100);
+   assert(rb_received < RB_MESSAGES);
+   check_msg(msg, size, 'A' + rb_received % 3);
+   if( rb_received > 0 && rb_iteration[rb_received - 1] == rb_iterations ){
+      rb_burst++;
+   } else {
+      rb_burst = 1;
+   }
+   /* the deferred messages are delivered on the next iterations, with the
+      reading stopped */
+   assert(rb_burst <= RB_BUDGET);
+   if( rb_received % 10 > 0 && rb_received < 20 && rb_burst == 1 ){
+      assert(!uv_is_active((uv_handle_t*) socket));
+   }
+   rb_iteration[rb_received++] = rb_iterations;
+   if( rb_received == 10 || rb_received == 20 ) uv_stop(client_loop);
+}
+
+void test_read_budget() {
+   uv_os_sock_t fds[2];
+   char *stream_buffer, *batch, *ptr;
+   unsigned int header;
+   int entire_msg_size = 104, batch_size = 5 + 10 * 101, i;
+
+   stream_buffer = malloc(RB_MESSAGES * entire_msg_size);
+   for (i = 0; i < RB_MESSAGES; i++) {
+      create_test_msg(stream_buffer + i * entire_msg_size, 100, 'A' + i % 3);
+   }
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &rb_reader, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &rb_reader, fds[1]) == 0);
+   assert(uv_msg_set_read_budget(&rb_reader, -1, 0) == UV_EINVAL);
+   assert(uv_msg_set_read_budget(&rb_reader, RB_BUDGET, 0) == 0);
+   assert(uv_msg_read_start(&rb_reader, udp_alloc_buffer, on_rb_msg_received, free_buffer) == 0);
+   uv_check_init(client_loop, &rb_check);
+   uv_check_start(&rb_check, on_rb_check);
+
+   /* 10 messages on a single read are delivered 3 per loop iteration */
+   rb_received = 0;
+   rb_iterations = 0;
+   rb_eof = 0;
+   assert(write(fds[0], stream_buffer, 10 * entire_msg_size) == 10 * entire_msg_size);
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(rb_received == 10);
+   assert(rb_iteration[9] - rb_iteration[0] == 3);
+   /* the reading is resumed when the buffer is drained */
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(rb_reader.deferred == 0);
+   assert(uv_is_active((uv_handle_t*) &rb_reader));
+
+   /* the messages of a batch are also delivered 3 per loop iteration */
+   batch = malloc(batch_size);
+   header = htonl(0x80000000 | (batch_size - 4));
+   memcpy(batch, &header, 4);
+   batch[4] = 'B';
+   for (i = 0, ptr = batch + 5; i < 10; i++, ptr += 101) {
+      ptr[0] = 100;
+      memcpy(ptr + 1, stream_buffer + (10 + i) * entire_msg_size + 4, 100);
+   }
+   assert(write(fds[0], batch, batch_size) == batch_size);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(rb_received == 20);
+   assert(rb_iteration[19] - rb_iteration[10] == 3);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(rb_reader.deferred == 0);
+   assert(uv_is_active((uv_handle_t*) &rb_reader));
+   free(batch);
+
+   /* the messages received before the end of the stream are delivered first.
+      the application can hold them by pausing the reading */
+   assert(uv_msg_read_pause(&rb_reader, 1) == 0);
+   assert(!uv_is_active((uv_handle_t*) &rb_reader));
+   assert(write(fds[0], stream_buffer + 20 * entire_msg_size, 5 * entire_msg_size) == 5 * entire_msg_size);
+   close(fds[0]);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(rb_received == 20);
+   assert(uv_msg_read_pause(&rb_reader, 0) == 0);
+   assert(uv_is_active((uv_handle_t*) &rb_reader));
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(rb_received == RB_MESSAGES);
+   assert(rb_eof == 1);
+
+   uv_close((uv_handle_t*) &rb_check, NULL);
+   uv_msg_close(&rb_reader, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   free(stream_buffer);
+
+   puts("Delivery budget tests PASS!");
+
+}
+
+#endif
+
+/* Write Completions *********************************************************/
+
+#ifndef _WIN32
+
+#define WC_MESSAGES  10
+
+uv_msg_t wc_sender;
+uv_msg_t wc_receiver;
+uv_loop_t wc_loop;
+int wc_received;
+int wc_sent;
+int wc_freed;
+
+void on_wc_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   check_msg(msg, size, 'A');
+   if( ++wc_received == WC_MESSAGES ) uv_stop(client_loop);
+}
+
+void on_wc_sent(send_message_t *req, int status) {
+   assert(status == 0);
+   /* the callbacks of the pass run before the messages are released */
+   assert(wc_freed == 0);
+   wc_sent++;
+}
+
+void on_wc_free(void *ptr) {
+   assert(wc_sent == WC_MESSAGES);
+   wc_freed++;
+   free(ptr);
+}
+
+int wc_plain_sent;
+
+void on_wc_plain_sent(send_message_t *req, int status) {
+   assert(status == 0);
+   wc_plain_sent++;
+}
+
+void test_write_completions() {
+   uv_os_sock_t fds[2];
+   char msg[104];
+   send_message_loop_t *ctx;
+   int pooled, i;
+
+   create_test_msg(msg, 100, 'A');
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &wc_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &wc_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_receiver, fds[1]) == 0);
+   /* the batch completes all the messages together */
+   assert(uv_msg_set_batching(&wc_sender, 500, 0) == 0);
+   assert(send_message_use_pool(&wc_sender) == 0);
+   assert(uv_msg_read_start(&wc_receiver, udp_alloc_buffer, on_wc_msg_received, free_buffer) == 0);
+
+   wc_received = wc_sent = wc_freed = 0;
+   for (i = 0; i < WC_MESSAGES; i++) {
+      char *copy = malloc(100);
+      memcpy(copy, msg + 4, 100);
+      assert(send_message(&wc_sender, copy, 100, on_wc_free, on_wc_sent, NULL) == 0);
+   }
+   ctx = (send_message_loop_t *) uv_msg_hook_get(&wc_sender, send_message_complete_all, NULL, 0);
+   assert(ctx != NULL);
+   pooled = ctx->pooled;
+
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   while (wc_freed < WC_MESSAGES && uv_run(client_loop, UV_RUN_ONCE) != 0);
+   uv_timer_stop(&timer);
+   assert(wc_received == WC_MESSAGES);
+   assert(wc_sent == WC_MESSAGES);
+   assert(wc_freed == WC_MESSAGES);
+
+   /* the requests return to the pool of the loop and are reused */
+   assert(ctx->completed_count == 0);
+   assert(ctx->pooled == pooled + WC_MESSAGES);
+   for (i = 0; i < WC_MESSAGES; i++) {
+      assert(send_message(&wc_sender, msg + 4, 100, UV_MSG_STATIC, NULL, NULL) == 0);
+   }
+   assert(ctx->pooled == pooled);
+
+   uv_msg_close(&wc_sender, NULL);
+   uv_msg_close(&wc_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   /* the loop state is released with the last socket closed */
+   assert(uv_loop_init(&wc_loop) == 0);
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(&wc_loop, &wc_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_sender, fds[0]) == 0);
+   assert(uv_msg_init(&wc_loop, &wc_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_receiver, fds[1]) == 0);
+   assert(uv_msg_set_batching(&wc_sender, 500, 0) == 0);
+   assert(send_message_use_pool(&wc_sender) == 0);
+   for (i = 0; i < WC_MESSAGES; i++) {
+      assert(send_message(&wc_sender, msg + 4, 100, UV_MSG_TRANSIENT, NULL, NULL) == 0);
+   }
+   assert(wc_sender.msg_loop != NULL);
+   uv_run(&wc_loop, UV_RUN_NOWAIT);
+   uv_msg_close(&wc_sender, NULL);
+   uv_msg_close(&wc_receiver, NULL);
+   uv_run(&wc_loop, UV_RUN_DEFAULT);
+   assert(uv_loop_close(&wc_loop) == 0);
+
+   /* without the pool the socket is not linked to the loop and uv_close is enough */
+   assert(uv_loop_init(&wc_loop) == 0);
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(&wc_loop, &wc_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_sender, fds[0]) == 0);
+   assert(uv_msg_init(&wc_loop, &wc_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_receiver, fds[1]) == 0);
+   assert(uv_msg_read_start(&wc_receiver, udp_alloc_buffer, on_wc_msg_received, free_buffer) == 0);
+   wc_received = wc_plain_sent = 0;
+   assert(send_message(&wc_sender, msg + 4, 100, UV_MSG_STATIC, NULL, NULL) == 0);
+   assert(send_message(&wc_sender, msg + 4, 100, UV_MSG_TRANSIENT, on_wc_plain_sent, NULL) == 0);
+   /* the callback is not called before returning */
+   assert(wc_plain_sent == 0);
+   assert(wc_sender.msg_loop == NULL);
+   while (wc_received < 2 && uv_run(&wc_loop, UV_RUN_ONCE) != 0);
+   assert(wc_plain_sent == 1);
+   assert(wc_received == 2);
+   uv_close((uv_handle_t*) &wc_sender, NULL);
+   uv_close((uv_handle_t*) &wc_receiver, NULL);
+   uv_run(&wc_loop, UV_RUN_DEFAULT);
+   assert(uv_loop_close(&wc_loop) == 0);
+
+   puts("Write completion tests PASS!");
+
+}
+
+#define PW_SIZE  (2 * 1024 * 1024)
+
+int pw_sent;
+int pw_status;
+int pw_received;
+int pw_eof;
+
+void on_pw_msg_received(uv_msg_t *socket, void *msg, int size) {
+   unsigned char *data = msg;
+   int i;
+   if( size < 0 ){
+      pw_eof = size;
+      uv_stop(client_loop);
+      return;
+   }
+   if( size == 100 ){
+      check_msg(msg, size, 'A');
+   } else {
+      assert(size == PW_SIZE);
+      for (i = 0; i < size; i += 4093) assert(data[i] == (unsigned char) (i % 251));
+      assert(data[size - 1] == (unsigned char) ((size - 1) % 251));
+   }
+   if( ++pw_received == 2 ) uv_stop(client_loop);
+}
+
+void on_pw_sent(send_message_t *req, int status) {
+   pw_status = status;
+   pw_sent++;
+}
+
+void test_partial_write() {
+   uv_os_sock_t fds[2];
+   char msg[104];
+   char *big;
+   int i;
+
+   create_test_msg(msg, 100, 'A');
+   big = malloc(PW_SIZE);
+   for (i = 0; i < PW_SIZE; i++) big[i] = (char) (i % 251);
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &wc_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &wc_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_receiver, fds[1]) == 0);
+   assert(uv_msg_read_start(&wc_receiver, udp_alloc_buffer, on_pw_msg_received, free_buffer) == 0);
+   /* the messages with a callback are written at once only with the pool */
+   assert(send_message_use_pool(&wc_sender) == 0);
+
+   /* written at once, reported on the completion pass */
+   pw_sent = pw_received = 0;
+   pw_status = -1;
+   assert(send_message(&wc_sender, msg + 4, 100, UV_MSG_TRANSIENT, on_pw_sent, NULL) == 0);
+   assert(uv_stream_get_write_queue_size((uv_stream_t*) &wc_sender) == 0);
+   assert(pw_sent == 0);
+
+   /* the socket buffer takes only the start of it. the rest is accounted as
+      in flight until it is written */
+   assert(send_message(&wc_sender, big, PW_SIZE, UV_MSG_STATIC, on_pw_sent, NULL) == 0);
+   assert(uv_stream_get_write_queue_size((uv_stream_t*) &wc_sender) > 0);
+   assert(uv_stream_get_write_queue_size((uv_stream_t*) &wc_sender) < PW_SIZE + 4);
+   assert(wc_sender.inflight == PW_SIZE + 4);
+
+   uv_timer_start(&timer, timer_cb, 5000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   while (pw_sent < 2 && uv_run(client_loop, UV_RUN_ONCE) != 0);
+   uv_timer_stop(&timer);
+   assert(pw_received == 2);
+   assert(pw_sent == 2 && pw_status == 0);
+   assert(wc_sender.inflight == 0);
+
+   /* when the rest cannot be sent the stream is shut down, so the peer does
+      not read the next frames as part of it */
+   pw_eof = 0;
+   i = try_write_message(&wc_sender, big, PW_SIZE);
+   assert(i > 0 && i < PW_SIZE + 4);
+   uv_msg_write_fail(&wc_sender);   /* as if the rest failed */
+   assert(send_message(&wc_sender, msg + 4, 100, UV_MSG_STATIC, NULL, NULL) == UV_EPIPE);
+   uv_timer_start(&timer, timer_cb, 5000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(pw_eof == UV_EOF);
+   assert(pw_received == 2);
+
+   uv_msg_close(&wc_sender, NULL);
+   uv_msg_close(&wc_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   free(big);
+
+   puts("Partial write tests PASS!");
+
+}
+
+#endif
+
+/* Transient Messages ********************************************************/
+
+#ifndef _WIN32
+
+#define TM_LARGE  (UV_MSG_INLINE_SIZE + 100)
+
+char tm_expected[TM_LARGE + 4];
+int tm_inline[2];
+int tm_sent;
+int tm_received;
+
+void on_tm_first_sent(uv_write_t *req, int status) {
+   assert(status == 0);
+}
+
+void on_tm_sent(send_message_t *req, int status) {
+   assert(status == 0);
+   /* the small message was copied inside the request */
+   tm_inline[tm_sent++] = (req->msg == req->inline_msg);
+}
+
+void on_tm_msg_received(uv_msg_t *socket, void *msg, int size) {
+   static const int sizes[3] = { 100, 100, TM_LARGE };
+   assert(size == sizes[tm_received]);
+   if( size == TM_LARGE ){
+      assert(memcmp(msg, tm_expected + 4, size) == 0);
+   } else {
+      check_msg(msg, size, 'A' + tm_received);
+   }
+   if( ++tm_received == 3 ) uv_stop(client_loop);
+}
+
+void test_transient_messages() {
+   uv_msg_send_t first;
+   uv_os_sock_t fds[2];
+   char msg[104];
+   char small[104];
+   char large[TM_LARGE + 4];
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &wc_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &wc_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_receiver, fds[1]) == 0);
+   /* the messages after the first wait on the queue */
+   assert(uv_msg_set_max_inflight(&wc_sender, 1) == 0);
+   assert(uv_msg_read_start(&wc_receiver, udp_alloc_buffer, on_tm_msg_received, free_buffer) == 0);
+
+   create_test_msg(msg, 100, 'A');
+   create_test_msg(small, 100, 'B');
+   create_test_msg(large, TM_LARGE, 'C');
+   memcpy(tm_expected, large, sizeof(large));
+   tm_sent = tm_received = 0;
+   assert(uv_msg_send(&first, &wc_sender, msg + 4, 100, on_tm_first_sent) == 0);
+   assert(send_message(&wc_sender, small + 4, 100, UV_MSG_TRANSIENT, on_tm_sent, NULL) == 0);
+   assert(send_message(&wc_sender, large + 4, TM_LARGE, UV_MSG_TRANSIENT, on_tm_sent, NULL) == 0);
+   assert(wc_sender.queued == 2);
+
+   /* the caller can reuse the buffers at once */
+   memset(small, 0, sizeof(small));
+   memset(large, 0, sizeof(large));
+
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   while (tm_sent < 2 && uv_run(client_loop, UV_RUN_ONCE) != 0);
+   uv_timer_stop(&timer);
+   assert(tm_received == 3);
+   assert(tm_sent == 2);
+   assert(tm_inline[0] == 1 && tm_inline[1] == 0);
+
+   uv_msg_close(&wc_sender, NULL);
+   uv_msg_close(&wc_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   puts("Transient message tests PASS!");
+
+}
+
+#endif
+
+/* Broadcast *****************************************************************/
+
+#ifndef _WIN32
+
+#define BC_BIG_SIZE  (2 * 1024 * 1024)
+
+uv_msg_t bc_senders[3];
+uv_msg_t bc_receivers[3];
+char bc_order[3][4];
+int bc_num[3];
+int bc_received;
+int bc_freed;
+
+void on_bc_free(void *ptr) {
+   bc_freed++;
+}
+
+void on_bc_msg_received(uv_msg_t *socket, void *msg, int size) {
+   int i = socket - bc_receivers;
+   if( size < 0 ) return;
+   if( size == BC_BIG_SIZE ){
+      bc_order[i][bc_num[i]++] = 'Z';
+   } else {
+      assert(size == 100);
+      check_msg(msg, size, ((char*)msg)[0]);
+      bc_order[i][bc_num[i]++] = ((char*)msg)[0];
+   }
+   if( ++bc_received == 8 ) uv_stop(client_loop);
+}
+
+void test_broadcast() {
+   uv_msg_t *sockets[4];
+   uv_os_sock_t fds[2];
+   char msg[104];
+   char *big;
+   int i;
+
+   for (i = 0; i < 3; i++) {
+      assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+      assert(uv_msg_init(client_loop, &bc_senders[i], UV_NAMED_PIPE) == 0);
+      assert(uv_pipe_open((uv_pipe_t*) &bc_senders[i], fds[0]) == 0);
+      assert(uv_msg_init(client_loop, &bc_receivers[i], UV_NAMED_PIPE) == 0);
+      assert(uv_pipe_open((uv_pipe_t*) &bc_receivers[i], fds[1]) == 0);
+      assert(uv_msg_read_start(&bc_receivers[i], udp_alloc_buffer, on_bc_msg_received, free_buffer) == 0);
+      bc_num[i] = 0;
+   }
+   /* the NULL entries are skipped */
+   sockets[0] = &bc_senders[0];
+   sockets[1] = NULL;
+   sockets[2] = &bc_senders[1];
+   sockets[3] = &bc_senders[2];
+   bc_received = bc_freed = 0;
+
+   assert(broadcast_message(sockets, 4, NULL, 100, UV_MSG_STATIC, 0) == UV_EINVAL);
+
+   /* a transient message is copied once */
+   create_test_msg(msg, 100, 'A');
+   assert(broadcast_message(sockets, 4, msg + 4, 100, UV_MSG_TRANSIENT, 0) == 3);
+   memset(msg, 0, sizeof(msg));
+
+   /* the sockets with a backlog above the limit are skipped */
+   big = malloc(BC_BIG_SIZE);
+   memset(big, 'Z', BC_BIG_SIZE);
+   assert(send_message(&bc_senders[1], big, BC_BIG_SIZE, free, NULL, NULL) == 0);
+   assert(uv_stream_get_write_queue_size((uv_stream_t*) &bc_senders[1]) > 0);
+   create_test_msg(msg, 100, 'B');
+   assert(broadcast_message(sockets, 4, msg + 4, 100, on_bc_free, 1) == 2);
+
+   /* and the closing ones too. this one is queued behind the big message */
+   uv_msg_close(&bc_senders[2], NULL);
+   create_test_msg(msg, 100, 'C');
+   assert(broadcast_message(sockets, 4, msg + 4, 100, UV_MSG_TRANSIENT, 0) == 2);
+   memset(msg, 0, sizeof(msg));
+
+   uv_timer_start(&timer, timer_cb, 5000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(bc_received == 8);
+   assert(bc_num[0] == 3 && memcmp(bc_order[0], "ABC", 3) == 0);
+   assert(bc_num[1] == 3 && memcmp(bc_order[1], "AZC", 3) == 0);
+   assert(bc_num[2] == 2 && memcmp(bc_order[2], "AB", 2) == 0);
+   /* the message is released once */
+   assert(bc_freed == 1);
+
+   for (i = 0; i < 3; i++) {
+      if (i != 2) uv_msg_close(&bc_senders[i], NULL);
+      uv_msg_close(&bc_receivers[i], NULL);
+   }
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   puts("Broadcast tests PASS!");
+
+}
+
+#endif
+
+/* Publish/Subscribe *********************************************************/
+
+#ifndef _WIN32
+
+pubsub_t ps_broker;
+uv_msg_t ps_clients[2];
+uv_msg_t ps_conns[2];       /* the broker side of the connections */
+char ps_received[2][4][16];
+int ps_num[2];
+int ps_processed;
+int ps_delivered;
+int ps_stop_at;
+
+void ps_check_stop() {
+   if( ps_processed + ps_delivered == ps_stop_at ) uv_stop(client_loop);
+}
+
+void on_ps_broker_received(uv_msg_t *socket, void *msg, int size) {
+   if( size < 0 ) return;
+   assert(pubsub_on_message(&ps_broker, socket, msg, size) == 0);
+   ps_processed++;
+   ps_check_stop();
+}
+
+void on_ps_client_received(uv_msg_t *socket, void *msg, int size) {
+   int i = socket - ps_clients;
+   char *topic, *payload;
+   int payload_size;
+
+   if( size < 0 ) return;
+   assert(pubsub_parse(msg, size, &topic, &payload, &payload_size) == 0);
+   assert(strlen(topic) + 1 + payload_size < sizeof(ps_received[0][0]));
+   sprintf(ps_received[i][ps_num[i]++], "%s:%.*s", topic, payload_size, payload);
+   ps_delivered++;
+   ps_check_stop();
+}
+
+void run_pubsub(int stop_at) {
+   ps_stop_at = stop_at;
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   if( ps_processed + ps_delivered < ps_stop_at ) uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(ps_processed + ps_delivered == ps_stop_at);
+}
+
+void test_pubsub() {
+   uv_os_sock_t fds[2];
+   char name[16];
+   int i;
+
+   assert(pubsub_init(&ps_broker) == 0);
+   for (i = 0; i < 2; i++) {
+      assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+      assert(uv_msg_init(client_loop, &ps_clients[i], UV_NAMED_PIPE) == 0);
+      assert(uv_pipe_open((uv_pipe_t*) &ps_clients[i], fds[0]) == 0);
+      assert(uv_msg_init(client_loop, &ps_conns[i], UV_NAMED_PIPE) == 0);
+      assert(uv_pipe_open((uv_pipe_t*) &ps_conns[i], fds[1]) == 0);
+      assert(uv_msg_read_start(&ps_clients[i], udp_alloc_buffer, on_ps_client_received, free_buffer) == 0);
+      assert(uv_msg_read_start(&ps_conns[i], udp_alloc_buffer, on_ps_broker_received, free_buffer) == 0);
+      ps_num[i] = 0;
+   }
+   ps_processed = ps_delivered = 0;
+
+   /* the malformed messages are rejected */
+   assert(pubsub_on_message(&ps_broker, &ps_conns[0], "S", 1) == UV_EPROTO);
+   assert(pubsub_on_message(&ps_broker, &ps_conns[0], "S\0", 2) == UV_EPROTO);
+   assert(pubsub_on_message(&ps_broker, &ps_conns[0], "Snews", 5) == UV_EPROTO);
+   assert(pubsub_on_message(&ps_broker, &ps_conns[0], "Xnews", 6) == UV_EPROTO);
+
+   assert(pubsub_send_subscribe(&ps_clients[0], "news") == 0);
+   assert(pubsub_send_subscribe(&ps_clients[0], "sport") == 0);
+   assert(pubsub_send_subscribe(&ps_clients[1], "news") == 0);
+   run_pubsub(3);
+   assert(ps_broker.topics_count == 2);
+   /* the two sockets and their three subscriptions */
+   assert(ps_broker.subs_count == 5);
+   assert(pubsub_subscribe(&ps_broker, &ps_conns[1], "news") == 0);
+   assert(ps_broker.subs_count == 5);
+
+   /* a publication reaches only the subscribers of its topic */
+   assert(pubsub_send_publish(&ps_clients[1], "news", "hello", 5) == 0);
+   run_pubsub(6);
+   assert(pubsub_send_publish(&ps_clients[1], "sport", "goal", 4) == 0);
+   assert(pubsub_send_publish(&ps_clients[1], "weather", "rain", 4) == 0);
+   run_pubsub(9);
+   assert(ps_num[0] == 2 && ps_num[1] == 1);
+   assert(strcmp(ps_received[0][0], "news:hello") == 0);
+   assert(strcmp(ps_received[0][1], "sport:goal") == 0);
+   assert(strcmp(ps_received[1][0], "news:hello") == 0);
+   assert(pubsub_route(&ps_broker, "weather", "Pweather", 9) == 0);
+
+   /* unsubscribing drops the topics without subscribers */
+   assert(pubsub_send_unsubscribe(&ps_clients[0], "sport") == 0);
+   run_pubsub(10);
+   assert(ps_broker.topics_count == 1 && ps_broker.subs_count == 4);
+   pubsub_remove(&ps_broker, &ps_conns[1]);
+   assert(ps_broker.topics_count == 1 && ps_broker.subs_count == 2);
+   assert(pubsub_send_publish(&ps_clients[1], "news", "again", 5) == 0);
+   run_pubsub(12);
+   assert(ps_num[0] == 3 && ps_num[1] == 1);
+   assert(strcmp(ps_received[0][2], "news:again") == 0);
+
+   /* the tables grow */
+   for (i = 0; i < 200; i++) {
+      sprintf(name, "topic%d", i);
+      assert(pubsub_subscribe(&ps_broker, &ps_conns[0], name) == 0);
+   }
+   assert(ps_broker.topics_count == 201 && ps_broker.subs_count == 202);
+   assert(ps_broker.topics_size >= 201 && ps_broker.subs_size >= 202);
+   assert(pubsub_route(&ps_broker, "topic150", "Ptopic150", 10) == 1);
+   pubsub_remove(&ps_broker, &ps_conns[0]);
+   assert(ps_broker.topics_count == 0 && ps_broker.subs_count == 0);
+
+   for (i = 0; i < 2; i++) {
+      uv_msg_close(&ps_clients[i], NULL);
+      uv_msg_close(&ps_conns[i], NULL);
+   }
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   pubsub_free(&ps_broker);
+
+   puts("Publish/subscribe tests PASS!");
+
+}
+
+#endif
+
+/* Tracepoints ***************************************************************/
+
+#if !defined(_WIN32) && !defined(UV_MSG_USDT)
+
+int tp_received;
+
+void on_tp_sent(uv_write_t *req, int status) {
+   assert(status == 0);
+}
+
+void on_tp_msg_received(uv_msg_t *socket, void *msg, int size) {
+   if( size < 0 ) return;
+   assert(size == 100);
+   if( ++tp_received == 2 ) uv_stop(client_loop);
+}
+
+void test_tracepoints() {
+   uv_msg_send_t req;
+   uv_os_sock_t fds[2];
+   char msg[104];
+
+   create_test_msg(msg, 100, 'A');
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &wc_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &wc_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &wc_receiver, fds[1]) == 0);
+   assert(uv_msg_read_start(&wc_receiver, udp_alloc_buffer, on_tp_msg_received, free_buffer) == 0);
+
+   probe_frame_parsed = probe_frame_delivered = probe_buffer_alloc = probe_buffer_realloc = 0;
+   probe_buffer_free = probe_buffer_move = probe_write_queued = probe_write_completed = 0;
+   tp_received = 0;
+
+   /* the direct write and the fast path */
+   assert(uv_msg_send(&req, &wc_sender, msg + 4, 100, on_tp_sent) == 0);
+   assert(send_message(&wc_sender, msg + 4, 100, UV_MSG_STATIC, NULL, NULL) == 0);
+   assert(probe_write_queued == 2);
+
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(tp_received == 2);
+   assert(probe_write_completed == 2);
+   assert(probe_frame_parsed == 2 && probe_frame_delivered == 2);
+   assert(probe_buffer_alloc >= 1);
+
+   uv_msg_close(&wc_sender, NULL);
+   uv_msg_close(&wc_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   /* the read buffers are released with the socket */
+   assert(probe_buffer_free == probe_buffer_alloc);
+
+   puts("Tracepoint tests PASS!");
+
+}
+
+#endif
+
+/* Outbound Journal **********************************************************/
+
+#ifndef _WIN32
+
+#define JOURNAL_PATH  "/tmp/uv_msg_test.journal"
+
+uv_msg_t jn_sender;
+uv_msg_t jn_receiver;
+uv_msg_t jn_moved;
+int jn_received;
+uint64_t jn_seqs[8];
+
+void on_jn_msg_received(uv_msg_t *socket, void *msg, int size) {
+   if( size < 0 ) return;
+   assert(size == 100);
+   jn_seqs[jn_received++] = socket->recv_seq;
+   uv_stop(client_loop);
+}
+
+/* runs the loop until the receiver has the messages and the journal has the
+   acknowledgements */
+void run_journal(msg_journal_t *journal, int received, int pending) {
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   while ((jn_received < received || msg_journal_pending(journal) > pending) &&
+          uv_is_active((uv_handle_t*) &timer)) {
+      uv_run(client_loop, UV_RUN_ONCE);
+   }
+   uv_timer_stop(&timer);
+}
+
+void open_journal_connection(uv_os_sock_t fds[2]) {
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &jn_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &jn_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &jn_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &jn_receiver, fds[1]) == 0);
+   assert(uv_msg_set_acks(&jn_receiver, 1) == 0);
+   assert(uv_msg_read_start(&jn_receiver, udp_alloc_buffer, on_jn_msg_received, free_buffer) == 0);
+   /* the acknowledgements are read by the sender */
+   assert(uv_msg_read_start(&jn_sender, udp_alloc_buffer, on_jn_msg_received, free_buffer) == 0);
+}
+
+void test_journal() {
+   msg_journal_t *journal;
+   uv_msg_migration_t *migration;
+   uv_msg_t acker = {0};
+   uv_os_sock_t fds[2];
+   char msg[104];
+   int i;
+
+   create_test_msg(msg, 100, 'J');
+   unlink(JOURNAL_PATH);
+   assert(msg_journal_open(&journal, JOURNAL_PATH, 50) == UV_EINVAL);
+   unlink(JOURNAL_PATH);
+   assert(msg_journal_open(&journal, JOURNAL_PATH, 64 * 1024) == 0);
+
+   /* the acknowledged messages are dropped from the journal */
+   open_journal_connection(fds);
+   assert(msg_journal_attach(journal, &jn_sender) == 0);
+   jn_received = 0;
+   for (i = 0; i < 3; i++) {
+      assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   }
+   assert(msg_journal_pending(journal) == 3);
+   run_journal(journal, 3, 0);
+   assert(jn_received == 3);
+   assert(jn_seqs[0] == 0 && jn_seqs[2] == 2);
+   assert(msg_journal_pending(journal) == 0);
+
+   /* the connection is lost. the messages are kept on the journal */
+   msg_journal_detach(journal);
+   uv_msg_close(&jn_sender, NULL);
+   uv_msg_close(&jn_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   for (i = 0; i < 2; i++) {
+      assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   }
+   assert(msg_journal_pending(journal) == 2);
+
+   /* and they survive the process */
+   msg_journal_close(journal);
+   assert(msg_journal_open(&journal, JOURNAL_PATH, 0) == 0);
+   assert(msg_journal_pending(journal) == 2);
+
+   /* they are sent again on the next connection, with their numbers */
+   open_journal_connection(fds);
+   assert(msg_journal_attach(journal, &jn_sender) == 0);
+   run_journal(journal, 5, 0);
+   assert(jn_received == 5);
+   assert(jn_seqs[3] == 3 && jn_seqs[4] == 4);
+   assert(msg_journal_pending(journal) == 0);
+
+   /* the journal moves with a migrated socket. closing the exported one does
+      not detach it */
+   assert(uv_msg_export(&jn_sender, NULL, &migration) == 0);
+   assert(jn_sender.ack_cb == NULL && journal->socket == &jn_sender);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(uv_msg_import(client_loop, &jn_moved, migration) == 0);
+   assert(jn_moved.ack_cb == msg_journal_on_ack && jn_moved.ack_data == journal);
+   assert(msg_journal_attach(journal, &jn_moved) == 0);
+   assert(journal->socket == &jn_moved);
+   assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   run_journal(journal, 6, 0);
+   assert(jn_received == 6);
+   assert(jn_seqs[5] == 5);
+   assert(msg_journal_pending(journal) == 0);
+
+   /* closing the socket detaches it. the journal can be closed while its
+      writes complete */
+   assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   uv_msg_close(&jn_moved, NULL);
+   assert(jn_moved.ack_cb == NULL && journal->socket == NULL);
+   assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   uv_msg_close(&jn_receiver, NULL);
+   assert(journal->inflight == 1);
+   msg_journal_close(journal);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   unlink(JOURNAL_PATH);
+
+   /* the file is used as a ring */
+   assert(msg_journal_open(&journal, JOURNAL_PATH, sizeof(msg_journal_header_t) +
+          3 * MSG_JOURNAL_RECORD_SIZE(100) + sizeof(msg_journal_record_t)) == 0);
+   for (i = 0; i < 3; i++) {
+      assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   }
+   assert(msg_journal_send(journal, msg + 4, 100) == UV_ENOBUFS);
+   /* acknowledges the first two, as the socket would */
+   acker.ack_data = journal;
+   msg_journal_on_ack(&acker, 2);
+   assert(msg_journal_pending(journal) == 1);
+   assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   assert(journal->header->head < journal->header->tail);
+   /* the head does not reach the tail */
+   assert(msg_journal_send(journal, msg + 4, 100) == UV_ENOBUFS);
+   msg_journal_on_ack(&acker, 3);
+   assert(journal->header->tail == sizeof(msg_journal_header_t));
+   assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   assert(msg_journal_pending(journal) == 2);
+
+   /* the messages are sent again across the end of the file */
+   jn_received = 0;
+   open_journal_connection(fds);
+   assert(msg_journal_attach(journal, &jn_sender) == 0);
+   run_journal(journal, 2, 0);
+   assert(jn_received == 2);
+   assert(jn_seqs[0] == 3 && jn_seqs[1] == 4);
+   assert(msg_journal_pending(journal) == 0);
+
+   uv_msg_close(&jn_sender, NULL);
+   uv_msg_close(&jn_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   msg_journal_close(journal);
+   unlink(JOURNAL_PATH);
+
+   /* a corrupted file is refused: a record past the end of the file, an
+      empty one in the middle, and one out of order */
+   for (i = 0; i < 3; i++) {
+      msg_journal_record_t *record;
+      assert(msg_journal_open(&journal, JOURNAL_PATH, 64 * 1024) == 0);
+      assert(msg_journal_send(journal, msg + 4, 100) == 0);
+      assert(msg_journal_send(journal, msg + 4, 100) == 0);
+      record = msg_journal_record(journal, sizeof(msg_journal_header_t) + MSG_JOURNAL_RECORD_SIZE(100));
+      if (i == 0) record->size = 64 * 1024;
+      if (i == 1) record->size = 0;
+      if (i == 2) record->seq = 7;
+      assert(msg_journal_attach(journal, &acker) == UV_EINVAL);
+      msg_journal_close(journal);
+      assert(msg_journal_open(&journal, JOURNAL_PATH, 0) == UV_EINVAL);
+      unlink(JOURNAL_PATH);
+   }
+
+   /* and when it is corrupted while in use the acknowledgement drops the
+      messages that cannot be found */
+   assert(msg_journal_open(&journal, JOURNAL_PATH, 64 * 1024) == 0);
+   assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   assert(msg_journal_send(journal, msg + 4, 100) == 0);
+   msg_journal_record(journal, sizeof(msg_journal_header_t))->size = 0;
+   acker.ack_data = journal;
+   msg_journal_on_ack(&acker, 1);
+   assert(msg_journal_pending(journal) == 0);
+   msg_journal_close(journal);
+   unlink(JOURNAL_PATH);
+
+   puts("Journal tests PASS!");
+
+}
+
+#endif
+
+/* Message Peeking ***********************************************************/
+
+#ifndef _WIN32
+
+#define PK_PEEK_SIZE  8
+#define PK_BIG_SIZE   (1024 * 1024)
+#define PK_MID_SIZE   (300 * 1024)
+
+uv_pipe_t pk_writer;
+uv_msg_t pk_reader;
+uv_write_t pk_write_req;
+char pk_peeked[8];
+int pk_peeks;
+char pk_received[8];
+int pk_num_received;
+int pk_aborted;
+size_t pk_max_alloc;
+
+void pk_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+   if( suggested_size > pk_max_alloc ) pk_max_alloc = suggested_size;
+   buf->base = (char*) malloc(suggested_size);
+   buf->len = suggested_size;
+}
+
+int on_pk_peek(uv_msg_t *socket, int size, const char *data, int len) {
+   assert(len == (size < PK_PEEK_SIZE ? size : PK_PEEK_SIZE));
+   pk_peeked[pk_peeks++] = data[0];
+   if( data[0] == 'X' || data[0] == 'Y' ) return UV_MSG_SKIP;
+   if( data[0] == 'Z' ) return UV_MSG_CLOSE;
+   return UV_MSG_DELIVER;
+}
+
+void on_pk_msg_received(uv_msg_t *socket, void *msg, int size) {
+   if( size == UV_ECONNABORTED ){
+      pk_aborted = 1;
+      uv_stop(client_loop);
+      return;
+   }
+   if( size == 100 ) check_msg(msg, size, ((char*)msg)[0]);
+   else assert(size == PK_MID_SIZE && ((char*)msg)[size - 1] == 0);
+   pk_received[pk_num_received++] = ((char*)msg)[0];
+}
+
+void test_peek() {
+   uv_os_sock_t fds[2];
+   char letters[] = "AYXCDZE";
+   int sizes[] = { 100, 100, PK_BIG_SIZE, 100, PK_MID_SIZE, 100, 100 };
+   char *stream_buffer, *ptr;
+   char batch[5 + 5 * 101];
+   unsigned int header;
+   uv_buf_t buf;
+   int total = 0, i;
+
+   for (i = 0; i < 7; i++) total += sizes[i] + 4;
+   ptr = stream_buffer = malloc(total);
+   for (i = 0; i < 7; i++) {
+      create_test_msg(ptr, sizes[i], letters[i]);
+      ptr += sizes[i] + 4;
+   }
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_pipe_init(client_loop, &pk_writer, 0) == 0);
+   assert(uv_pipe_open(&pk_writer, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &pk_reader, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &pk_reader, fds[1]) == 0);
+   assert(uv_msg_set_peek(&pk_reader, on_pk_peek, -1) == UV_EINVAL);
+   assert(uv_msg_set_peek(&pk_reader, on_pk_peek, PK_PEEK_SIZE) == 0);
+   assert(uv_msg_read_start(&pk_reader, pk_alloc_buffer, on_pk_msg_received, free_buffer) == 0);
+
+   pk_peeks = 0;
+   pk_num_received = 0;
+   pk_aborted = 0;
+   pk_max_alloc = 0;
+
+   buf = uv_buf_init(stream_buffer, total);
+   assert(uv_write(&pk_write_req, (uv_stream_t*) &pk_writer, &buf, 1, NULL) == 0);
+   uv_timer_start(&timer, timer_cb, 5000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   /* each message is peeked once. the skipped ones are not delivered and the
+      reading stops on the rejected one */
+   assert(pk_peeks == 6 && memcmp(pk_peeked, "AYXCDZ", 6) == 0);
+   assert(pk_num_received == 3 && memcmp(pk_received, "ACD", 3) == 0);
+   assert(pk_aborted == 1);
+   assert(!uv_is_active((uv_handle_t*) &pk_reader));
+   assert(uv_msg_read_start(&pk_reader, pk_alloc_buffer, on_pk_msg_received, free_buffer) == UV_ECONNABORTED);
+   /* the skipped big message was not buffered */
+   assert(pk_max_alloc >= PK_MID_SIZE + 4 && pk_max_alloc < PK_BIG_SIZE);
+
+   uv_msg_close(&pk_reader, NULL);
+   uv_close((uv_handle_t*) &pk_writer, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   /* the messages of a batch are also peeked, one by one */
+   header = htonl(0x80000000 | (sizeof batch - 4));
+   memcpy(batch, &header, 4);
+   batch[4] = 'B';
+   for (i = 0, ptr = batch + 5; i < 5; i++, ptr += 101) {
+      ptr[0] = 100;
+      create_test_msg(stream_buffer, 100, "AXCZE"[i]);
+      memcpy(ptr + 1, stream_buffer + 4, 100);
+   }
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &pk_reader, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &pk_reader, fds[1]) == 0);
+   assert(uv_msg_set_peek(&pk_reader, on_pk_peek, PK_PEEK_SIZE) == 0);
+   assert(uv_msg_read_start(&pk_reader, pk_alloc_buffer, on_pk_msg_received, free_buffer) == 0);
+   pk_peeks = 0;
+   pk_num_received = 0;
+   pk_aborted = 0;
+   assert(write(fds[0], batch, sizeof batch) == sizeof batch);
+   uv_timer_start(&timer, timer_cb, 5000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(pk_peeks == 4 && memcmp(pk_peeked, "AXCZ", 4) == 0);
+   assert(pk_num_received == 2 && memcmp(pk_received, "AC", 2) == 0);
+   assert(pk_aborted == 1);
+
+   uv_msg_close(&pk_reader, NULL);
+   close(fds[0]);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   free(stream_buffer);
+
+   puts("Message peeking tests PASS!");
+
+}
+
+#endif
+
+/* Send Cancellation ********************************************************/
+
+#ifndef _WIN32
+
+#define SC_BIG_SIZE  (8 * 1024 * 1024)
+
+uv_msg_t sc_sender;
+uv_msg_t sc_receiver;
+uv_msg_send_t sc_reqs[5];
+int sc_status[7];
+int sc_completed;
+char sc_received[8];
+int sc_num_received;
+
+void on_sc_sent(uv_write_t *req, int status) {
+   sc_status[(uv_msg_send_t*) req - sc_reqs] = status;
+   sc_completed++;
+}
+
+void on_sc_message_sent(send_message_t *req, int status) {
+   sc_status[req->data ? 6 : 5] = status;
+   sc_completed++;
+}
+
+void on_sc_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   check_msg(msg, size, ((char*)msg)[0]);
+   sc_received[sc_num_received++] = ((char*)msg)[0];
+   if( sc_num_received == 4 ) uv_stop(client_loop);
+}
+
+void test_send_cancel() {
+   uv_os_sock_t fds[2];
+   char msgs[6][104];
+   send_message_t *req, *late;
+   char *big;
+   int i;
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &sc_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &sc_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &sc_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &sc_receiver, fds[1]) == 0);
+   /* a single message is written at a time, the others wait on the queue */
+   assert(uv_msg_set_max_inflight(&sc_sender, 1) == 0);
+   assert(uv_msg_read_start(&sc_receiver, udp_alloc_buffer, on_sc_msg_received, free_buffer) == 0);
+
+   sc_completed = 0;
+   sc_num_received = 0;
+   for (i = 0; i < 5; i++) {
+      create_test_msg(msgs[i], 100, 'A' + i);
+      assert(uv_msg_send(&sc_reqs[i], &sc_sender, msgs[i] + 4, 100, on_sc_sent) == 0);
+   }
+   assert(send_message_cancellable(&sc_sender, UV_MSG_PRIO_NORMAL, msgs[0] + 4, 100, UV_MSG_STATIC,
+                                   NULL, NULL, &req) == UV_EINVAL);
+   assert(send_message_cancellable(&sc_sender, UV_MSG_PRIO_NORMAL, msgs[0] + 4, 100, UV_MSG_STATIC,
+                                   on_sc_message_sent, NULL, &req) == 0);
+   assert(req != NULL);
+   create_test_msg(msgs[5], 100, 'F');
+   assert(send_message_cancellable(&sc_sender, UV_MSG_PRIO_NORMAL, msgs[5] + 4, 100, UV_MSG_STATIC,
+                                   on_sc_message_sent, &late, &late) == 0);
+   assert(late != NULL);
+   assert(sc_sender.queued == 6);
+
+   /* the first message is already on the transport */
+   assert(uv_msg_send_cancel(&sc_reqs[0]) == UV_EBUSY);
+   assert(uv_msg_send_timeout(&sc_reqs[0], 1) == UV_EBUSY);
+   /* the callback of a cancelled message is called at once */
+   assert(uv_msg_send_cancel(&sc_reqs[2]) == 0);
+   assert(sc_completed == 1 && sc_status[2] == UV_ECANCELED);
+   assert(uv_msg_send_cancel(&sc_reqs[2]) == UV_EBUSY);
+   /* the handle is cleared, so a late cancel finds nothing */
+   assert(send_message_cancel(&req) == 0);
+   assert(req == NULL);
+   assert(send_message_cancel(&req) == UV_ENOENT);
+   assert(send_message_timeout(&req, 1) == UV_ENOENT);
+   assert(sc_sender.queued == 4);
+   assert(send_message_timeout(&late, 1000) == 0);
+   /* this one expires while waiting */
+   assert(uv_msg_send_timeout(&sc_reqs[3], 1) == 0);
+   usleep(5000);
+
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   while (sc_completed < 7 && uv_run(client_loop, UV_RUN_ONCE) != 0);
+   uv_timer_stop(&timer);
+
+   assert(sc_num_received == 4 && memcmp(sc_received, "ABEF", 4) == 0);
+   assert(sc_completed == 7);
+   assert(sc_status[0] == 0 && sc_status[1] == 0 && sc_status[4] == 0);
+   assert(sc_status[3] == UV_ETIMEDOUT);
+   assert(sc_status[5] == UV_ECANCELED);
+   /* the written message cannot be cancelled */
+   assert(sc_status[6] == 0);
+   assert(late == NULL);
+   assert(send_message_cancel(&late) == UV_ENOENT);
+   assert(sc_sender.queued == 0 && sc_sender.queued_bytes == 0);
+
+   uv_msg_close(&sc_sender, NULL);
+   uv_msg_close(&sc_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   /* a queue that is not moving still expires its messages, from any position.
+      the receiver does not read, so the big message is never completed */
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &sc_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &sc_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &sc_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &sc_receiver, fds[1]) == 0);
+   assert(uv_msg_set_max_inflight(&sc_sender, 1) == 0);
+   big = malloc(SC_BIG_SIZE);
+   memset(big, 'X', SC_BIG_SIZE);
+   memset(sc_status, 1, sizeof(sc_status));
+   sc_completed = 0;
+   assert(uv_msg_send(&sc_reqs[0], &sc_sender, big, SC_BIG_SIZE, on_sc_sent) == 0);
+   for (i = 1; i < 4; i++) {
+      assert(uv_msg_send(&sc_reqs[i], &sc_sender, msgs[i] + 4, 100, on_sc_sent) == 0);
+   }
+   assert(sc_sender.queued == 3);
+   assert(uv_msg_send_timeout(&sc_reqs[2], 20) == 0);
+   uv_timer_start(&timer, timer_cb, 200, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(sc_completed == 1 && sc_status[2] == UV_ETIMEDOUT);
+   assert(sc_sender.queued == 2 && sc_sender.queue[UV_MSG_PRIO_NORMAL] == &sc_reqs[1]);
+   assert(sc_reqs[1].next == &sc_reqs[3] && sc_reqs[3].prev == &sc_reqs[1]);
+   assert(!uv_is_active((uv_handle_t*) sc_sender.send_timer));
+
+   uv_msg_close(&sc_sender, NULL);
+   uv_msg_close(&sc_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(sc_completed == 4);
+   assert(sc_status[1] == UV_ECANCELED && sc_status[3] == UV_ECANCELED);
+   free(big);
+
+   puts("Send cancellation tests PASS!");
+
+}
+
+#endif
+
+/* Rate Limits ***************************************************************/
+
+#ifndef _WIN32
+
+#define RL_RATE      100   /* messages per second */
+#define RL_MESSAGES  110
+
+uv_msg_t rl_sender;
+uv_msg_t rl_receiver;
+uv_msg_send_t rl_reqs[RL_MESSAGES];
+int rl_received;
+int rl_stop_at;
+
+void on_rl_sent(uv_write_t *req, int status) {
+   assert(status == 0);
+}
+
+void on_rl_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   check_msg(msg, size, 'A' + rl_received % 3);
+   rl_received++;
+   if( rl_received == rl_stop_at ) uv_stop(client_loop);
+}
+
+void test_rate_limit() {
+   uv_os_sock_t fds[2];
+   char msgs[3][104];
+   uint64_t start;
+   int i;
+
+   for (i = 0; i < 3; i++) create_test_msg(msgs[i], 100, 'A' + i);
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &rl_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &rl_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &rl_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &rl_receiver, fds[1]) == 0);
+   assert(uv_msg_set_recv_rate(&rl_receiver, RL_RATE, 0) == 0);
+   assert(uv_msg_read_start(&rl_receiver, udp_alloc_buffer, on_rl_msg_received, free_buffer) == 0);
+
+   /* the receiver delivers a full bucket and stops reading */
+   rl_received = 0;
+   rl_stop_at = RL_RATE;
+   for (i = 0; i < RL_MESSAGES; i++) {
+      assert(uv_msg_send(&rl_reqs[i], &rl_sender, msgs[i % 3] + 4, 100, on_rl_sent) == 0);
+   }
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(rl_received == RL_RATE);
+   assert(rl_receiver.rate_paused == 1);
+   assert(!uv_is_active((uv_handle_t*) &rl_receiver));
+
+   /* the others are delivered as the tokens are refilled */
+   start = uv_now(client_loop);
+   rl_stop_at = RL_MESSAGES;
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   assert(rl_received == RL_MESSAGES);
+   assert(uv_now(client_loop) - start >= (RL_MESSAGES - RL_RATE) * 1000 / RL_RATE - 20);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   assert(rl_receiver.rate_paused == 0);
+
+   /* the sender keeps the messages without tokens on its queue */
+   assert(uv_msg_set_recv_rate(&rl_receiver, 0, 0) == 0);
+   assert(uv_msg_set_send_rate(&rl_sender, RL_RATE, 1000 * 1000) == 0);
+   rl_received = 0;
+   for (i = 0; i < RL_MESSAGES; i++) {
+      assert(uv_msg_send(&rl_reqs[i], &rl_sender, msgs[i % 3] + 4, 100, on_rl_sent) == 0);
+   }
+   assert(rl_sender.queued == RL_MESSAGES - RL_RATE);
+   start = uv_now(client_loop);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(rl_received == RL_MESSAGES);
+   assert(rl_sender.queued == 0);
+   assert(uv_now(client_loop) - start >= (RL_MESSAGES - RL_RATE) * 1000 / RL_RATE - 20);
+
+   uv_msg_close(&rl_sender, NULL);
+   uv_msg_close(&rl_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   puts("Rate limit tests PASS!");
+
+}
+
+#endif
+
+/* Traffic Capture ***********************************************************/
+
+#ifndef _WIN32
+
+#define CP_FILE  "test_capture.tmp"
+
+uv_msg_t cp_sender;
+uv_msg_t cp_receiver;
+uv_msg_send_t cp_reqs[3];
+int cp_received;
+
+void on_cp_sent(uv_write_t *req, int status) {
+   assert(status == 0);
+}
+
+void on_cp_msg_received(uv_msg_t *socket, void *msg, int size) {
+   assert(size == 100);
+   check_msg(msg, size, 'A' + cp_received);
+   cp_received++;
+   if( cp_received == 3 ) uv_stop(client_loop);
+}
+
+void test_capture() {
+   uv_os_sock_t fds[2];
+   msg_capture_record_t *records;
+   char msgs[3][104];
+   char stream[3 * 104];
+   int count, total, i;
+
+   for (i = 0; i < 3; i++) create_test_msg(msgs[i], 100, 'A' + i);
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_msg_init(client_loop, &cp_sender, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &cp_sender, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &cp_receiver, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &cp_receiver, fds[1]) == 0);
+   assert(msg_capture_start(&cp_sender, CP_FILE) == 0);
+   assert(msg_capture_start(&cp_sender, CP_FILE) == UV_EINVAL);
+   assert(uv_msg_read_start(&cp_receiver, udp_alloc_buffer, on_cp_msg_received, free_buffer) == 0);
+
+   cp_received = 0;
+   for (i = 0; i < 3; i++) {
+      if( i == 1 ){
+         /* written directly to the socket, and also recorded and counted */
+         unsigned int activity = cp_sender.activity;
+         assert(send_message(&cp_sender, msgs[i] + 4, 100, UV_MSG_STATIC, NULL, NULL) == 0);
+         assert(cp_sender.activity == activity + 1);
+         continue;
+      }
+      assert(uv_msg_send(&cp_reqs[i], &cp_sender, msgs[i] + 4, 100, on_cp_sent) == 0);
+   }
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(cp_received == 3);
+   msg_capture_stop(&cp_sender);
+   assert(cp_sender.capture_cb == NULL);
+
+   /* the sent messages are recorded without the length header */
+   count = msg_capture_load(CP_FILE, UV_MSG_CAPTURE_SEND, &records);
+   assert(count == 3);
+   for (i = 0; i < 3; i++) {
+      assert(records[i].type == UV_MSG_CAPTURE_SEND);
+      assert(records[i].size == 100);
+      assert(memcmp(records[i].data, msgs[i] + 4, 100) == 0);
+      if( i > 0 ) assert(records[i].time >= records[i-1].time);
+   }
+   msg_capture_free(records, count);
+   assert(msg_capture_load(CP_FILE, UV_MSG_CAPTURE_READ, &records) == 0);
+
+   /* the reads are recorded with the chunk sizes returned by the socket */
+   assert(msg_capture_start(&cp_receiver, CP_FILE) == 0);
+   cp_received = 0;
+   for (i = 0; i < 3; i++) {
+      assert(uv_msg_send(&cp_reqs[i], &cp_sender, msgs[i] + 4, 100, on_cp_sent) == 0);
+   }
+   uv_timer_start(&timer, timer_cb, 2000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+   assert(cp_received == 3);
+   msg_capture_stop(&cp_receiver);
+
+   count = msg_capture_load(CP_FILE, 0, &records);
+   assert(count > 0);
+   total = 0;
+   for (i = 0; i < count; i++) {
+      assert(records[i].type == UV_MSG_CAPTURE_READ);
+      assert(total + records[i].size <= (int) sizeof(stream));
+      memcpy(stream + total, records[i].data, records[i].size);
+      total += records[i].size;
+   }
+   msg_capture_free(records, count);
+   assert(total == 3 * 104);
+   for (i = 0; i < 3; i++) {
+      assert(memcmp(stream + i * 104, msgs[i], 104) == 0);
+   }
+
+   assert(msg_capture_load("no-such-file.tmp", 0, &records) == UV_ENOENT);
+   remove(CP_FILE);
+
+   uv_msg_close(&cp_sender, NULL);
+   uv_msg_close(&cp_receiver, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+
+   puts("Traffic capture tests PASS!");
+
+}
+
+#endif
+
+/* Mapped Buffers ************************************************************/
+
+#ifdef __linux__
+
+#define MMAP_BIG_SIZE  (384 * 1024)
+
+uv_pipe_t mm_writer;
+uv_msg_t mm_reader;
+uv_write_t mm_write_req;
+int mm_received;
+
+void on_mm_msg_received(uv_msg_t *socket, void *msg, int size) {
+   char *data = msg;
+   if( mm_received == 1 ){
+      /* the big message is read on a mapped buffer */
+      assert(size == MMAP_BIG_SIZE);
+      assert(socket->buf_mapped == 1);
+      assert(data[0] == 'B' && data[size / 2] == 'B' && data[size - 1] == 0);
+   } else {
+      assert(size == 100);
+      check_msg(msg, size, 'A' + mm_received);
+   }
+   mm_received++;
+   if( mm_received == 3 ) uv_stop(client_loop);
+}
+
+void test_mmap_buffers() {
+   uv_os_sock_t fds[2];
+   char *stream_buffer, *big;
+   uv_buf_t buf;
+   int entire_msg_size = 104;
+
+   stream_buffer = malloc(2 * entire_msg_size);
+   create_test_msg(stream_buffer, 100, 'A');
+   create_test_msg(stream_buffer + entire_msg_size, 100, 'C');
+   big = malloc(MMAP_BIG_SIZE + 4);
+   memset(big + 4, 'B', MMAP_BIG_SIZE);
+   big[MMAP_BIG_SIZE + 3] = 0;
+   *(int*)big = htonl(MMAP_BIG_SIZE);
+
+   assert(uv_socketpair(SOCK_STREAM, 0, fds, 0, 0) == 0);
+   assert(uv_pipe_init(client_loop, &mm_writer, 0) == 0);
+   assert(uv_pipe_open(&mm_writer, fds[0]) == 0);
+   assert(uv_msg_init(client_loop, &mm_reader, UV_NAMED_PIPE) == 0);
+   assert(uv_pipe_open((uv_pipe_t*) &mm_reader, fds[1]) == 0);
+   assert(uv_msg_set_mmap_threshold(&mm_reader, 256 * 1024, UV_MSG_MMAP_HUGEPAGES) == 0);
+   assert(uv_msg_read_start(&mm_reader, udp_alloc_buffer, on_mm_msg_received, free_buffer) == 0);
+
+   mm_received = 0;
+   send_data((uv_stream_t*) &mm_writer, stream_buffer, entire_msg_size);
+   buf = uv_buf_init(big, MMAP_BIG_SIZE + 4);
+   assert(uv_write(&mm_write_req, (uv_stream_t*) &mm_writer, &buf, 1, NULL) == 0);
+   send_data((uv_stream_t*) &mm_writer, stream_buffer + entire_msg_size, entire_msg_size);
+   uv_timer_start(&timer, timer_cb, 5000, 0);
+   uv_run(client_loop, UV_RUN_DEFAULT);
+   uv_timer_stop(&timer);
+
+   assert(mm_received == 3);
+   /* the mapped buffer is released after the big message */
+   assert(mm_reader.buf_mapped == 0 || mm_reader.alloc_size < 256 * 1024);
+
+   uv_msg_close(&mm_reader, NULL);
+   uv_close((uv_handle_t*) &mm_writer, NULL);
+   uv_run(client_loop, UV_RUN_NOWAIT);
+   free(stream_buffer);
+   free(big);
+
+   puts("Mapped buffer tests PASS!");
+
+}
+
+#endif
+
 int run_tests() {
 
    test_coalesced_and_fragmented_messages();
 
+   test_udp_datagrams();
+
+   test_send_priorities();
+
+   test_autocork();
+
+#ifdef __linux__
+   test_zerocopy();
+#endif
+
+#ifndef _WIN32
+   test_shm_messages();
+   test_shm_peer_checks();
+   test_ownership();
+   test_read_ahead();
+#endif
+
+#ifndef _WIN32
+   test_credits();
+   test_batching();
+   test_migration();
+   test_balancer();
+   test_memory_limit();
+   test_read_budget();
+   test_write_completions();
+   test_partial_write();
+   test_transient_messages();
+   test_broadcast();
+   test_pubsub();
+#ifndef UV_MSG_USDT
+   test_tracepoints();
+#endif
+   test_journal();
+   test_peek();
+   test_send_cancel();
+   test_rate_limit();
+   test_capture();
+#endif
+
+#ifdef __linux__
+   test_mmap_buffers();
+#endif
+
 }
@@ -0,0 +1,378 @@
+/* C++20 coroutine interface for the message framing.
+
+   Header only. The uv_msg_framing.c file must be compiled as C and linked.
+
+     uvmsg::task session(uvmsg::connection conn) {
+        int rc = co_await conn.connect((const sockaddr*) &dest);
+        rc = co_await conn.send(std::span(data, size));
+        uvmsg::message msg = co_await conn.read();
+        if (msg) process(msg.data());
+     }
+
+   The connection is move-only and closes the socket when destroyed. The sends
+   keep their request inside the coroutine frame. The received messages are
+   delivered on their own buffers (ownership transfer): with read-ahead
+   disabled, the default, each message is read directly into its buffer and
+   not copied. If read-ahead is enabled on the socket, the messages read
+   together with the previous one are copied once to their buffers. The
+   messages waiting for the reader are kept in a std::deque, which allocates
+   in blocks. The coroutine frames of uvmsg::task come from a per-thread
+   pool. */
+
+#ifndef UV_MSG_HPP
+#define UV_MSG_HPP
+
+#include <coroutine>
+#include <cstdlib>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <new>
+#include <span>
+#include <utility>
+#include "uv_msg_framing.h"
+
+namespace uvmsg {
+
+
+/* Coroutine Frame Pool ******************************************************/
+
+/* the released frames are kept in free lists by size class and reused by the
+   next coroutines. the frames larger than the biggest class use the heap */
+
+class frame_pool {
+public:
+   static constexpr std::size_t granularity = 128;
+   static constexpr std::size_t classes = 32;
+
+   static void* allocate(std::size_t size) {
+      std::size_t idx = (size + granularity - 1) / granularity;
+      if (idx == 0 || idx > classes) return ::operator new(size);
+      node *n = free_lists[idx - 1];
+      if (n) {
+         free_lists[idx - 1] = n->next;
+         return n;
+      }
+      return ::operator new(idx * granularity);
+   }
+
+   static void deallocate(void *ptr, std::size_t size) noexcept {
+      std::size_t idx = (size + granularity - 1) / granularity;
+      if (idx == 0 || idx > classes) {
+         ::operator delete(ptr);
+         return;
+      }
+      node *n = static_cast<node*>(ptr);
+      n->next = free_lists[idx - 1];
+      free_lists[idx - 1] = n;
+   }
+
+private:
+   struct node { node *next; };
+   static inline thread_local node *free_lists[classes] = {};
+};
+
+
+/* Task **********************************************************************/
+
+/* a detached coroutine. it starts running when called and releases its frame
+   when it finishes */
+
+struct task {
+   struct promise_type {
+      task get_return_object() noexcept { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() noexcept { std::terminate(); }
+
+      static void* operator new(std::size_t size) { return frame_pool::allocate(size); }
+      static void operator delete(void *ptr, std::size_t size) noexcept { frame_pool::deallocate(ptr, size); }
+   };
+};
+
+
+/* Received Message **********************************************************/
+
+/* owns the buffer of a received message. on failure it holds the error code */
+
+class message {
+public:
+   message() noexcept = default;
+   message(char *msg, int size) noexcept : msg_(msg), size_(size) {}
+   explicit message(int error) noexcept : size_(error) {}
+
+   message(message &&other) noexcept
+      : msg_(std::exchange(other.msg_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+   message& operator=(message &&other) noexcept {
+      if (this != &other) {
+         std::free(msg_);
+         msg_ = std::exchange(other.msg_, nullptr);
+         size_ = std::exchange(other.size_, 0);
+      }
+      return *this;
+   }
+
+   message(const message&) = delete;
+   message& operator=(const message&) = delete;
+
+   ~message() { std::free(msg_); }
+
+   explicit operator bool() const noexcept { return size_ >= 0; }
+   int error() const noexcept { return size_ < 0 ? size_ : 0; }
+
+   std::span<const char> data() const noexcept {
+      return size_ > 0 ? std::span<const char>(msg_, size_) : std::span<const char>();
+   }
+   std::size_t size() const noexcept { return size_ > 0 ? size_ : 0; }
+
+   /* transfers the buffer to the caller, who must release it with free() */
+   char* release() noexcept { size_ = 0; return std::exchange(msg_, nullptr); }
+
+private:
+   char *msg_ = nullptr;
+   int size_ = 0;
+};
+
+
+/* Connection ****************************************************************/
+
+class connection {
+
+   /* the libuv handle must not move, so it lives on the heap until closed */
+   struct state {
+      uv_msg_t socket;
+      std::deque<message> pending;
+      std::coroutine_handle<> reader;
+      int error = 0;
+      bool reading = false;
+      bool paused = false;
+   };
+
+public:
+   /* received messages kept while no one is reading, before pausing the socket */
+   static constexpr std::size_t max_pending = 64;
+
+   connection() noexcept = default;
+
+   connection(connection &&other) noexcept : state_(std::exchange(other.state_, nullptr)) {}
+
+   connection& operator=(connection &&other) noexcept {
+      if (this != &other) {
+         close();
+         state_ = std::exchange(other.state_, nullptr);
+      }
+      return *this;
+   }
+
+   connection(const connection&) = delete;
+   connection& operator=(const connection&) = delete;
+
+   ~connection() { close(); }
+
+   /* stream_type is the same as in uv_msg_init. returns 0 or an error code */
+   int init(uv_loop_t *loop, int stream_type) {
+      close();
+      state *s = new (std::nothrow) state;
+      if (!s) return UV_ENOMEM;
+      int rc = uv_msg_init(loop, &s->socket, stream_type);
+      if (rc) {
+         delete s;
+         return rc;
+      }
+      s->socket.data = s;
+      uv_msg_set_ownership(&s->socket, 1);
+      state_ = s;
+      return 0;
+   }
+
+   void close() noexcept {
+      if (!state_) return;
+      uv_msg_close(&std::exchange(state_, nullptr)->socket, on_close);
+   }
+
+   explicit operator bool() const noexcept { return state_ != nullptr; }
+
+   uv_msg_t* get() const noexcept { return state_ ? &state_->socket : nullptr; }
+   uv_stream_t* stream() const noexcept { return reinterpret_cast<uv_stream_t*>(get()); }
+
+   int accept(uv_stream_t *server) {
+      return state_ ? uv_accept(server, stream()) : UV_EINVAL;
+   }
+
+   /* Connecting *************************************************************/
+
+   struct connect_op {
+      uv_connect_t req;
+      state *s;
+      const sockaddr *addr;
+      const char *name;
+      std::coroutine_handle<> handle;
+      int status = 0;
+
+      bool await_ready() const noexcept { return s == nullptr; }
+
+      bool await_suspend(std::coroutine_handle<> h) {
+         handle = h;
+         req.data = this;
+         if (name) {
+            uv_pipe_connect(&req, &s->socket.pipe, name, on_connect);
+            return true;
+         }
+         status = uv_tcp_connect(&req, &s->socket.tcp, addr, on_connect);
+         return status == 0;
+      }
+
+      int await_resume() const noexcept { return s ? status : UV_EINVAL; }
+
+      static void on_connect(uv_connect_t *req, int status) {
+         connect_op *op = static_cast<connect_op*>(req->data);
+         op->status = status;
+         op->handle.resume();
+      }
+   };
+
+   connect_op connect(const sockaddr *addr) noexcept { return {{}, state_, addr, nullptr, {}, 0}; }
+   connect_op connect(const char *pipe_name) noexcept { return {{}, state_, nullptr, pipe_name, {}, 0}; }
+
+   /* Sending ****************************************************************/
+
+   /* the data must stay valid until the send completes, which is guaranteed
+      while the coroutine is awaiting it */
+
+   struct send_op {
+      uv_msg_send_t req;
+      state *s;
+      std::span<const char> data;
+      int priority;
+      std::coroutine_handle<> handle;
+      int status;
+
+      bool await_ready() const noexcept { return s == nullptr || data.empty(); }
+
+      bool await_suspend(std::coroutine_handle<> h) {
+         handle = h;
+         req.data = this;
+         status = uv_msg_send_prio(&req, &s->socket, priority,
+                                   const_cast<char*>(data.data()), static_cast<int>(data.size()), on_sent);
+         return status == 0;
+      }
+
+      int await_resume() const noexcept { return s && !data.empty() ? status : UV_EINVAL; }
+
+      static void on_sent(uv_write_t *req, int status) {
+         send_op *op = static_cast<send_op*>(req->data);
+         op->status = status;
+         op->handle.resume();
+      }
+   };
+
+   send_op send(std::span<const char> data, int priority = UV_MSG_PRIO_NORMAL) noexcept {
+      return {{}, state_, data, priority, {}, 0};
+   }
+
+   /* Reading ****************************************************************/
+
+   struct read_op {
+      state *s;
+
+      bool await_ready() const noexcept {
+         return s == nullptr || !s->pending.empty() || s->error != 0;
+      }
+
+      bool await_suspend(std::coroutine_handle<> h) {
+         if (s->reader) {
+            /* only one coroutine can read at a time */
+            s = nullptr;
+            return false;
+         }
+         if (!s->reading) {
+            int rc = uv_msg_read_start(&s->socket, on_alloc, on_msg_received, on_free);
+            if (rc) {
+               s->error = rc;
+               return false;
+            }
+            s->reading = true;
+         }
+         resume_reading(s);
+         s->reader = h;
+         return true;
+      }
+
+      message await_resume() noexcept {
+         if (s == nullptr) return message(UV_EINVAL);
+         if (s->pending.empty()) return message(s->error);
+         message msg = std::move(s->pending.front());
+         s->pending.pop_front();
+         if (s->pending.size() < max_pending / 2) resume_reading(s);
+         return msg;
+      }
+   };
+
+   read_op read() noexcept { return {state_}; }
+
+private:
+   state *state_ = nullptr;
+
+   static void on_alloc(uv_handle_t*, std::size_t size, uv_buf_t *buf) {
+      buf->base = static_cast<char*>(std::malloc(size));
+      buf->len = buf->base ? size : 0;
+   }
+
+   static void on_free(uv_handle_t*, void *ptr) {
+      std::free(ptr);
+   }
+
+   /* through the library, so the pauses of its memory limits, delivery budget
+      and rate limits are kept. the shared memory transport cannot pause */
+   static void pause_reading(state *s) {
+      if (s->paused) return;
+      if (uv_msg_read_pause(&s->socket, 1) == 0) s->paused = true;
+   }
+
+   static void resume_reading(state *s) {
+      if (!s->paused || s->error != 0 || uv_is_closing(reinterpret_cast<uv_handle_t*>(&s->socket))) return;
+      s->paused = false;
+      int rc = uv_msg_read_pause(&s->socket, 0);
+      if (rc) s->error = rc;
+   }
+
+   static void wake_reader(state *s) {
+      if (s->reader) std::exchange(s->reader, nullptr).resume();
+   }
+
+   static void on_msg_received(uv_msg_t *socket, void *msg, int size) {
+      state *s = static_cast<state*>(socket->data);
+
+      if (size < 0) {
+         s->error = size;
+      } else {
+         /* the exceptions must not cross the C frames of libuv */
+         try {
+            s->pending.emplace_back(static_cast<char*>(msg), size);
+         } catch (...) {
+            std::free(msg);
+            s->error = UV_ENOMEM;
+            pause_reading(s);
+            wake_reader(s);
+            return;
+         }
+         if (s->pending.size() >= max_pending && !s->reader) pause_reading(s);
+      }
+
+      wake_reader(s);
+   }
+
+   static void on_close(uv_handle_t *handle) {
+      state *s = static_cast<state*>(handle->data);
+      if (s->error == 0) s->error = UV_ECANCELED;
+      wake_reader(s);
+      delete s;
+   }
+
+};
+
+}  // namespace uvmsg
+
+#endif  // UV_MSG_HPP
@@ -0,0 +1,150 @@
+/* Traffic capture for performance reproduction.
+
+   Records the bytes read from a socket, with the same sizes returned by each
+   read, and the messages sent on it, together with their timing. The file
+   can be fed back through a socket using the replay tool (replay.c).
+
+   File format:
+
+     "UVMSGCAP" + version (1 byte)
+     records:
+       type (1 byte)              UV_MSG_CAPTURE_READ or UV_MSG_CAPTURE_SEND
+       time delta (varint)        microseconds since the previous record
+       size (varint)
+       data (size bytes)
+*/
+
+#define MSG_CAPTURE_MAGIC    "UVMSGCAP"
+#define MSG_CAPTURE_VERSION  1
+
+typedef struct msg_capture_s {
+   FILE *file;
+   uint64_t last_time;   /* in nanoseconds */
+} msg_capture_t;
+
+static void msg_capture_write_varint(FILE *file, uint64_t value) {
+   unsigned char buf[10];
+   int n = 0;
+   do {
+      buf[n] = value & 0x7f;
+      value >>= 7;
+      if (value) buf[n] |= 0x80;
+      n++;
+   } while (value);
+   fwrite(buf, 1, n, file);
+}
+
+static int msg_capture_read_varint(FILE *file, uint64_t *value) {
+   int c, shift = 0;
+   *value = 0;
+   do {
+      c = fgetc(file);
+      if (c == EOF || shift > 63) return 0;
+      *value |= (uint64_t)(c & 0x7f) << shift;
+      shift += 7;
+   } while (c & 0x80);
+   return 1;
+}
+
+static void msg_capture_record(uv_msg_t *socket, int type, const char *data, int size) {
+   msg_capture_t *capture = (msg_capture_t *) socket->capture_data;
+   uint64_t now = uv_hrtime();
+
+   fputc(type, capture->file);
+   msg_capture_write_varint(capture->file, (now - capture->last_time) / 1000);
+   msg_capture_write_varint(capture->file, size);
+   fwrite(data, 1, size, capture->file);
+   capture->last_time = now;
+}
+
+int msg_capture_start(uv_msg_t *socket, const char *path) {
+   msg_capture_t *capture;
+
+   if (!socket || !path || socket->capture_cb) return UV_EINVAL;
+
+   capture = malloc(sizeof(msg_capture_t));
+   if (!capture) return UV_ENOMEM;
+   capture->file = fopen(path, "wb");
+   if (!capture->file) {
+      free(capture);
+      return UV_EIO;
+   }
+   fwrite(MSG_CAPTURE_MAGIC, 1, 8, capture->file);
+   fputc(MSG_CAPTURE_VERSION, capture->file);
+   capture->last_time = uv_hrtime();
+
+   return uv_msg_set_capture(socket, msg_capture_record, capture);
+}
+
+void msg_capture_stop(uv_msg_t *socket) {
+   msg_capture_t *capture = (msg_capture_t *) socket->capture_data;
+
+   if (socket->capture_cb != msg_capture_record) return;
+   uv_msg_set_capture(socket, NULL, NULL);
+   fclose(capture->file);
+   free(capture);
+}
+
+/* Reading a capture file ***************************************************/
+
+typedef struct msg_capture_record_s {
+   int type;
+   uint64_t time;      /* microseconds since the start of the capture */
+   int size;
+   char *data;
+} msg_capture_record_t;
+
+/* loads the records of the given type (0 = all). returns the number of records
+   or a negative error code. release them with msg_capture_free() */
+int msg_capture_load(const char *path, int type, msg_capture_record_t **precords) {
+   msg_capture_record_t *records = NULL;
+   int count = 0, allocated = 0;
+   uint64_t time = 0;
+   char magic[8];
+   FILE *file;
+   int c;
+
+   file = fopen(path, "rb");
+   if (!file) return UV_ENOENT;
+   if (fread(magic, 1, 8, file) != 8 || memcmp(magic, MSG_CAPTURE_MAGIC, 8) != 0 ||
+       fgetc(file) != MSG_CAPTURE_VERSION) {
+      fclose(file);
+      return UV_EINVAL;
+   }
+
+   while ((c = fgetc(file)) != EOF) {
+      uint64_t delta, size;
+      char *data;
+      if (!msg_capture_read_varint(file, &delta) || !msg_capture_read_varint(file, &size) ||
+          size > 0x7fffffff) break;
+      time += delta;
+      if (type && c != type) {
+         fseek(file, (long) size, SEEK_CUR);
+         continue;
+      }
+      data = malloc(size ? size : 1);
+      if (!data || fread(data, 1, size, file) != size) { free(data); break; }
+      if (count == allocated) {
+         msg_capture_record_t *bigger;
+         allocated = allocated ? allocated * 2 : 1024;
+         bigger = realloc(records, allocated * sizeof(msg_capture_record_t));
+         if (!bigger) { free(data); break; }
+         records = bigger;
+      }
+      records[count].type = c;
+      records[count].time = time;
+      records[count].size = (int) size;
+      records[count].data = data;
+      count++;
+   }
+
+   fclose(file);
+   *precords = records;
+   return count;
+}
+
+void msg_capture_free(msg_capture_record_t *records, int count) {
+   int i;
+   for (i = 0; i < count; i++) free(records[i].data);
+   free(records);
+}
@@ -1,4 +1,25 @@
 #include "uv_msg_framing.h"
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#endif
+#ifdef __linux__
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define UV_MSG_HAVE_ZEROCOPY
+#endif
+#ifndef MREMAP_MAYMOVE
+/* declared only with _GNU_SOURCE */
+#define MREMAP_MAYMOVE 1
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...);
+#endif
+#endif
 
 #ifdef DEBUGTRACE
 #define UVTRACE(X)   printf X;
@@ -6,9 +27,34 @@
 #define UVTRACE(X)
 #endif
 
+/* static tracepoints for bpftrace, perf and systemtap. compile with
+   -DUV_MSG_USDT to enable them. they are a single nop when not attached.
+   the tests define their own UV_MSG_PROBE2/3 to count them */
+#ifdef UV_MSG_USDT
+#include <sys/sdt.h>
+#define UV_MSG_PROBE2(name, a, b)     DTRACE_PROBE2(uv_msg, name, a, b)
+#define UV_MSG_PROBE3(name, a, b, c)  DTRACE_PROBE3(uv_msg, name, a, b, c)
+#endif
+#ifndef UV_MSG_PROBE2
+#define UV_MSG_PROBE2(name, a, b)
+#define UV_MSG_PROBE3(name, a, b, c)
+#endif
+
+/* the high bit of the length marks the control frames, exchanged between the
+   endpoints and not delivered to the application */
+#define UV_MSG_CONTROL_FLAG  0x80000000
+#define UV_MSG_FRAME_SIZE(ptr)  ((int)(ntohl(*(unsigned int*)(ptr)) & ~UV_MSG_CONTROL_FLAG))
+#define UV_MSG_IS_CONTROL(ptr)  ((ntohl(*(unsigned int*)(ptr)) & UV_MSG_CONTROL_FLAG) != 0)
+
 
 /* Stream Initialization *****************************************************/
 
+#ifndef _WIN32
+static int uv_msg_shm_init(uv_loop_t *loop, uv_msg_t *socket);
+#endif
+static void uv_msg_deliver(uv_msg_t *uvmsg, char *msg, int size);
+static void uv_msg_memory_attach(uv_msg_t *socket);
+
 int uv_msg_init(uv_loop_t* loop, uv_msg_t* handle, int stream_type) {
    int rc;
 
@@ -19,11 +65,24 @@ int uv_msg_init(uv_loop_t* loop, uv_msg_t* handle, int stream_type) {
    case UV_NAMED_PIPE:
       rc = uv_pipe_init(loop, (uv_pipe_t*) handle, 0);
       break;
+   case UV_UDP:
+#if UV_VERSION_HEX >= 0x012800
+      rc = uv_udp_init_ex(loop, (uv_udp_t*) handle, AF_UNSPEC | UV_UDP_RECVMMSG);
+#else
+      rc = uv_udp_init(loop, (uv_udp_t*) handle);
+#endif
+      break;
+#ifndef _WIN32
+   case UV_MSG_SHM:
+      rc = uv_msg_shm_init(loop, handle);
+      break;
+#endif
    default:
       return UV_EINVAL;
    }
 
    if( rc ) return rc;
+   if( stream_type != UV_MSG_SHM ) handle->shm = NULL;
 
    handle->buf = NULL;
    handle->alloc_size = 0;
@@ -31,182 +90,3581 @@ int uv_msg_init(uv_loop_t* loop, uv_msg_t* handle, int stream_type) {
    handle->alloc_cb = NULL;
    handle->free_cb = NULL;
    handle->msg_read_cb = NULL;
+   handle->addr = NULL;
+   handle->max_datagram = 0;
+   handle->udp_sending = 0;
+   handle->udp_queue = NULL;
+   handle->udp_queue_tail = NULL;
+   handle->close_cb = NULL;
+   memset(handle->queue, 0, sizeof(handle->queue));
+   memset(handle->queue_tail, 0, sizeof(handle->queue_tail));
+   handle->queued = 0;
+   handle->inflight = 0;
+   handle->max_inflight = 0;
+   handle->send_timeout = 0;
+   handle->send_timer = NULL;
+   handle->send_due = 0;
+   handle->write_failed = 0;
+   handle->owned = 0;
+   handle->frame = NULL;
+   handle->frame_size = 0;
+   handle->frame_filled = 0;
+   handle->frame_header_filled = 0;
+   handle->capture_cb = NULL;
+   handle->capture_data = NULL;
+   handle->read_ahead = 0;
+   handle->mmap_threshold = 0;
+   handle->mmap_flags = 0;
+   handle->buf_mapped = 0;
+   handle->msg_loop = NULL;
+   handle->autocork = 0;
+   handle->corked = 0;
+   handle->burst = 0;
+   handle->burst_avg = 0;
+   handle->written_next = NULL;
+   handle->zerocopy = 0;
+   handle->zc_seq = 0;
+   handle->zc_copied = 0;
+   handle->zc_closed = 0;
+   handle->zc_queue = NULL;
+   handle->zc_queue_tail = NULL;
+   handle->zc_poll = NULL;
+   handle->credit_window_msgs = 0;
+   handle->credit_window_bytes = 0;
+   handle->credit_msgs = 0;
+   handle->credit_bytes = 0;
+   handle->consumed_msgs = 0;
+   handle->consumed_bytes = 0;
+   handle->batch = NULL;
+   handle->batch_max_msg = 0;
+   handle->batch_max_size = 0;
+   handle->batch_msgs = 0;
+   handle->batch_next = NULL;
+   handle->activity = 0;
+   handle->balancer_loop = NULL;
+   handle->balancer_next = NULL;
+   handle->queued_bytes = 0;
+   handle->memory_used = 0;
+   handle->memory_state = 0;
+   handle->memory_next = NULL;
+   handle->memory_prev = NULL;
+   handle->budget_msgs = 0;
+   handle->budget_usecs = 0;
+   handle->deferred = 0;
+   handle->deferred_next = NULL;
+   handle->acks = 0;
+   handle->recv_seq = 0;
+   handle->acked_seq = 0;
+   handle->ack_cb = NULL;
+   handle->ack_data = NULL;
+   handle->peek_cb = NULL;
+   handle->peek_size = 0;
+   handle->peeked = 0;
+   handle->skip = 0;
+   handle->read_paused = 0;
+   memset(&handle->recv_rate, 0, sizeof(handle->recv_rate));
+   memset(&handle->send_rate, 0, sizeof(handle->send_rate));
+   handle->rate_paused = 0;
+   handle->rate_waiting = 0;
+   handle->rate_wake = 0;
+   handle->rate_next = NULL;
    /* initialize the public member */
    handle->data = NULL;
 
+   uv_msg_memory_attach(handle);
+
    return 0;
 }
 
 
-/* Message Writting **********************************************************/
+/* Loop Context **************************************************************/
 
-#ifdef _WIN32
-static void uv_msg_sent(uv_write_t *req, int status) {
-   free(req);
+/* State shared by the sockets of the same event loop. It is created when the
+   first socket needs it and released with the last one */
+
+struct uv_msg_loop_s {
+   uv_loop_t *loop;
+   int refs;
+   int handles;               /* open handles, released on close */
+   uv_prepare_t prepare;      /* end of the tick, before waiting for I/O */
+   uv_check_t check;          /* end of the tick, after the I/O callbacks */
+   int active;
+   uv_msg_t *written;         /* sockets written on this tick (autocork) */
+   uv_msg_t *batched;         /* sockets with a batch being built */
+   uv_idle_t idle;            /* delivers the deferred messages without waiting for I/O */
+   uv_msg_t *deferred;        /* sockets that exhausted their delivery budget */
+   uv_timer_t rate_timer;     /* wakes the sockets waiting for tokens */
+   uv_msg_t *rate_waiting;
+   uint64_t rate_due;
+   uv_msg_hook_t *hooks;      /* state of the modules built on the framing */
+   int flushing;              /* hooks to flush at the end of the tick */
+   /* memory accounting */
+   uv_timer_t memory_timer;
+   size_t memory_soft;
+   size_t memory_hard;
+   size_t memory_used;
+   int memory_exceeded;       /* above the hard limit */
+   int memory_paused;         /* sockets waiting to resume, they keep the loop alive */
+   uv_msg_t *accounted;       /* sockets initialized with the limits set */
+   struct uv_msg_loop_s *next;
+};
+
+static struct uv_msg_loop_s *uv_msg_loops = NULL;
+static uv_mutex_t uv_msg_loops_mutex;
+static uv_once_t uv_msg_loops_once = UV_ONCE_INIT;
+
+static void uv_msg_loop_check(uv_check_t *check);
+static void uv_msg_loop_prepare(uv_prepare_t *prepare);
+
+static void uv_msg_loops_init(void) {
+   uv_mutex_init(&uv_msg_loops_mutex);
 }
-#endif
 
-int uv_msg_send(uv_msg_send_t *req, uv_msg_t *socket, void *msg, int size, uv_write_cb write_cb) {
-   uv_stream_t *stream = (uv_stream_t*) socket;
+static struct uv_msg_loop_s * uv_msg_loop_get(uv_loop_t *loop, int create) {
+   struct uv_msg_loop_s *ctx;
 
-   if ( !req || !stream || !msg || size <= 0 ) return UV_EINVAL;
+   uv_once(&uv_msg_loops_once, uv_msg_loops_init);
+   uv_mutex_lock(&uv_msg_loops_mutex);
 
-   UVTRACE(("sending message: %s\n", (char*)msg));
+   for (ctx = uv_msg_loops; ctx; ctx = ctx->next) {
+      if (ctx->loop == loop) break;
+   }
 
-   req->msg_size = htonl(size);
-   req->buf[0].base = (char*) &req->msg_size;
-   req->buf[0].len = 4;
-   req->buf[1] = uv_buf_init(msg, size);
+   if (!ctx && create) {
+      ctx = malloc(sizeof(struct uv_msg_loop_s));
+      if (ctx) {
+         memset(ctx, 0, sizeof(struct uv_msg_loop_s));
+         ctx->loop = loop;
+         uv_prepare_init(loop, &ctx->prepare);
+         uv_unref((uv_handle_t*) &ctx->prepare);
+         ctx->prepare.data = ctx;
+         uv_check_init(loop, &ctx->check);
+         uv_unref((uv_handle_t*) &ctx->check);
+         ctx->check.data = ctx;
+         uv_timer_init(loop, &ctx->memory_timer);
+         uv_unref((uv_handle_t*) &ctx->memory_timer);
+         ctx->memory_timer.data = ctx;
+         uv_idle_init(loop, &ctx->idle);
+         ctx->idle.data = ctx;
+         uv_timer_init(loop, &ctx->rate_timer);
+         ctx->rate_timer.data = ctx;
+         ctx->handles = 5;
+         ctx->next = uv_msg_loops;
+         uv_msg_loops = ctx;
+      }
+   }
+   if (ctx) ctx->refs++;
 
-#ifdef _WIN32
-   /* uv_write does not accept more than 1 buffer with Pipes on Windows
-      https://github.com/libuv/libuv/issues/794 */
-   if (stream->type == UV_NAMED_PIPE) {
-     int rc;
-     uv_msg_send_t *req1 = malloc(sizeof(uv_msg_send_t));
-     if (!req1) return UV_ENOMEM;
-     rc = uv_write((uv_write_t*) req1, stream, &req->buf[0], 1, uv_msg_sent);
-     if (rc) { free(req1); return rc; }
-     return uv_write((uv_write_t*) req, stream, &req->buf[1], 1, write_cb);
-   } else
-#endif
-   return uv_write((uv_write_t*) req, stream, &req->buf[0], 2, write_cb);
+   uv_mutex_unlock(&uv_msg_loops_mutex);
+   return ctx;
+}
 
+static void uv_msg_loop_free(uv_handle_t *handle) {
+   struct uv_msg_loop_s *ctx = handle->data;
+   if (--ctx->handles > 0) return;
+   while (ctx->hooks) {
+      uv_msg_hook_t *hook = ctx->hooks;
+      ctx->hooks = hook->next;
+      if (hook->free_cb) hook->free_cb(hook);
+      free(hook);
+   }
+   free(ctx);
 }
 
+static void uv_msg_loop_release(struct uv_msg_loop_s *ctx) {
+   struct uv_msg_loop_s **pctx;
 
-/* Message Reading ***********************************************************/
+   uv_mutex_lock(&uv_msg_loops_mutex);
+   if (--ctx->refs == 0) {
+      for (pctx = &uv_msg_loops; *pctx; pctx = &(*pctx)->next) {
+         if (*pctx == ctx) { *pctx = ctx->next; break; }
+      }
+   } else {
+      ctx = NULL;
+   }
+   uv_mutex_unlock(&uv_msg_loops_mutex);
 
-void uv_stream_msg_free_buffer(uv_msg_t *uvmsg) {
-   if( uvmsg->free_cb ) uvmsg->free_cb((uv_handle_t*)uvmsg, uvmsg->buf);
-   uvmsg->buf = 0;
-   uvmsg->alloc_size = 0;
+   if (ctx) {
+      uv_close((uv_handle_t*) &ctx->prepare, uv_msg_loop_free);
+      uv_close((uv_handle_t*) &ctx->check, uv_msg_loop_free);
+      uv_close((uv_handle_t*) &ctx->memory_timer, uv_msg_loop_free);
+      uv_close((uv_handle_t*) &ctx->idle, uv_msg_loop_free);
+      uv_close((uv_handle_t*) &ctx->rate_timer, uv_msg_loop_free);
+   }
 }
 
-int uv_stream_msg_realloc(uv_handle_t *handle, size_t suggested_size) {
-   uv_msg_t *uvmsg = (uv_msg_t*) handle;
-   uv_buf_t buf = {0};
-   uvmsg->alloc_cb(handle, suggested_size, &buf);
-   if( buf.base==0 || buf.len < suggested_size ) return 0;  //! if buf.len < suggested_size and buf.base is valid it will be lost here (the allocated memory)
-   memcpy(buf.base, uvmsg->buf, uvmsg->filled);
-   if( uvmsg->free_cb ) uvmsg->free_cb(handle, uvmsg->buf);
-   uvmsg->buf = buf.base;
-   uvmsg->alloc_size = buf.len;
-   return 1;
+/* runs the end of tick work on the next prepare and check phases */
+static void uv_msg_loop_activate(struct uv_msg_loop_s *ctx) {
+   if (ctx->active) return;
+   uv_prepare_start(&ctx->prepare, uv_msg_loop_prepare);
+   uv_check_start(&ctx->check, uv_msg_loop_check);
+   ctx->active = 1;
 }
 
-void uv_stream_msg_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *stream_buf) {
-   uv_msg_t *uvmsg = (uv_msg_t*) handle;
+/* attaches the socket to the context of its loop, until it is closed */
+static int uv_msg_loop_attach(uv_msg_t *socket) {
+   if (socket->msg_loop) return 0;
+   socket->msg_loop = uv_msg_loop_get(((uv_handle_t*)socket)->loop, 1);
+   return socket->msg_loop ? 0 : UV_ENOMEM;
+}
 
-   UVTRACE(("stream_msg_alloc  uvmsg=%p\n", uvmsg));
-   if( uvmsg==0 ) return;
+/* Loop Hooks ****************************************************************/
 
-   if( uvmsg->buf==0 ){
-      uv_buf_t buf = {0};
-      uvmsg->alloc_cb(handle, suggested_size, &buf);
-      uvmsg->buf = buf.base;
-      if( uvmsg->buf==0 ) return;
-      uvmsg->alloc_size = buf.len;
-   }
+/* The modules built on the framing (like uv_send_message.c) keep their state
+   for each loop on a hook. It is released together with the context of the
+   loop, and its flush_cb runs at the end of the tick when requested */
 
-   UVTRACE(("stream_msg_alloc  uvmsg->buf=%p  filled=%d\n", uvmsg->buf, uvmsg->filled));
+/* returns the hook of the loop of the socket with this flush_cb, creating it
+   with size bytes set to zero (0 = do not create). the socket stays attached
+   to the context until it is closed */
+uv_msg_hook_t * uv_msg_hook_get(uv_msg_t *socket, uv_msg_hook_cb flush_cb, uv_msg_hook_cb free_cb, size_t size) {
+   struct uv_msg_loop_s *ctx;
+   uv_msg_hook_t *hook;
 
-   if( uvmsg->filled >= 4 ){
-      int msg_size = ntohl(*(int*)uvmsg->buf);
-      int entire_msg_size = msg_size + 4;
-      UVTRACE(("stream_msg_alloc  msg_size=%d\n", msg_size));
-      if( uvmsg->alloc_size < entire_msg_size ){
-         /* here the suggested size is exactly what it's needed to read the entire message */
-         if( !uv_stream_msg_realloc(handle, entire_msg_size) ){
-            stream_buf->base = 0;
-            return;
-         }
-      }
-      stream_buf->len = entire_msg_size - uvmsg->filled;
+   if (!socket || !flush_cb) return NULL;
+   if (size == 0) {
+      ctx = socket->msg_loop;
+      if (!ctx) return NULL;
    } else {
-      if( uvmsg->alloc_size < 4 ){
-         /* There is no enough space for the message length. Allocate the default size */
-         UVTRACE(("calling realloc - alloc_size: %d, filled: %d\n", uvmsg->alloc_size, uvmsg->filled));
-         if( !uv_stream_msg_realloc(handle, 64 * 1024) ){
-            stream_buf->base = 0;
-            return;
-         }
-      }
-      stream_buf->len = uvmsg->alloc_size - uvmsg->filled;
+      if (size < sizeof(uv_msg_hook_t) || uv_msg_loop_attach(socket)) return NULL;
+      ctx = socket->msg_loop;
    }
 
-   stream_buf->base = uvmsg->buf + uvmsg->filled;
-   UVTRACE(("stream_msg_alloc  base=%p  len=%d\n", stream_buf->base, stream_buf->len));
+   for (hook = ctx->hooks; hook; hook = hook->next) {
+      if (hook->flush_cb == flush_cb) return hook;
+   }
+   if (size == 0) return NULL;
+
+   hook = malloc(size);
+   if (!hook) return NULL;
+   memset(hook, 0, size);
+   hook->flush_cb = flush_cb;
+   hook->free_cb = free_cb;
+   hook->msg_loop = ctx;
+   hook->next = ctx->hooks;
+   ctx->hooks = hook;
+   return hook;
 }
 
-void uv_stream_msg_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
-   uv_msg_t *uvmsg = (uv_msg_t*) stream;
-   char *ptr;
+/* the flush_cb of the hook is called at the end of this tick */
+void uv_msg_hook_flush(uv_msg_hook_t *hook) {
+   struct uv_msg_loop_s *ctx = hook->msg_loop;
 
-   UVTRACE(("uv_stream_msg_read: received %d bytes\n", nread));
-   UVTRACE(("uvmsg: %p  uvmsg->buf: %p  buf->base: %p\n", uvmsg, uvmsg->buf, buf->base));
+   if (hook->pending) return;
+   hook->pending = 1;
+   if (ctx->flushing++ == 0) {
+      /* the context and the loop are kept alive until the flush, even if the
+         sockets are closed */
+      uv_mutex_lock(&uv_msg_loops_mutex);
+      ctx->refs++;
+      uv_mutex_unlock(&uv_msg_loops_mutex);
+      uv_ref((uv_handle_t*) &ctx->prepare);
+   }
+   uv_msg_loop_activate(ctx);
+}
 
-   if (uvmsg == 0) return;
+static void uv_msg_hook_run(struct uv_msg_loop_s *ctx) {
+   uv_msg_hook_t *hook;
 
-   if (nread == 0) {
-      /* Nothing read */
-      //! does it should release the ->buf here?
-      //uv_stream_msg_free_buffer(uvmsg);
+   if (ctx->flushing == 0) return;
+   for (hook = ctx->hooks; hook; hook = hook->next) {
+      if (!hook->pending) continue;
+      /* a flush requested by the callback is included in this one */
+      hook->flush_cb(hook);
+      hook->pending = 0;
+      ctx->flushing--;
+   }
+   /* the ones requested for the hooks already run are left for the next tick */
+   if (ctx->flushing > 0) return;
+   uv_unref((uv_handle_t*) &ctx->prepare);
+   uv_msg_loop_release(ctx);
+}
+
+static void uv_msg_autocork_remove(uv_msg_t *socket);
+static void uv_msg_batch_cancel(uv_msg_t *socket);
+static void uv_msg_memory_remove(uv_msg_t *socket);
+static void uv_msg_deferred_remove(uv_msg_t *socket);
+static void uv_msg_rate_remove(uv_msg_t *socket);
+
+static void uv_msg_loop_detach(uv_msg_t *socket) {
+   if (!socket->msg_loop) return;
+   uv_msg_memory_remove(socket);
+   uv_msg_deferred_remove(socket);
+   uv_msg_rate_remove(socket);
+   uv_msg_autocork_remove(socket);
+   uv_msg_batch_cancel(socket);
+   uv_msg_loop_release(socket->msg_loop);
+   socket->msg_loop = NULL;
+}
+
+
+/* Memory Accounting *********************************************************/
+
+/* With uv_msg_set_memory_limit() the sockets of the loop account the memory
+   used by their read buffers, the messages waiting to be written and the ones
+   being batched. It is measured periodically. Above the soft limit the
+   sockets using more memory stop reading until the total is back below 3/4 of
+   the limit. Above the hard limit the new messages are rejected with
+   UV_ENOBUFS and, on each measurement, the socket using more memory receives
+   the UV_ENOBUFS error on its read callback, so the application can close it. */
+
+#define UV_MSG_MEMORY_INTERVAL   100   /* milliseconds */
+#define UV_MSG_MEMORY_PAUSE_MAX  16    /* sockets paused on each measurement */
+
+#define UV_MSG_MEMORY_PAUSED  1
+#define UV_MSG_MEMORY_SHED    2
+
+static void uv_msg_memory_attach(uv_msg_t *socket) {
+   struct uv_msg_loop_s *ctx = uv_msg_loop_get(((uv_handle_t*)socket)->loop, 0);
+
+   if (!ctx) return;
+   if (ctx->memory_soft == 0 && ctx->memory_hard == 0) {
+      uv_msg_loop_release(ctx);
       return;
    }
+   socket->msg_loop = ctx;
+   socket->memory_next = ctx->accounted;
+   if (ctx->accounted) ctx->accounted->memory_prev = socket;
+   ctx->accounted = socket;
+}
 
-   if (nread < 0) {
-      /* Error */
-      uv_stream_msg_free_buffer(uvmsg);
-      uvmsg->msg_read_cb((uv_msg_t*)stream, NULL, nread);
+static void uv_msg_memory_remove(uv_msg_t *socket) {
+   struct uv_msg_loop_s *ctx = socket->msg_loop;
+
+   if (socket->memory_state == UV_MSG_MEMORY_PAUSED && --ctx->memory_paused == 0) {
+      uv_unref((uv_handle_t*) &ctx->memory_timer);
+   }
+   socket->memory_state = 0;
+
+   if (socket->memory_prev) {
+      socket->memory_prev->memory_next = socket->memory_next;
+   } else if (ctx->accounted == socket) {
+      ctx->accounted = socket->memory_next;
+   } else {
       return;
    }
+   if (socket->memory_next) socket->memory_next->memory_prev = socket->memory_prev;
+   socket->memory_next = socket->memory_prev = NULL;
+}
 
-#ifdef TESTING_UV_MSG_FRAMING
-   assert(buf->base == uvmsg->buf + uvmsg->filled);
-   print_bytes("received", buf->base, nread);
-#endif
+static size_t uv_msg_memory_usage(uv_msg_t *socket) {
+   size_t used = socket->queued_bytes;
 
-   uvmsg->filled += nread;
+   if (socket->buf) used += socket->alloc_size;
+   if (socket->frame) used += socket->frame_size;
+   if (socket->batch) used += socket->batch_max_size;
+   if (socket->udp.type == UV_UDP) {
+      used += uv_udp_get_send_queue_size(&socket->udp);
+   } else {
+      used += uv_stream_get_write_queue_size((uv_stream_t*) socket);
+   }
+   return used;
+}
 
-   UVTRACE(("alloc_size: %d, received: %d, filled: %d\n", uvmsg->alloc_size, nread, uvmsg->filled));
+static int uv_msg_memory_can_pause(uv_msg_t *socket) {
+   return socket->memory_state == 0 && socket->msg_read_cb && !socket->shm &&
+          uv_is_active((uv_handle_t*) socket) && !uv_is_closing((uv_handle_t*) socket);
+}
 
-   ptr = uvmsg->buf;
+static void uv_msg_memory_pause(uv_msg_t *socket, int state) {
+   struct uv_msg_loop_s *ctx = socket->msg_loop;
 
-   while( uvmsg->filled >= 4 ){
-      int msg_size = ntohl(*(int*)ptr);
-      int entire_msg = msg_size + 4;
-      UVTRACE(("msg_size: %d, entire_msg: %d\n", msg_size, entire_msg));
-      if( uvmsg->filled >= entire_msg ){
-         uvmsg->msg_read_cb((uv_msg_t*)stream, ptr + 4, msg_size);
-         if( uvmsg->filled > entire_msg ){
-            ptr += entire_msg;
-         }
-         uvmsg->filled -= entire_msg;
+   if (socket->memory_state == 0) {
+      if (socket->udp.type == UV_UDP) {
+         uv_udp_recv_stop(&socket->udp);
       } else {
-         break;
+         uv_read_stop((uv_stream_t*) socket);
+      }
+   } else if (socket->memory_state == UV_MSG_MEMORY_PAUSED && --ctx->memory_paused == 0) {
+      uv_unref((uv_handle_t*) &ctx->memory_timer);
+   }
+   if (state == UV_MSG_MEMORY_PAUSED && ctx->memory_paused++ == 0) {
+      uv_ref((uv_handle_t*) &ctx->memory_timer);
+   }
+   socket->memory_state = state;
+}
+
+static void uv_msg_memory_resume(uv_msg_t *socket) {
+   struct uv_msg_loop_s *ctx = socket->msg_loop;
+
+   if (--ctx->memory_paused == 0) uv_unref((uv_handle_t*) &ctx->memory_timer);
+   socket->memory_state = 0;
+   if (uv_is_closing((uv_handle_t*) socket)) return;
+   /* the reading is restarted when the held messages are delivered */
+   if (socket->deferred || socket->rate_paused || socket->read_paused) return;
+   uv_msg_read_start(socket, socket->alloc_cb, socket->msg_read_cb, socket->free_cb);
+}
+
+/* pauses the sockets using more memory, enough to cover the excess */
+static void uv_msg_memory_pause_largest(struct uv_msg_loop_s *ctx, size_t excess) {
+   uv_msg_t *socket, *largest;
+   int i;
+
+   for (i = 0; i < UV_MSG_MEMORY_PAUSE_MAX; i++) {
+      largest = NULL;
+      for (socket = ctx->accounted; socket; socket = socket->memory_next) {
+         if (uv_msg_memory_can_pause(socket) &&
+             (!largest || socket->memory_used > largest->memory_used)) largest = socket;
       }
+      if (!largest) break;
+      uv_msg_memory_pause(largest, UV_MSG_MEMORY_PAUSED);
+      if (largest->memory_used >= excess) break;
+      excess -= largest->memory_used;
    }
+}
 
-   if( ptr > uvmsg->buf && uvmsg->filled > 0 ){
-      UVTRACE(("moving the buffer\n"));
-      memmove(uvmsg->buf, ptr, uvmsg->filled);
-   } else if( uvmsg->filled == 0 ){
-      UVTRACE(("releasing the buffer\n"));
-      uv_stream_msg_free_buffer(uvmsg);
+static void uv_msg_memory_measure(uv_timer_t *timer) {
+   struct uv_msg_loop_s *ctx = timer->data;
+   uv_msg_t *socket, *worst = NULL;
+   size_t total = 0;
+
+   for (socket = ctx->accounted; socket; socket = socket->memory_next) {
+      socket->memory_used = uv_msg_memory_usage(socket);
+      total += socket->memory_used;
    }
+   ctx->memory_used = total;
+   ctx->memory_exceeded = ctx->memory_hard > 0 && total >= ctx->memory_hard;
 
-#ifdef TESTING_UV_MSG_FRAMING
-   uv_async_send(&async_next_step);
+   if (ctx->memory_soft > 0 && total >= ctx->memory_soft) {
+      uv_msg_memory_pause_largest(ctx, total - ctx->memory_soft);
+   } else if (total < ctx->memory_soft / 4 * 3) {
+      for (socket = ctx->accounted; socket; socket = socket->memory_next) {
+         if (socket->memory_state == UV_MSG_MEMORY_PAUSED) uv_msg_memory_resume(socket);
+      }
+   }
+
+   if (ctx->memory_exceeded) {
+      for (socket = ctx->accounted; socket; socket = socket->memory_next) {
+         if (socket->memory_state != UV_MSG_MEMORY_SHED && socket->msg_read_cb &&
+             !uv_is_closing((uv_handle_t*) socket) &&
+             (!worst || socket->memory_used > worst->memory_used)) worst = socket;
+      }
+      if (worst) {
+         uv_msg_memory_pause(worst, UV_MSG_MEMORY_SHED);
+         worst->msg_read_cb(worst, NULL, UV_ENOBUFS);
+      }
+   }
+}
+
+/* returns UV_ENOBUFS when the loop of the socket is above the hard limit */
+int uv_msg_memory_check(uv_msg_t *socket) {
+   if (socket->msg_loop && socket->msg_loop->memory_exceeded) return UV_ENOBUFS;
+   return 0;
+}
+
+/* the limits apply to the sockets initialized after this call. 0 = no limit */
+int uv_msg_set_memory_limit(uv_loop_t *loop, size_t soft_limit, size_t hard_limit) {
+   struct uv_msg_loop_s *ctx;
+   int limited;
+
+   if (!loop || (hard_limit > 0 && soft_limit > hard_limit)) return UV_EINVAL;
+
+   ctx = uv_msg_loop_get(loop, 1);
+   if (!ctx) return UV_ENOMEM;
+   limited = ctx->memory_soft > 0 || ctx->memory_hard > 0;
+
+   ctx->memory_soft = soft_limit;
+   ctx->memory_hard = hard_limit;
+   ctx->memory_exceeded = 0;
+
+   if (soft_limit > 0 || hard_limit > 0) {
+      uv_timer_start(&ctx->memory_timer, uv_msg_memory_measure, UV_MSG_MEMORY_INTERVAL, UV_MSG_MEMORY_INTERVAL);
+      /* the limits hold a reference to the context */
+      if (limited) uv_msg_loop_release(ctx);
+   } else {
+      uv_msg_t *socket;
+      uv_timer_stop(&ctx->memory_timer);
+      for (socket = ctx->accounted; socket; socket = socket->memory_next) {
+         if (socket->memory_state == UV_MSG_MEMORY_PAUSED) uv_msg_memory_resume(socket);
+      }
+      uv_msg_loop_release(ctx);
+      if (limited) uv_msg_loop_release(ctx);
+   }
+   return 0;
+}
+
+
+/* Adaptive Corking **********************************************************/
+
+/* With autocork the socket uses TCP_NODELAY, so an isolated message (like a
+   request or a reply) is sent right away. When more messages are written on
+   the same loop iteration the socket is corked, so they are coalesced in full
+   packets, and it is uncorked at the end of the tick. If the recent
+   iterations had bursts the socket is corked already on the first message.
+
+   Where TCP_CORK is not available Nagle's algorithm is enabled during the
+   burst instead, and disabling it again flushes the data. */
+
+#define UV_MSG_BURST_SCALE  16     /* fixed point for the burst average */
+
+static void uv_msg_cork(uv_msg_t *socket, int on) {
+#ifdef TCP_CORK
+   uv_os_fd_t fd;
+   if (uv_fileno((uv_handle_t*) socket, &fd) == 0) {
+      setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+   }
+#else
+   uv_tcp_nodelay(&socket->tcp, !on);
 #endif
+   socket->corked = on;
 }
 
-int uv_msg_read_start(uv_msg_t* stream, uv_alloc_cb alloc_cb, uv_msg_read_cb msg_read_cb, uv_free_cb free_cb) {
+/* called before each write on the socket */
+void uv_msg_autocork_write(uv_msg_t *socket) {
+   struct uv_msg_loop_s *ctx = socket->msg_loop;
 
-   stream->msg_read_cb = msg_read_cb;
-   stream->alloc_cb = alloc_cb;
-   stream->free_cb = free_cb;
+   if (!socket->autocork || !ctx) return;
 
-   return uv_read_start((uv_stream_t*)stream, uv_stream_msg_alloc, uv_stream_msg_read);
+   if (socket->burst++ == 0) {
+      uv_msg_loop_activate(ctx);
+      socket->written_next = ctx->written;
+      ctx->written = socket;
+   }
+
+   if (!socket->corked &&
+       (socket->burst >= 2 || socket->burst_avg >= 2 * UV_MSG_BURST_SCALE)) {
+      uv_msg_cork(socket, 1);
+   }
+}
+
+static void uv_msg_autocork_flush(uv_msg_loop_t *ctx) {
+   uv_msg_t *socket = ctx->written;
+
+   ctx->written = NULL;
+   while (socket) {
+      uv_msg_t *next = socket->written_next;
+      if (socket->corked) uv_msg_cork(socket, 0);
+      /* moving average of the messages written per iteration */
+      socket->burst_avg += (socket->burst * UV_MSG_BURST_SCALE - socket->burst_avg) / 4;
+      socket->burst = 0;
+      socket->written_next = NULL;
+      socket = next;
+   }
+}
+
+static void uv_msg_autocork_remove(uv_msg_t *socket) {
+   uv_msg_t **psocket;
+
+   if (socket->burst == 0) return;
+   for (psocket = &socket->msg_loop->written; *psocket; psocket = &(*psocket)->written_next) {
+      if (*psocket == socket) { *psocket = socket->written_next; break; }
+   }
+   socket->burst = 0;
+}
+
+int uv_msg_set_autocork(uv_msg_t *socket, int enabled) {
+   int rc;
+
+   if (!socket || ((uv_handle_t*)socket)->type != UV_TCP || socket->shm) return UV_EINVAL;
+
+   if (enabled && !socket->autocork) {
+      rc = uv_msg_loop_attach(socket);
+      if (rc) return rc;
+      rc = uv_tcp_nodelay(&socket->tcp, 1);
+      if (rc) return rc;
+   } else if (!enabled && socket->autocork) {
+      if (socket->corked) uv_msg_cork(socket, 0);
+      uv_msg_autocork_remove(socket);
+   }
+
+   socket->autocork = enabled ? 1 : 0;
+   return 0;
+}
+
+
+
+/* Zero Copy Sending *********************************************************/
+
+/* On Linux the messages bigger than the threshold set with uv_msg_set_zerocopy()
+   are sent with MSG_ZEROCOPY, when there is nothing else waiting to be written
+   on the stream, so the order is kept. What is not accepted by the kernel is
+   written with uv_write. The kernel reports on the socket error queue when
+   it no longer uses the message memory, and only then the write callback is
+   called. The error queue is watched with a uv_poll_t on a duplicate of the
+   socket descriptor (libuv does not accept two watchers on the same one),
+   where libuv reports it as a priority event.
+
+   A socket closed while the kernel still uses some messages stays open on the
+   duplicate, shut down for writing, until they are reported. Only then their
+   callbacks and the close callback are called, so the memory is never
+   released while the kernel can still read it. */
+
+#ifdef UV_MSG_HAVE_ZEROCOPY
+
+static void uv_msg_zc_complete(uv_msg_t *socket, uv_msg_send_t *req) {
+   if (req->prev) req->prev->next = req->next; else socket->zc_queue = req->next;
+   if (req->next) req->next->prev = req->prev; else socket->zc_queue_tail = req->prev;
+   req->write_cb((uv_write_t*) req, req->zc_status);
+}
+
+/* the part not accepted by the kernel was written */
+static void uv_msg_zc_written(uv_write_t *wreq, int status) {
+   uv_msg_send_t *req = (uv_msg_send_t*) wreq;
+   uv_msg_t *socket = (uv_msg_t*) wreq->handle;
+   if (status < 0) req->zc_status = status;
+   if (--req->zc_pending == 0) uv_msg_zc_complete(socket, req);
+}
+
+/* reads the completion notifications. the queue is in the order of the sends,
+   so each range is matched from its head, stopping after its end */
+static void uv_msg_zc_drain(uv_msg_t *socket) {
+   char control[128];
+   struct msghdr msg;
+   struct cmsghdr *cm;
+   uv_os_fd_t fd;
+
+   if (uv_fileno((uv_handle_t*) socket->zc_poll, &fd) != 0) return;
+
+   while (socket->zc_queue) {
+      memset(&msg, 0, sizeof msg);
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof control;
+      if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+      for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+         struct sock_extended_err *serr;
+         uv_msg_send_t *req, *next;
+         if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+               (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+         serr = (struct sock_extended_err *) CMSG_DATA(cm);
+         if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+         /* the kernel had to copy the data (e.g. loopback, no NIC support) */
+         if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) socket->zc_copied++;
+         /* the sends from ee_info to ee_data are completed */
+         for (req = socket->zc_queue; req && (int) (req->zc_seq - serr->ee_data) <= 0; req = next) {
+            next = req->next;
+            /* before the range: waiting for its uv_write, or reported out of order */
+            if ((int) (req->zc_seq - serr->ee_info) < 0) continue;
+            if (--req->zc_pending == 0) uv_msg_zc_complete(socket, req);
+         }
+      }
+   }
+}
+
+static void uv_msg_on_close(uv_handle_t *handle);
+
+static void uv_msg_zc_ready(uv_poll_t *poll, int status, int events) {
+   uv_msg_t *socket = poll->data;
+
+   uv_msg_zc_drain(socket);
+   if (!socket->zc_queue) {
+      uv_poll_stop(poll);
+      /* the close was waiting for the completions */
+      if (socket->zc_closed) uv_msg_on_close((uv_handle_t*) socket);
+   } else if (status < 0) {
+      /* libuv stopped the watcher on the error */
+      uv_poll_start(poll, UV_PRIORITIZED, uv_msg_zc_ready);
+   }
+}
+
+/* the watcher of the error queue */
+static int uv_msg_zc_open(uv_msg_t *socket) {
+   uv_os_fd_t fd;
+   int rc;
+
+   if (socket->zc_poll) return 0;
+   rc = uv_fileno((uv_handle_t*) socket, &fd);
+   if (rc) return rc;
+
+   socket->zc_poll = malloc(sizeof(uv_poll_t));
+   if (!socket->zc_poll) return UV_ENOMEM;
+   fd = dup(fd);
+   rc = fd < 0 ? -errno : uv_poll_init(((uv_handle_t*)socket)->loop, socket->zc_poll, fd);
+   if (rc) {
+      if (fd >= 0) close(fd);
+      free(socket->zc_poll);
+      socket->zc_poll = NULL;
+      return rc;
+   }
+   socket->zc_poll->data = socket;
+   return 0;
+}
+
+static void uv_msg_zc_closed(uv_handle_t *handle) {
+   free(handle);
+}
+
+static void uv_msg_zc_release(uv_msg_t *socket) {
+   uv_os_fd_t fd;
+
+   if (!socket->zc_poll) return;
+   uv_fileno((uv_handle_t*) socket->zc_poll, &fd);
+   uv_close((uv_handle_t*) socket->zc_poll, uv_msg_zc_closed);
+   close(fd);
+   socket->zc_poll = NULL;
+}
+
+static int uv_msg_zc_send(uv_msg_t *socket, uv_msg_send_t *req, int nbufs, uv_write_cb write_cb) {
+   struct msghdr msg;
+   uv_buf_t *bufs = req->buf;
+   uv_os_fd_t fd;
+   ssize_t sent;
+   size_t total = req->buf[0].len + (nbufs > 1 ? req->buf[1].len : 0);
+   int rc;
+
+   rc = uv_fileno((uv_handle_t*) socket, &fd);
+   if (rc) return rc;
+
+   /* uv_buf_t has the same layout as struct iovec on unix */
+   memset(&msg, 0, sizeof msg);
+   msg.msg_iov = (struct iovec *) bufs;
+   msg.msg_iovlen = nbufs;
+   sent = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+   if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+         return uv_write((uv_write_t*) req, (uv_stream_t*) socket, bufs, nbufs, write_cb);
+      }
+      return -errno;
+   }
+
+   req->write_cb = write_cb;
+   req->zc_seq = socket->zc_seq++;
+   req->zc_status = 0;
+   req->zc_pending = 1;
+   req->next = NULL;
+   req->prev = socket->zc_queue_tail;
+   if (socket->zc_queue_tail) {
+      socket->zc_queue_tail->next = req;
+   } else {
+      socket->zc_queue = req;
+   }
+   socket->zc_queue_tail = req;
+
+   if (!uv_is_active((uv_handle_t*) socket->zc_poll)) {
+      uv_poll_start(socket->zc_poll, UV_PRIORITIZED, uv_msg_zc_ready);
+   }
+
+   if ((size_t) sent < total) {
+      /* write the remaining, before anything else written later */
+      if ((size_t) sent >= bufs[0].len) {
+         sent -= bufs[0].len;
+         bufs++;
+         nbufs--;
+      }
+      bufs[0].base += sent;
+      bufs[0].len -= sent;
+      req->zc_pending++;
+      rc = uv_write((uv_write_t*) req, (uv_stream_t*) socket, bufs, nbufs, uv_msg_zc_written);
+      if (rc) { req->zc_pending--; req->zc_status = rc; }
+   }
+
+   return 0;
+}
+
+/* the handle was closed with messages still used by the kernel. the peer
+   receives the end of the stream after them */
+static void uv_msg_zc_linger(uv_msg_t *socket) {
+   uv_os_fd_t fd;
+
+   socket->zc_closed = 1;
+   if (uv_fileno((uv_handle_t*) socket->zc_poll, &fd) == 0) shutdown(fd, SHUT_WR);
+}
+
+#else
+
+static void uv_msg_zc_release(uv_msg_t *socket) {}
+
+#endif
+
+int uv_msg_set_zerocopy(uv_msg_t *socket, size_t threshold) {
+#ifdef UV_MSG_HAVE_ZEROCOPY
+   uv_os_fd_t fd;
+   int rc, on = 1;
+
+   if (!socket || ((uv_handle_t*)socket)->type != UV_TCP || socket->shm) return UV_EINVAL;
+
+   if (threshold > 0) {
+      rc = uv_fileno((uv_handle_t*) socket, &fd);
+      if (rc) return rc;
+      if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) return -errno;
+      rc = uv_msg_zc_open(socket);
+      if (rc) return rc;
+   }
+   socket->zerocopy = threshold;
+   return 0;
+#else
+   return UV_ENOTSUP;
+#endif
+}
+
+static void uv_msg_batch_flush_all(uv_msg_loop_t *ctx);
+
+/* the end of the tick. it runs before waiting for I/O, for what was written
+   on the timers, and after the I/O callbacks */
+static void uv_msg_loop_tick(uv_msg_loop_t *ctx) {
+
+   /* the messages sent by the callbacks are flushed below */
+   uv_msg_hook_run(ctx);
+   uv_msg_batch_flush_all(ctx);
+   uv_msg_autocork_flush(ctx);
+
+   /* do not run on the idle iterations */
+   if (!ctx->written && !ctx->batched && !ctx->flushing) {
+      uv_prepare_stop(&ctx->prepare);
+      uv_check_stop(&ctx->check);
+      ctx->active = 0;
+   }
+}
+
+static void uv_msg_loop_prepare(uv_prepare_t *prepare) {
+   uv_msg_loop_tick((uv_msg_loop_t*) prepare->data);
+}
+
+static void uv_msg_loop_check(uv_check_t *check) {
+   uv_msg_loop_tick((uv_msg_loop_t*) check->data);
+}
+
+
+/* Datagram Writting *********************************************************/
+
+/* Each datagram carries one or more complete frames. When packing is enabled
+   the first message is sent right away and the ones sent while it is in
+   flight are packed together. The datagrams are queued back to back so libuv
+   can flush them with a single sendmmsg() call where available. */
+
+#define UV_MSG_UDP_MAX_PACK  64
+
+static void uv_msg_udp_flush(uv_msg_t *socket);
+
+static void uv_msg_udp_sent(uv_udp_send_t *sreq, int status) {
+   uv_msg_send_t *req = (uv_msg_send_t*) sreq;
+   uv_msg_t *socket = (uv_msg_t*) sreq->handle;
+   uv_msg_send_t *next;
+
+   socket->udp_sending--;
+
+   for (; req; req = next) {
+      next = req->next;
+      req->write_cb((uv_write_t*) req, status);
+   }
+
+   uv_msg_udp_flush(socket);
+}
+
+/* sends the first messages of the queue in a single datagram */
+static int uv_msg_udp_send_packed(uv_msg_t *socket) {
+   uv_buf_t bufs[UV_MSG_UDP_MAX_PACK * 2];
+   uv_msg_send_t *first, *last, *req;
+   int nbufs = 0, size = 0, rc;
+
+   first = last = socket->udp_queue;
+   for (req = first; req && nbufs + 2 <= UV_MSG_UDP_MAX_PACK * 2; req = req->next) {
+      int entire_msg = req->buf[0].len + req->buf[1].len;
+      if (req != first && size + entire_msg > socket->max_datagram) break;
+      bufs[nbufs++] = req->buf[0];
+      if (req->buf[1].len > 0) bufs[nbufs++] = req->buf[1];
+      size += entire_msg;
+      last = req;
+   }
+
+   socket->udp_queue = last->next;
+   if (socket->udp_queue == NULL) socket->udp_queue_tail = NULL;
+   last->next = NULL;
+
+   UVTRACE(("sending datagram with %d buffers, %d bytes\n", nbufs, size));
+
+   rc = uv_udp_send(&first->udp_req, &socket->udp, bufs, nbufs, NULL, uv_msg_udp_sent);
+   if (rc) return rc;
+   socket->udp_sending++;
+   return 0;
+}
+
+static void uv_msg_udp_flush(uv_msg_t *socket) {
+   while (socket->udp_queue) {
+      uv_msg_send_t *first = socket->udp_queue;
+      int rc;
+      if (uv_is_closing((uv_handle_t*) socket)) {
+         socket->udp_queue = socket->udp_queue_tail = NULL;
+         rc = UV_ECANCELED;
+      } else {
+         rc = uv_msg_udp_send_packed(socket);
+      }
+      if (rc) {
+         /* the requests were already accepted, so report the error on their callbacks */
+         uv_msg_send_t *next;
+         for (; first; first = next) {
+            next = first->next;
+            first->write_cb((uv_write_t*) first, rc);
+         }
+      }
+   }
+}
+
+static int uv_msg_udp_send(uv_msg_t *socket, uv_msg_send_t *req) {
+   int rc;
+
+   if (socket->max_datagram > 0 && socket->udp_sending > 0) {
+      /* pack it with the next messages when the current datagram is sent */
+      if (socket->udp_queue_tail) {
+         socket->udp_queue_tail->next = req;
+      } else {
+         socket->udp_queue = req;
+      }
+      socket->udp_queue_tail = req;
+      return 0;
+   }
+
+   rc = uv_udp_send(&req->udp_req, &socket->udp, req->buf, req->buf[1].len > 0 ? 2 : 1, NULL, uv_msg_udp_sent);
+   if (rc) return rc;
+   socket->udp_sending++;
+   return 0;
+}
+
+int uv_msg_set_udp_packing(uv_msg_t *socket, int max_datagram) {
+   if (!socket || socket->udp.type != UV_UDP || max_datagram < 0) return UV_EINVAL;
+   socket->max_datagram = max_datagram;
+   return 0;
+}
+
+
+/* Shared Memory Transport ***************************************************/
+
+/* With UV_MSG_SHM the messages are exchanged using a single-producer single-
+   consumer ring in shared memory for each direction. Each side creates the
+   ring it writes to and sends its name to the peer. The Unix socket is used
+   only for this handshake and for the wakeups:
+
+     'H' + name   the peer must map the ring with this name
+     'W'          there are new messages on the ring
+     'S'          there is free space on the ring
+
+   The messages are delivered to the msg_read_cb directly from the shared
+   memory. The write callback is called when the message is copied to the
+   ring, together with the completion of the next write done on the socket.
+
+   The peer can write to the inbound ring at any time, so its size is read
+   once when it is mapped and every record is checked against it. Only the
+   names created by this library are opened and unlinked. */
+
+#ifndef _WIN32
+
+#define UV_MSG_SHM_WRAP      0xFFFFFFFF
+#define UV_MSG_SHM_ALIGN(X)  (((X) + 3) & ~3)
+#define UV_MSG_SHM_PREFIX    "/uvmsg"
+#define UV_MSG_SHM_MIN_SIZE  4096
+#define UV_MSG_SHM_MAX_SIZE  (1U << 30)
+
+struct uv_msg_ring_s {
+   uint32_t size;               /* capacity of data[], a power of 2 */
+   uint32_t consumer_waiting;
+   uint32_t producer_waiting;
+   uint32_t reserved;
+   uint64_t head;               /* written by the producer */
+   char pad1[56];
+   uint64_t tail;               /* written by the consumer */
+   char pad2[56];
+   char data[];
+};
+
+struct uv_msg_shm_s {
+   struct uv_msg_ring_s *out;   /* we are the producer */
+   struct uv_msg_ring_s *in;    /* we are the consumer */
+   size_t out_len;
+   size_t in_len;
+   uint32_t ring_size;
+   uint32_t in_size;            /* of the inbound ring, read once when mapped */
+   int failed;                  /* the peer broke the protocol */
+   char out_name[UV_MSG_SHM_NAME_LEN];
+   uv_msg_send_t *pending;      /* waiting for space on the ring */
+   uv_msg_send_t *pending_tail;
+   uv_msg_send_t *carrier;      /* last write on the socket, and the messages */
+   uv_msg_send_t *carrier_tail; /* that will be completed together with it */
+   char rbuf[UV_MSG_SHM_NAME_LEN + 64];
+   int rfilled;
+};
+
+static int uv_msg_shm_init(uv_loop_t *loop, uv_msg_t *socket) {
+   struct uv_msg_shm_s *shm = malloc(sizeof(struct uv_msg_shm_s));
+   int rc;
+
+   if (!shm) return UV_ENOMEM;
+   rc = uv_pipe_init(loop, (uv_pipe_t*) socket, 0);
+   if (rc) { free(shm); return rc; }
+   memset(shm, 0, sizeof(struct uv_msg_shm_s));
+   shm->ring_size = UV_MSG_SHM_DEFAULT_SIZE;
+   socket->shm = shm;
+   return 0;
+}
+
+static void uv_msg_shm_written(uv_write_t *wreq, int status) {
+   uv_msg_send_t *req = (uv_msg_send_t*) wreq;
+   uv_msg_t *socket = (uv_msg_t*) wreq->handle;
+   uv_msg_send_t *next;
+
+   if (socket->shm && socket->shm->carrier == req) {
+      socket->shm->carrier = socket->shm->carrier_tail = NULL;
+   }
+
+   for (; req; req = next) {
+      next = req->next;
+      req->write_cb((uv_write_t*) req, status);
+   }
+}
+
+static void uv_msg_shm_signal_sent(uv_write_t *req, int status) {
+   free(req);
+}
+
+/* writes a control byte (or the handshake) on the socket */
+static int uv_msg_shm_signal(uv_msg_t *socket, char *data, int size) {
+   struct { uv_write_t req; char data[UV_MSG_SHM_NAME_LEN + 1]; } *wreq;
+   uv_buf_t buf;
+   int rc;
+
+   wreq = malloc(sizeof(*wreq));
+   if (!wreq) return UV_ENOMEM;
+   memcpy(wreq->data, data, size);
+   buf = uv_buf_init(wreq->data, size);
+   rc = uv_write(&wreq->req, (uv_stream_t*) socket, &buf, 1, uv_msg_shm_signal_sent);
+   if (rc) free(wreq);
+   return rc;
+}
+
+static void * uv_msg_shm_map(const char *name, size_t len, int create) {
+   void *ptr;
+   int fd;
+
+   fd = shm_open(name, create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+   if (fd < 0) return NULL;
+   if (create && ftruncate(fd, len) != 0) {
+      close(fd);
+      shm_unlink(name);
+      return NULL;
+   }
+   ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (ptr == MAP_FAILED) {
+      if (create) shm_unlink(name);
+      return NULL;
+   }
+   return ptr;
+}
+
+/* creates the outbound ring and sends its name to the peer */
+static int uv_msg_shm_start(uv_msg_t *socket) {
+   struct uv_msg_shm_s *shm = socket->shm;
+   char hello[UV_MSG_SHM_NAME_LEN + 1];
+   int rc;
+
+   if (shm->out) return 0;
+
+   snprintf(shm->out_name, UV_MSG_SHM_NAME_LEN, UV_MSG_SHM_PREFIX "%d_%lx", (int) getpid(), (unsigned long) (uintptr_t) socket);
+   shm->out_len = sizeof(struct uv_msg_ring_s) + shm->ring_size;
+   shm->out = uv_msg_shm_map(shm->out_name, shm->out_len, 1);
+   if (!shm->out) return UV_ENOMEM;
+   memset(shm->out, 0, sizeof(struct uv_msg_ring_s));
+   shm->out->size = shm->ring_size;
+   /* the peer is not reading yet, so the first message must wake it up */
+   shm->out->consumer_waiting = 1;
+
+   hello[0] = 'H';
+   memcpy(hello + 1, shm->out_name, UV_MSG_SHM_NAME_LEN);
+   rc = uv_msg_shm_signal(socket, hello, sizeof hello);
+   if (rc) {
+      munmap(shm->out, shm->out_len);
+      shm_unlink(shm->out_name);
+      shm->out = NULL;
+   }
+   return rc;
+}
+
+/* copies the message to the ring. returns 0 if there is no space */
+static int uv_msg_shm_write(struct uv_msg_ring_s *ring, void *msg, int size) {
+   uint64_t head = ring->head;
+   uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+   uint32_t off = head & (ring->size - 1);
+   uint32_t need = 4 + UV_MSG_SHM_ALIGN(size);
+   uint32_t avail = ring->size - (uint32_t)(head - tail);
+
+   if (off + need > ring->size) {
+      /* the message must be contiguous: skip the end of the ring */
+      uint32_t pad = ring->size - off;
+      if (pad > avail) return 0;
+      *(uint32_t*)(ring->data + off) = UV_MSG_SHM_WRAP;
+      head += pad;
+      avail -= pad;
+      off = 0;
+      __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+   }
+   if (need > avail) return 0;
+
+   memcpy(ring->data + off + 4, msg, size);
+   *(uint32_t*)(ring->data + off) = size;
+   __atomic_store_n(&ring->head, head + need, __ATOMIC_SEQ_CST);
+   return 1;
+}
+
+/* the message was copied to the ring: wake up the peer if it is sleeping and
+   complete the request together with the next write on the socket */
+static int uv_msg_shm_commit(uv_msg_t *socket, uv_msg_send_t *req) {
+   struct uv_msg_shm_s *shm = socket->shm;
+   int wakeup = __atomic_exchange_n(&shm->out->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+   int rc;
+
+   req->next = NULL;
+
+   if (!wakeup && shm->carrier) {
+      shm->carrier_tail->next = req;
+      shm->carrier_tail = req;
+      return 0;
+   }
+
+   req->buf[0] = uv_buf_init(wakeup ? "W" : "", wakeup ? 1 : 0);
+   rc = uv_write((uv_write_t*) req, (uv_stream_t*) socket, &req->buf[0], 1, uv_msg_shm_written);
+   if (rc) return rc;
+   shm->carrier = shm->carrier_tail = req;
+   return 0;
+}
+
+static void uv_msg_shm_flush(uv_msg_t *socket) {
+   struct uv_msg_shm_s *shm = socket->shm;
+
+   while (shm->pending) {
+      uv_msg_send_t *req = shm->pending;
+      int rc;
+      if (!uv_msg_shm_write(shm->out, req->buf[1].base, req->buf[1].len)) {
+         __atomic_store_n(&shm->out->producer_waiting, 1, __ATOMIC_SEQ_CST);
+         if (!uv_msg_shm_write(shm->out, req->buf[1].base, req->buf[1].len)) return;
+      }
+      shm->pending = req->next;
+      if (shm->pending == NULL) shm->pending_tail = NULL;
+      rc = uv_msg_shm_commit(socket, req);
+      if (rc) req->write_cb((uv_write_t*) req, rc);
+   }
+}
+
+static int uv_msg_shm_send(uv_msg_t *socket, uv_msg_send_t *req, void *msg, int size) {
+   struct uv_msg_shm_s *shm = socket->shm;
+   int rc;
+
+   rc = uv_msg_shm_start(socket);
+   if (rc) return rc;
+
+   if (4 + UV_MSG_SHM_ALIGN(size) > shm->ring_size) return UV_EMSGSIZE;
+
+   /* used if the message has to wait for space on the ring */
+   req->buf[1] = uv_buf_init(msg, size);
+
+   if (shm->pending == NULL && uv_msg_shm_write(shm->out, msg, size)) {
+      return uv_msg_shm_commit(socket, req);
+   }
+
+   req->next = NULL;
+   if (shm->pending_tail) {
+      shm->pending_tail->next = req;
+   } else {
+      shm->pending = req;
+   }
+   shm->pending_tail = req;
+   uv_msg_shm_flush(socket);
+   return 0;
+}
+
+/* the peer wrote something invalid on the ring or on the socket */
+static void uv_msg_shm_fail(uv_msg_t *socket) {
+   socket->shm->failed = 1;
+   socket->msg_read_cb(socket, NULL, UV_EPROTO);
+}
+
+/* delivers the messages available on the inbound ring */
+static void uv_msg_shm_drain(uv_msg_t *socket) {
+   struct uv_msg_ring_s *ring = socket->shm->in;
+   uint32_t ring_size = socket->shm->in_size;
+   uint64_t tail, head;
+
+   if (!ring || socket->shm->failed) return;
+
+   do {
+      tail = ring->tail;
+      head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      while (tail != head) {
+         uint32_t off = tail & (ring_size - 1);
+         uint32_t size = *(uint32_t*)(ring->data + off);
+         if (head - tail > ring_size ||
+             (size != UV_MSG_SHM_WRAP && size > ring_size - off - 4)) {
+            uv_msg_shm_fail(socket);
+            return;
+         }
+         if (size == UV_MSG_SHM_WRAP) {
+            tail += ring_size - off;
+         } else {
+            uv_msg_deliver(socket, ring->data + off + 4, size);
+            /* the read callback can close the handle */
+            if (uv_is_closing((uv_handle_t*) socket)) return;
+            tail += 4 + UV_MSG_SHM_ALIGN(size);
+         }
+         __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+         if (head == tail) head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      }
+      if (__atomic_exchange_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST)) {
+         uv_msg_shm_signal(socket, "S", 1);
+      }
+      /* go to sleep, unless a new message arrived in the meantime */
+      __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+   } while (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail &&
+            __atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST));
+}
+
+static void uv_msg_shm_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+   struct uv_msg_shm_s *shm = ((uv_msg_t*) handle)->shm;
+   buf->base = shm->rbuf + shm->rfilled;
+   buf->len = sizeof(shm->rbuf) - shm->rfilled;
+}
+
+static void uv_msg_shm_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+   uv_msg_t *socket = (uv_msg_t*) stream;
+   struct uv_msg_shm_s *shm = socket->shm;
+   char *ptr, *end;
+
+   if (nread < 0) {
+      /* deliver what the peer wrote before closing */
+      uv_msg_shm_drain(socket);
+      if (!uv_is_closing((uv_handle_t*) socket)) socket->msg_read_cb(socket, NULL, nread);
+      return;
+   }
+   if (shm->failed) return;
+
+   shm->rfilled += nread;
+   ptr = shm->rbuf;
+   end = shm->rbuf + shm->rfilled;
+
+   while (ptr < end && !uv_is_closing((uv_handle_t*) socket) && !shm->failed) {
+      if (*ptr == 'W') {
+         uv_msg_shm_drain(socket);
+         ptr++;
+      } else if (*ptr == 'S' && shm->out) {
+         __atomic_store_n(&shm->out->producer_waiting, 0, __ATOMIC_SEQ_CST);
+         uv_msg_shm_flush(socket);
+         ptr++;
+      } else if (*ptr == 'H') {
+         char name[UV_MSG_SHM_NAME_LEN];
+         struct uv_msg_ring_s *ring;
+         uint32_t size = 0;
+         if (end - ptr < 1 + UV_MSG_SHM_NAME_LEN) break;
+         memcpy(name, ptr + 1, UV_MSG_SHM_NAME_LEN);
+         name[UV_MSG_SHM_NAME_LEN - 1] = 0;
+         ptr += 1 + UV_MSG_SHM_NAME_LEN;
+         if (shm->in) continue;
+         /* only the rings created by this library */
+         if (strncmp(name, UV_MSG_SHM_PREFIX, sizeof(UV_MSG_SHM_PREFIX) - 1) != 0 ||
+             strchr(name + 1, '/') != NULL) {
+            uv_msg_shm_fail(socket);
+            return;
+         }
+         /* map the header first to discover the size of the ring */
+         ring = uv_msg_shm_map(name, sizeof(struct uv_msg_ring_s), 0);
+         if (ring) {
+            size = __atomic_load_n(&ring->size, __ATOMIC_ACQUIRE);
+            munmap(ring, sizeof(struct uv_msg_ring_s));
+         }
+         if (size >= UV_MSG_SHM_MIN_SIZE && size <= UV_MSG_SHM_MAX_SIZE && (size & (size - 1)) == 0) {
+            shm->in_size = size;
+            shm->in_len = sizeof(struct uv_msg_ring_s) + size;
+            shm->in = uv_msg_shm_map(name, shm->in_len, 0);
+         }
+         shm_unlink(name);
+         if (!shm->in) {
+            uv_msg_shm_fail(socket);
+            return;
+         }
+         uv_msg_shm_drain(socket);
+      } else {
+         socket->msg_read_cb(socket, NULL, UV_EPROTO);
+         return;
+      }
+   }
+
+   /* keep an incomplete handshake for the next read */
+   shm->rfilled = end - ptr;
+   if (shm->rfilled > 0 && ptr > shm->rbuf) memmove(shm->rbuf, ptr, shm->rfilled);
+}
+
+static void uv_msg_shm_release(uv_msg_t *socket) {
+   struct uv_msg_shm_s *shm = socket->shm;
+   uv_msg_send_t *req, *next;
+
+   for (req = shm->pending; req; req = next) {
+      next = req->next;
+      req->write_cb((uv_write_t*) req, UV_ECANCELED);
+   }
+   if (shm->out) {
+      munmap(shm->out, shm->out_len);
+      shm_unlink(shm->out_name);
+   }
+   if (shm->in) munmap(shm->in, shm->in_len);
+   free(shm);
+   socket->shm = NULL;
+}
+
+int uv_msg_set_shm_size(uv_msg_t *socket, unsigned int size) {
+   if (!socket || !socket->shm || socket->shm->out) return UV_EINVAL;
+   /* it must be a power of 2 */
+   if (size < UV_MSG_SHM_MIN_SIZE || size > UV_MSG_SHM_MAX_SIZE || (size & (size - 1)) != 0) return UV_EINVAL;
+   socket->shm->ring_size = size;
+   return 0;
+}
+
+#else
+
+int uv_msg_set_shm_size(uv_msg_t *socket, unsigned int size) {
+   return UV_ENOTSUP;
+}
+
+#endif
+
+
+/* Message Writting **********************************************************/
+
+#ifdef _WIN32
+static void uv_msg_sent(uv_write_t *req, int status) {
+   free(req);
+}
+#endif
+
+static void uv_msg_shutdown_done(uv_shutdown_t *req, int status) {
+   free(req);
+}
+
+/* the start of a frame was written but its rest could not be, so the peer
+   would read the next frames as part of it. the stream is shut down and the
+   next writes fail */
+static void uv_msg_write_fail(uv_msg_t *socket) {
+   uv_shutdown_t *req;
+
+   if (socket->write_failed) return;
+   socket->write_failed = 1;
+   req = malloc(sizeof(uv_shutdown_t));
+   if (req && uv_shutdown(req, (uv_stream_t*) socket, uv_msg_shutdown_done) != 0) free(req);
+}
+
+/* writes the frame to the stream */
+static int uv_msg_write(uv_msg_t *socket, uv_msg_send_t *req, uv_write_cb write_cb) {
+   uv_stream_t *stream = (uv_stream_t*) socket;
+   int nbufs = req->buf[1].base ? 2 : 1;
+
+   if (socket->write_failed) return UV_EPIPE;
+   uv_msg_autocork_write(socket);
+
+#ifdef UV_MSG_HAVE_ZEROCOPY
+   if (socket->zerocopy && stream->type == UV_TCP &&
+       req->buf[0].len + (nbufs > 1 ? req->buf[1].len : 0) >= socket->zerocopy &&
+       uv_stream_get_write_queue_size(stream) == 0) {
+      return uv_msg_zc_send(socket, req, nbufs, write_cb);
+   }
+#endif
+
+#ifdef _WIN32
+   /* uv_write does not accept more than 1 buffer with Pipes on Windows
+      https://github.com/libuv/libuv/issues/794 */
+   if (stream->type == UV_NAMED_PIPE && nbufs == 2) {
+     int rc;
+     uv_msg_send_t *req1 = malloc(sizeof(uv_msg_send_t));
+     if (!req1) return UV_ENOMEM;
+     rc = uv_write((uv_write_t*) req1, stream, &req->buf[0], 1, uv_msg_sent);
+     if (rc) { free(req1); return rc; }
+     return uv_write((uv_write_t*) req, stream, &req->buf[1], 1, write_cb);
+   } else
+#endif
+   return uv_write((uv_write_t*) req, stream, &req->buf[0], nbufs, write_cb);
+
+}
+
+static int uv_msg_batch_add(uv_msg_t *socket, uv_msg_send_t *req, uv_write_cb write_cb);
+static void uv_msg_batch_flush(uv_msg_t *socket);
+
+/* hands the message to the transport. the buffers are already set */
+static int uv_msg_transmit(uv_msg_t *socket, uv_msg_send_t *req, uv_write_cb write_cb) {
+   uv_stream_t *stream = (uv_stream_t*) socket;
+
+   if (stream->type == UV_UDP) {
+      req->write_cb = write_cb;
+      req->next = NULL;
+      return uv_msg_udp_send(socket, req);
+   }
+
+#ifndef _WIN32
+   if (socket->shm) {
+      req->write_cb = write_cb;
+      if (req->buf[1].base == NULL) {
+         return uv_msg_shm_send(socket, req, req->buf[0].base + 4, req->buf[0].len - 4);
+      }
+      return uv_msg_shm_send(socket, req, req->buf[1].base, req->buf[1].len);
+   }
+#endif
+
+   if (socket->batch_max_msg > 0) {
+      if (!UV_MSG_IS_CONTROL(&req->msg_size) &&
+          UV_MSG_FRAME_SIZE(&req->msg_size) <= socket->batch_max_msg &&
+          !uv_is_closing((uv_handle_t*) socket)) {
+         return uv_msg_batch_add(socket, req, write_cb);
+      }
+      /* the batched messages go first */
+      uv_msg_batch_flush(socket);
+   }
+
+   return uv_msg_write(socket, req, write_cb);
+}
+
+
+/* Send Queue ****************************************************************/
+
+/* When a limit is set with uv_msg_set_max_inflight() only that amount of bytes
+   is handed to the transport at a time. The other messages are held here in
+   one queue per priority, so a high priority message is written before the
+   queued ones with lower priority. Messages already handed to the transport
+   are never reordered.
+
+   The queued messages can be cancelled, and the ones that waited more than
+   their timeout are dropped with UV_ETIMEDOUT instead of being written. A
+   timer of the socket runs on the earliest deadline, so they expire from any
+   position on the queue, even when it is not moving. */
+
+static void uv_msg_queue_flush(uv_msg_t *socket);
+static int uv_msg_credit_available(uv_msg_t *socket);
+static void uv_msg_credit_use(uv_msg_t *socket, int size);
+static int uv_msg_rate_active(struct uv_msg_rate_s *rate);
+static int uv_msg_rate_send_available(uv_msg_t *socket);
+static void uv_msg_rate_use(struct uv_msg_rate_s *rate, int size);
+
+static int uv_msg_entire_size(uv_msg_send_t *req) {
+   return ntohl(req->msg_size) + 4;
+}
+
+static void uv_msg_queue_sent(uv_write_t *wreq, int status) {
+   uv_msg_send_t *req = (uv_msg_send_t*) wreq;
+   uv_msg_t *socket = req->socket;
+
+   UV_MSG_PROBE3(write_completed, socket, uv_msg_entire_size(req) - 4, status);
+   socket->inflight -= uv_msg_entire_size(req);
+   req->send_cb((uv_write_t*) req, status);
+
+   uv_msg_queue_flush(socket);
+}
+
+/* unlinks a message from any position on the queue */
+static void uv_msg_queue_remove(uv_msg_t *socket, uv_msg_send_t *req) {
+   int prio = req->queue_prio;
+
+   if (req->prev) {
+      req->prev->next = req->next;
+   } else {
+      socket->queue[prio] = req->next;
+   }
+   if (req->next) {
+      req->next->prev = req->prev;
+   } else {
+      socket->queue_tail[prio] = req->prev;
+   }
+   req->queue_prio = -1;
+   socket->queued--;
+   socket->queued_bytes -= uv_msg_entire_size(req);
+}
+
+static void uv_msg_deadline_expire(uv_timer_t *timer);
+
+/* runs the timer on the earliest deadline of the queue */
+static void uv_msg_deadline_update(uv_msg_t *socket) {
+   uv_loop_t *loop = ((uv_handle_t*)socket)->loop;
+   uint64_t due = 0;
+   uv_msg_send_t *req;
+   int prio;
+
+   for (prio = 0; prio < UV_MSG_PRIORITIES; prio++) {
+      for (req = socket->queue[prio]; req; req = req->next) {
+         if (req->deadline && (due == 0 || req->deadline < due)) due = req->deadline;
+      }
+   }
+
+   if (due == 0 || uv_is_closing((uv_handle_t*) socket)) {
+      if (socket->send_timer) uv_timer_stop(socket->send_timer);
+      socket->send_due = 0;
+      return;
+   }
+   if (!socket->send_timer) {
+      socket->send_timer = malloc(sizeof(uv_timer_t));
+      /* without it they expire when they reach the head of the queue */
+      if (!socket->send_timer) return;
+      uv_timer_init(loop, socket->send_timer);
+      /* the socket keeps the loop alive while its queue can move */
+      uv_unref((uv_handle_t*) socket->send_timer);
+      socket->send_timer->data = socket;
+   }
+   socket->send_due = due;
+   uv_timer_start(socket->send_timer, uv_msg_deadline_expire,
+                  due > uv_now(loop) ? due - uv_now(loop) : 0, 0);
+}
+
+/* a new deadline on the queue */
+static void uv_msg_deadline_add(uv_msg_t *socket, uint64_t deadline) {
+   if (deadline && (socket->send_due == 0 || deadline < socket->send_due)) {
+      uv_msg_deadline_update(socket);
+   }
+}
+
+static void uv_msg_deadline_expire(uv_timer_t *timer) {
+   uv_msg_t *socket = timer->data;
+   uint64_t now = uv_now(timer->loop);
+   uv_msg_send_t *req, *next, *expired = NULL;
+   int prio;
+
+   /* unlinked first, since the callbacks can change the queue */
+   for (prio = 0; prio < UV_MSG_PRIORITIES; prio++) {
+      for (req = socket->queue[prio]; req; req = next) {
+         next = req->next;
+         if (req->deadline && now >= req->deadline) {
+            uv_msg_queue_remove(socket, req);
+            req->next = expired;
+            expired = req;
+         }
+      }
+   }
+   socket->send_due = 0;
+
+   for (req = expired; req; req = next) {
+      next = req->next;
+      req->send_cb((uv_write_t*) req, UV_ETIMEDOUT);
+   }
+   uv_msg_deadline_update(socket);
+}
+
+static void uv_msg_deadline_closed(uv_handle_t *handle) {
+   free(handle);
+}
+
+static void uv_msg_deadline_release(uv_msg_t *socket) {
+   if (!socket->send_timer) return;
+   uv_close((uv_handle_t*) socket->send_timer, uv_msg_deadline_closed);
+   socket->send_timer = NULL;
+   socket->send_due = 0;
+}
+
+static void uv_msg_queue_cancel(uv_msg_t *socket, int status) {
+   int prio;
+
+   for (prio = 0; prio < UV_MSG_PRIORITIES; prio++) {
+      uv_msg_send_t *req, *next;
+      req = socket->queue[prio];
+      socket->queue[prio] = socket->queue_tail[prio] = NULL;
+      for (; req; req = next) {
+         next = req->next;
+         req->queue_prio = -1;
+         socket->queued--;
+         socket->queued_bytes -= uv_msg_entire_size(req);
+         req->send_cb((uv_write_t*) req, status);
+      }
+   }
+}
+
+static void uv_msg_queue_flush(uv_msg_t *socket) {
+
+   if (uv_is_closing((uv_handle_t*) socket)) {
+      uv_msg_queue_cancel(socket, UV_ECANCELED);
+      return;
+   }
+
+   while (socket->queued > 0 && uv_msg_credit_available(socket) &&
+          (socket->max_inflight == 0 || socket->inflight < socket->max_inflight || socket->inflight == 0) &&
+          uv_msg_rate_send_available(socket)) {
+      uv_msg_send_t *req;
+      int prio = 0, rc;
+      while (socket->queue[prio] == NULL) prio++;
+      req = socket->queue[prio];
+      socket->queue[prio] = req->next;
+      if (socket->queue[prio]) {
+         socket->queue[prio]->prev = NULL;
+      } else {
+         socket->queue_tail[prio] = NULL;
+      }
+      req->queue_prio = -1;
+      socket->queued--;
+      socket->queued_bytes -= uv_msg_entire_size(req);
+      if (req->deadline && uv_now(((uv_handle_t*)socket)->loop) >= req->deadline) {
+         req->send_cb((uv_write_t*) req, UV_ETIMEDOUT);
+         continue;
+      }
+      uv_msg_credit_use(socket, uv_msg_entire_size(req) - 4);
+      uv_msg_rate_use(&socket->send_rate, uv_msg_entire_size(req) - 4);
+
+      socket->inflight += uv_msg_entire_size(req);
+      rc = uv_msg_transmit(socket, req, uv_msg_queue_sent);
+      if (rc) {
+         /* the request was already accepted, so report the error on its callback */
+         socket->inflight -= uv_msg_entire_size(req);
+         req->send_cb((uv_write_t*) req, rc);
+      }
+   }
+
+   if (socket->queued == 0 && socket->send_due) {
+      uv_timer_stop(socket->send_timer);
+      socket->send_due = 0;
+   }
+}
+
+/* accounts a message accepted for sending */
+static void uv_msg_accept(uv_msg_t *socket, uv_msg_send_t *req) {
+
+   socket->activity++;
+   req->socket = socket;
+   req->queue_prio = -1;
+   UV_MSG_PROBE3(write_queued, socket, uv_msg_entire_size(req) - 4, socket->queued_bytes);
+
+   if (socket->capture_cb) {
+      if (req->buf[1].base) {
+         socket->capture_cb(socket, UV_MSG_CAPTURE_SEND, req->buf[1].base, req->buf[1].len);
+      } else {
+         socket->capture_cb(socket, UV_MSG_CAPTURE_SEND, req->buf[0].base + 4, req->buf[0].len - 4);
+      }
+   }
+}
+
+static int uv_msg_submit(uv_msg_t *socket, uv_msg_send_t *req, int priority, uv_write_cb write_cb) {
+   int rc;
+
+   /* checked before the direct path, so it does not depend on the queueing */
+   if (priority < 0 || priority >= UV_MSG_PRIORITIES) return UV_EINVAL;
+
+   rc = uv_msg_memory_check(socket);
+   if (rc) return rc;
+
+   uv_msg_accept(socket, req);
+
+   if (socket->max_inflight == 0 && socket->credit_window_msgs == 0 && !uv_msg_rate_active(&socket->send_rate)) {
+      /* accounted in flight like the queued ones, until its callback */
+      req->send_cb = write_cb;
+      socket->inflight += uv_msg_entire_size(req);
+      rc = uv_msg_transmit(socket, req, uv_msg_queue_sent);
+      if (rc) socket->inflight -= uv_msg_entire_size(req);
+      return rc;
+   }
+
+   if (uv_is_closing((uv_handle_t*) socket)) return UV_EPIPE;
+
+   req->send_cb = write_cb;
+   req->next = NULL;
+   req->prev = socket->queue_tail[priority];
+   req->queue_prio = priority;
+   req->deadline = socket->send_timeout ? uv_now(((uv_handle_t*)socket)->loop) + socket->send_timeout : 0;
+   if (socket->queue_tail[priority]) {
+      socket->queue_tail[priority]->next = req;
+   } else {
+      socket->queue[priority] = req;
+   }
+   socket->queue_tail[priority] = req;
+   socket->queued++;
+   socket->queued_bytes += uv_msg_entire_size(req);
+
+   uv_msg_queue_flush(socket);
+   if (req->queue_prio >= 0) uv_msg_deadline_add(socket, req->deadline);
+   return 0;
+}
+
+/* sends the rest of a message when its first bytes were written with
+   uv_try_write() with nothing queued on the stream. it is accounted like the
+   other messages, but it is handed to the transport at once, since the peer
+   already received the start of it. if it fails the stream is shut down */
+int uv_msg_send_rest(uv_msg_send_t *req, uv_msg_t *socket, void *msg, int size, int written, uv_write_cb write_cb) {
+   uv_stream_t *stream = (uv_stream_t*) socket;
+   int rc;
+
+   if ( !req || !socket || !msg || size <= 0 || written < 0 || written >= size + 4 ) return UV_EINVAL;
+   if (stream->type != UV_TCP && stream->type != UV_NAMED_PIPE) return UV_EINVAL;
+#ifndef _WIN32
+   if (socket->shm) return UV_EINVAL;
+#endif
+
+   req->msg_size = htonl(size);
+   req->buf[0] = uv_buf_init((char*) &req->msg_size, 4);
+   req->buf[1] = uv_buf_init(msg, size);
+   uv_msg_accept(socket, req);
+
+   /* skip the bytes already written */
+   if (written >= 4) {
+      req->buf[0] = uv_buf_init(msg + written - 4, size - (written - 4));
+      req->buf[1] = uv_buf_init(NULL, 0);
+   } else {
+      req->buf[0].base += written;
+      req->buf[0].len -= written;
+   }
+
+   req->send_cb = write_cb;
+   socket->inflight += uv_msg_entire_size(req);
+   rc = uv_msg_write(socket, req, uv_msg_queue_sent);
+   if (rc) {
+      socket->inflight -= uv_msg_entire_size(req);
+      uv_msg_write_fail(socket);
+   }
+   return rc;
+}
+
+int uv_msg_set_max_inflight(uv_msg_t *socket, size_t max_inflight) {
+   if (!socket) return UV_EINVAL;
+   /* without a limit the queued messages are released at once */
+   socket->max_inflight = max_inflight ? max_inflight : (size_t) -1;
+   uv_msg_queue_flush(socket);
+   socket->max_inflight = max_inflight;
+   return 0;
+}
+
+/* the timeout of the messages sent after this call */
+int uv_msg_set_send_timeout(uv_msg_t *socket, unsigned int timeout) {
+   if (!socket) return UV_EINVAL;
+   socket->send_timeout = timeout;
+   return 0;
+}
+
+/* sets the timeout of a message that is still on the send queue. returns
+   UV_EBUSY if it was already handed to the transport */
+int uv_msg_send_timeout(uv_msg_send_t *req, unsigned int timeout) {
+
+   if (!req || !req->socket) return UV_EINVAL;
+   if (req->queue_prio < 0) return UV_EBUSY;
+   req->deadline = timeout ? uv_now(((uv_handle_t*)req->socket)->loop) + timeout : 0;
+   uv_msg_deadline_add(req->socket, req->deadline);
+   return 0;
+}
+
+/* removes a message from the send queue. its callback is called with
+   UV_ECANCELED before returning. returns UV_EBUSY if it was already handed to
+   the transport */
+int uv_msg_send_cancel(uv_msg_send_t *req) {
+   uv_msg_t *socket;
+
+   if (!req || !req->socket) return UV_EINVAL;
+   socket = req->socket;
+   if (req->queue_prio < 0) return UV_EBUSY;
+
+   uv_msg_queue_remove(socket, req);
+   req->send_cb((uv_write_t*) req, UV_ECANCELED);
+   return 0;
+}
+
+
+/* Control Frames ************************************************************/
+
+/* A control frame has the high bit of the length set. The first byte of its
+   payload is the frame type */
+
+#define UV_MSG_CONTROL_CREDIT  'C'
+#define UV_MSG_CONTROL_BATCH   'B'
+#define UV_MSG_CONTROL_ACK     'A'
+#define UV_MSG_CONTROL_SEQ     'S'
+#define UV_MSG_CONTROL_MAX     16
+
+struct uv_msg_control_s {
+   uv_msg_send_t req;
+   char frame[4 + UV_MSG_CONTROL_MAX];
+};
+
+static void uv_msg_control_sent(uv_write_t *req, int status) {
+   free(req);
+}
+
+static int uv_msg_send_control(uv_msg_t *socket, int type, const void *data, int size) {
+   struct uv_msg_control_s *ctl;
+   unsigned int header;
+   int rc;
+
+   if (size + 1 > UV_MSG_CONTROL_MAX) return UV_EINVAL;
+   if (uv_is_closing((uv_handle_t*) socket)) return UV_EPIPE;
+
+   ctl = malloc(sizeof(struct uv_msg_control_s));
+   if (!ctl) return UV_ENOMEM;
+
+   header = htonl(UV_MSG_CONTROL_FLAG | (size + 1));
+   memcpy(ctl->frame, &header, 4);
+   ctl->frame[4] = type;
+   if (size > 0) memcpy(ctl->frame + 5, data, size);
+   ctl->req.msg_size = header;
+   ctl->req.buf[0] = uv_buf_init(ctl->frame, size + 5);
+   ctl->req.buf[1] = uv_buf_init(NULL, 0);
+
+   /* control frames are not subject to the queue or the credits */
+   rc = uv_msg_transmit(socket, &ctl->req, uv_msg_control_sent);
+   if (rc) free(ctl);
+   return rc;
+}
+
+static void uv_msg_on_credit(uv_msg_t *socket, const char *data, int size);
+static void uv_msg_on_ack(uv_msg_t *socket, int type, const char *data, int size);
+
+static void uv_msg_on_control(uv_msg_t *socket, char *data, int size) {
+   if (size < 1) return;
+   switch (data[0]) {
+   case UV_MSG_CONTROL_CREDIT:
+      uv_msg_on_credit(socket, data + 1, size - 1);
+      break;
+   case UV_MSG_CONTROL_ACK:
+   case UV_MSG_CONTROL_SEQ:
+      uv_msg_on_ack(socket, data[0], data + 1, size - 1);
+      break;
+   default:
+      /* unknown control frames are ignored. the batches are delivered by
+         uv_stream_msg_parse(), within the budget */
+      break;
+   }
+}
+
+
+/* Flow Control **************************************************************/
+
+/* With uv_msg_set_credits() on both endpoints each one grants to the other a
+   window of messages and bytes that can be sent before it reads them. The
+   sender keeps the messages on its queue while it has no credits, and the
+   receiver grants more credits with a control frame once half of the window
+   was delivered to the application. A single message can exceed the bytes
+   window, so big messages do not get stuck. */
+
+static int uv_msg_credit_available(uv_msg_t *socket) {
+   return socket->credit_window_msgs == 0 ||
+          (socket->credit_msgs > 0 && socket->credit_bytes > 0);
+}
+
+static void uv_msg_credit_use(uv_msg_t *socket, int size) {
+   if (socket->credit_window_msgs == 0) return;
+   socket->credit_msgs--;
+   socket->credit_bytes -= size;
+}
+
+static int uv_msg_credit_grant(uv_msg_t *socket, int msgs, int bytes) {
+   unsigned int credit[2];
+   credit[0] = htonl(msgs);
+   credit[1] = htonl(bytes);
+   return uv_msg_send_control(socket, UV_MSG_CONTROL_CREDIT, credit, sizeof credit);
+}
+
+static void uv_msg_on_credit(uv_msg_t *socket, const char *data, int size) {
+   unsigned int credit[2];
+   if (size < (int) sizeof credit) return;
+   memcpy(credit, data, sizeof credit);
+   socket->credit_msgs += (int) ntohl(credit[0]);
+   socket->credit_bytes += (int) ntohl(credit[1]);
+   uv_msg_queue_flush(socket);
+}
+
+/* called when a message is delivered to the application */
+static void uv_msg_credit_consumed(uv_msg_t *socket, int size) {
+   if (socket->credit_window_msgs == 0) return;
+   socket->consumed_msgs++;
+   socket->consumed_bytes += size;
+   if (socket->consumed_msgs >= (socket->credit_window_msgs + 1) / 2 ||
+       socket->consumed_bytes >= (socket->credit_window_bytes + 1) / 2) {
+      if (uv_msg_credit_grant(socket, socket->consumed_msgs, socket->consumed_bytes) == 0) {
+         socket->consumed_msgs = 0;
+         socket->consumed_bytes = 0;
+      }
+   }
+}
+
+int uv_msg_set_credits(uv_msg_t *socket, int max_messages, int max_bytes) {
+   int rc;
+
+   if (!socket || max_messages < 0 || max_bytes < 0 || (max_messages == 0) != (max_bytes == 0)) return UV_EINVAL;
+   if (((uv_handle_t*)socket)->type == UV_UDP || socket->shm) return UV_EINVAL;
+
+   if (max_messages > 0 && socket->credit_window_msgs == 0) {
+      /* the initial window granted to the peer */
+      rc = uv_msg_credit_grant(socket, max_messages, max_bytes);
+      if (rc) return rc;
+   }
+
+   socket->credit_window_msgs = max_messages;
+   socket->credit_window_bytes = max_bytes;
+   /* without credits the queued messages are released */
+   uv_msg_queue_flush(socket);
+   return 0;
+}
+
+
+/* Acknowledgements **********************************************************/
+
+/* The delivered messages are numbered on the receiver. With acknowledgements
+   enabled it reports to the peer, after each read, the sequence number of the
+   next message it expects. The sender can set the number of the next message
+   it sends with uv_msg_send_sequence(), for example after a reconnection, and
+   receives the acknowledgements on the ack_cb. When the socket is closed the
+   ack_cb receives UV_MSG_SEQ_CLOSED, so its owner can drop the socket. See
+   uv_msg_journal.c */
+
+static int uv_msg_send_seq(uv_msg_t *socket, int type, uint64_t seq) {
+   unsigned int data[2];
+   data[0] = htonl((unsigned int)(seq >> 32));
+   data[1] = htonl((unsigned int) seq);
+   return uv_msg_send_control(socket, type, data, sizeof data);
+}
+
+static void uv_msg_on_ack(uv_msg_t *socket, int type, const char *data, int size) {
+   unsigned int value[2];
+   uint64_t seq;
+
+   if (size < (int) sizeof value) return;
+   memcpy(value, data, sizeof value);
+   seq = ((uint64_t) ntohl(value[0]) << 32) | ntohl(value[1]);
+
+   if (type == UV_MSG_CONTROL_SEQ) {
+      socket->recv_seq = seq;
+      socket->acked_seq = seq;
+   } else if (socket->ack_cb) {
+      socket->ack_cb(socket, seq);
+   }
+}
+
+/* called at the end of each read */
+static void uv_msg_ack_flush(uv_msg_t *socket) {
+   if (!socket->acks || socket->recv_seq == socket->acked_seq) return;
+   if (uv_msg_send_seq(socket, UV_MSG_CONTROL_ACK, socket->recv_seq) == 0) {
+      socket->acked_seq = socket->recv_seq;
+   }
+}
+
+/* called when the socket is closed */
+static void uv_msg_ack_close(uv_msg_t *socket) {
+   uv_msg_ack_cb ack_cb = socket->ack_cb;
+   if (!ack_cb) return;
+   socket->ack_cb = NULL;
+   ack_cb(socket, UV_MSG_SEQ_CLOSED);
+   socket->ack_data = NULL;
+}
+
+int uv_msg_set_acks(uv_msg_t *socket, int enabled) {
+   if (!socket) return UV_EINVAL;
+   if (((uv_handle_t*)socket)->type == UV_UDP || socket->shm) return UV_EINVAL;
+   socket->acks = enabled ? 1 : 0;
+   return 0;
+}
+
+int uv_msg_set_ack_cb(uv_msg_t *socket, uv_msg_ack_cb ack_cb, void *ack_data) {
+   if (!socket) return UV_EINVAL;
+   socket->ack_cb = ack_cb;
+   socket->ack_data = ack_data;
+   return 0;
+}
+
+int uv_msg_send_sequence(uv_msg_t *socket, uint64_t seq) {
+   if (!socket) return UV_EINVAL;
+   if (((uv_handle_t*)socket)->type == UV_UDP || socket->shm) return UV_EINVAL;
+   return uv_msg_send_seq(socket, UV_MSG_CONTROL_SEQ, seq);
+}
+
+
+/* Message Batching **********************************************************/
+
+/* With uv_msg_set_batching() the small messages written on the same tick of
+   the loop are packed in a single batch frame, a control frame with a record
+   for each message: its length as a varint followed by its bytes. The batch
+   is written when it is full, before a message that is not batched, or at the
+   end of the tick. The receiver delivers each message on its own, so batching
+   is transparent for the application but the peer must support it. */
+
+#define UV_MSG_BATCH_DEFAULT_SIZE  (64 * 1024)
+#define UV_MSG_VARINT_MAX          5
+
+struct uv_msg_batch_s {
+   uv_msg_send_t req;
+   uv_msg_send_t *reqs;       /* the batched messages */
+   uv_msg_send_t *reqs_tail;
+   int size;                  /* bytes used on data, including the header */
+   char data[];
+};
+
+static void uv_msg_batch_complete(struct uv_msg_batch_s *batch, int status) {
+   uv_msg_send_t *req, *next;
+
+   for (req = batch->reqs; req; req = next) {
+      next = req->next;
+      req->write_cb((uv_write_t*) req, status);
+   }
+   free(batch);
+}
+
+static void uv_msg_batch_sent(uv_write_t *req, int status) {
+   uv_msg_batch_complete((struct uv_msg_batch_s*) req, status);
+}
+
+static void uv_msg_batch_flush(uv_msg_t *socket) {
+   struct uv_msg_batch_s *batch = socket->batch;
+   unsigned int header;
+   int rc;
+
+   if (!batch) return;
+   socket->batch = NULL;
+
+   if (batch->reqs == batch->reqs_tail) {
+      /* a single message is written as usual */
+      uv_msg_send_t *req = batch->reqs;
+      free(batch);
+      rc = uv_msg_write(socket, req, req->write_cb);
+      if (rc) req->write_cb((uv_write_t*) req, rc);
+      return;
+   }
+
+   header = htonl(UV_MSG_CONTROL_FLAG | (batch->size - 4));
+   memcpy(batch->data, &header, 4);
+   batch->req.msg_size = header;
+   batch->req.buf[0] = uv_buf_init(batch->data, batch->size);
+   batch->req.buf[1] = uv_buf_init(NULL, 0);
+
+   rc = uv_msg_write(socket, &batch->req, uv_msg_batch_sent);
+   /* the messages were already accepted, so report the error on their callbacks */
+   if (rc) uv_msg_batch_complete(batch, rc);
+}
+
+static int uv_msg_batch_add(uv_msg_t *socket, uv_msg_send_t *req, uv_write_cb write_cb) {
+   struct uv_msg_batch_s *batch = socket->batch;
+   int size = UV_MSG_FRAME_SIZE(&req->msg_size);
+   char *msg = req->buf[1].base ? req->buf[1].base : req->buf[0].base + 4;
+   unsigned int value = size;
+   char *ptr;
+
+   if (batch && batch->size + UV_MSG_VARINT_MAX + size > socket->batch_max_size) {
+      uv_msg_batch_flush(socket);
+      batch = NULL;
+   }
+
+   if (!batch) {
+      batch = malloc(sizeof(struct uv_msg_batch_s) + socket->batch_max_size);
+      if (!batch) return UV_ENOMEM;
+      batch->reqs = batch->reqs_tail = NULL;
+      batch->data[4] = UV_MSG_CONTROL_BATCH;
+      batch->size = 5;
+      socket->batch = batch;
+   }
+
+   if (socket->batch_msgs++ == 0) {
+      uv_msg_loop_activate(socket->msg_loop);
+      socket->batch_next = socket->msg_loop->batched;
+      socket->msg_loop->batched = socket;
+   }
+
+   ptr = batch->data + batch->size;
+   do {
+      *ptr = value & 0x7f;
+      value >>= 7;
+      if (value) *ptr |= 0x80;
+      ptr++;
+   } while (value);
+   memcpy(ptr, msg, size);
+   batch->size = (int)(ptr - batch->data) + size;
+
+   req->write_cb = write_cb;
+   req->next = NULL;
+   if (batch->reqs_tail) {
+      batch->reqs_tail->next = req;
+   } else {
+      batch->reqs = req;
+   }
+   batch->reqs_tail = req;
+   return 0;
+}
+
+/* called at the end of the tick */
+static void uv_msg_batch_flush_all(uv_msg_loop_t *ctx) {
+   uv_msg_t *socket = ctx->batched;
+
+   ctx->batched = NULL;
+   while (socket) {
+      uv_msg_t *next = socket->batch_next;
+      socket->batch_msgs = 0;
+      socket->batch_next = NULL;
+      uv_msg_batch_flush(socket);
+      socket = next;
+   }
+}
+
+/* called when the socket is closed */
+static void uv_msg_batch_cancel(uv_msg_t *socket) {
+   uv_msg_t **psocket;
+
+   if (socket->batch_msgs > 0) {
+      for (psocket = &socket->msg_loop->batched; *psocket; psocket = &(*psocket)->batch_next) {
+         if (*psocket == socket) { *psocket = socket->batch_next; break; }
+      }
+      socket->batch_msgs = 0;
+   }
+   if (socket->batch) {
+      struct uv_msg_batch_s *batch = socket->batch;
+      socket->batch = NULL;
+      uv_msg_batch_complete(batch, UV_ECANCELED);
+   }
+}
+
+static int uv_msg_budget_check(uv_msg_t *uvmsg, int budgeted, int delivered, uint64_t deadline);
+static void uv_stream_msg_abort(uv_msg_t *uvmsg);
+
+/* delivers the messages of a batch, each one within the budget and accepted by
+   the peek_cb. returns the size of the records left when the budget is
+   exhausted, 0 when all of them were delivered, or -1 when the peek_cb
+   rejected the connection */
+static int uv_msg_on_batch(uv_msg_t *socket, char *data, int size, int budgeted, int *delivered, uint64_t deadline) {
+   char *end = data + size;
+
+   while (data < end && !uv_is_closing((uv_handle_t*) socket)) {
+      unsigned int len = 0;
+      int shift = 0;
+      char *record = data;
+      do {
+         if (data == end || shift > 28) return 0;
+         len |= (unsigned int)(*data & 0x7f) << shift;
+         shift += 7;
+      } while (*data++ & 0x80);
+      if (len > (unsigned int)(end - data)) return 0;
+      if (!uv_msg_budget_check(socket, budgeted, *delivered, deadline)) return (int)(end - record);
+      if (socket->peek_cb) {
+         int peek_len = (int) len < socket->peek_size ? (int) len : socket->peek_size;
+         int action = socket->peek_cb(socket, (int) len, data, peek_len);
+         if (action == UV_MSG_CLOSE) {
+            uv_stream_msg_abort(socket);
+            return -1;
+         }
+         if (action == UV_MSG_SKIP) {
+            /* the sender still counts it */
+            uv_msg_credit_consumed(socket, (int) len);
+            socket->recv_seq++;
+            data += len;
+            continue;
+         }
+      }
+      uv_msg_deliver(socket, data, (int) len);
+      uv_msg_credit_consumed(socket, (int) len);
+      uv_msg_rate_use(&socket->recv_rate, (int) len);
+      socket->recv_seq++;
+      (*delivered)++;
+      data += len;
+   }
+   return 0;
+}
+
+int uv_msg_set_batching(uv_msg_t *socket, int max_msg_size, int max_batch_size) {
+   int rc;
+
+   if (!socket || max_msg_size < 0 || max_batch_size < 0) return UV_EINVAL;
+   if (((uv_handle_t*)socket)->type == UV_UDP || socket->shm) return UV_EINVAL;
+
+   if (max_batch_size == 0) max_batch_size = UV_MSG_BATCH_DEFAULT_SIZE;
+   /* the batch must hold at least 2 messages */
+   if (max_msg_size > 0 && max_batch_size < 5 + 2 * (UV_MSG_VARINT_MAX + max_msg_size)) return UV_EINVAL;
+
+   if (max_msg_size > 0) {
+      rc = uv_msg_loop_attach(socket);
+      if (rc) return rc;
+   }
+
+   uv_msg_batch_flush(socket);
+   socket->batch_max_msg = max_msg_size;
+   socket->batch_max_size = max_batch_size;
+   return 0;
+}
+
+
+/* Message Sending ***********************************************************/
+
+int uv_msg_send_prio(uv_msg_send_t *req, uv_msg_t *socket, int priority, void *msg, int size, uv_write_cb write_cb) {
+
+   if ( !req || !socket || !msg || size <= 0 ) return UV_EINVAL;
+
+   UVTRACE(("sending message: %s\n", (char*)msg));
+
+   req->msg_size = htonl(size);
+   req->buf[0].base = (char*) &req->msg_size;
+   req->buf[0].len = 4;
+   req->buf[1] = uv_buf_init(msg, size);
+
+   return uv_msg_submit(socket, req, priority, write_cb);
+}
+
+int uv_msg_send(uv_msg_send_t *req, uv_msg_t *socket, void *msg, int size, uv_write_cb write_cb) {
+   return uv_msg_send_prio(req, socket, UV_MSG_PRIO_NORMAL, msg, size, write_cb);
+}
+
+/* sends a message that is already preceded by its length (in network order).
+   the size includes the 4 bytes of the length */
+int uv_msg_send_frame_prio(uv_msg_send_t *req, uv_msg_t *socket, int priority, void *frame, int size, uv_write_cb write_cb) {
+
+   if ( !req || !socket || !frame || size <= 4 ) return UV_EINVAL;
+
+   memcpy(&req->msg_size, frame, 4);
+   req->buf[0] = uv_buf_init(frame, size);
+   req->buf[1] = uv_buf_init(NULL, 0);
+
+   return uv_msg_submit(socket, req, priority, write_cb);
+}
+
+int uv_msg_send_frame(uv_msg_send_t *req, uv_msg_t *socket, void *frame, int size, uv_write_cb write_cb) {
+   return uv_msg_send_frame_prio(req, socket, UV_MSG_PRIO_NORMAL, frame, size, write_cb);
+}
+
+
+/* Message Peeking ***********************************************************/
+
+/* The peek callback receives the size and the first bytes of each message
+   before the buffer grows to hold it, and decides if the message is read and
+   delivered, discarded or if the connection must be dropped. The discarded
+   messages are drained from the socket using the normal read buffer, so a big
+   unwanted message does not allocate its size. */
+
+/* the message at the start of the buffer was not accepted yet */
+static int uv_stream_msg_peeking(uv_msg_t *uvmsg) {
+   return uvmsg->peek_cb && !uvmsg->peeked && uvmsg->filled >= 4 && !UV_MSG_IS_CONTROL(uvmsg->buf);
+}
+
+void uv_stream_msg_free_buffer(uv_msg_t *uvmsg);
+
+/* stops reading and reports the rejected connection */
+static void uv_stream_msg_abort(uv_msg_t *uvmsg) {
+   uv_read_stop((uv_stream_t*) uvmsg);
+   if( uvmsg->deferred ) uv_msg_deferred_remove(uvmsg);
+   uvmsg->skip = -1;
+   uvmsg->filled = 0;
+   uv_stream_msg_free_buffer(uvmsg);
+   uvmsg->msg_read_cb(uvmsg, NULL, UV_ECONNABORTED);
+}
+
+/* peek_size is the number of bytes of each message passed to the callback. the
+   shorter messages are passed entirely */
+int uv_msg_set_peek(uv_msg_t *uvmsg, uv_msg_peek_cb peek_cb, int peek_size) {
+   if( !uvmsg || peek_size < 0 ) return UV_EINVAL;
+   if( ((uv_handle_t*)uvmsg)->type == UV_UDP || uvmsg->shm ) return UV_EINVAL;
+   uvmsg->peek_cb = peek_cb;
+   uvmsg->peek_size = peek_size;
+   return 0;
+}
+
+/* Message Reading ***********************************************************/
+
+/* With ownership enabled each message is delivered in its own buffer, allocated
+   with the alloc_cb, and the application must release it with the free_cb.
+   Without read-ahead only the length of each message is read on the handle and
+   the rest is read directly on its own buffer. The messages that were read
+   together with others are copied to a new buffer. */
+
+static void uv_msg_deliver(uv_msg_t *uvmsg, char *msg, int size) {
+   uvmsg->activity++;
+   UV_MSG_PROBE2(frame_delivered, uvmsg, size);
+   if( uvmsg->owned && size > 0 ){
+      uv_buf_t buf = {0};
+      uvmsg->alloc_cb((uv_handle_t*)uvmsg, size, &buf);
+      if( buf.base==0 || buf.len < (size_t)size ){
+         if( buf.base && uvmsg->free_cb ) uvmsg->free_cb((uv_handle_t*)uvmsg, buf.base);
+         uvmsg->msg_read_cb(uvmsg, NULL, UV_ENOBUFS);
+         return;
+      }
+      memcpy(buf.base, msg, size);
+      msg = buf.base;
+   } else if( uvmsg->owned ){
+      msg = NULL;
+   }
+   uvmsg->msg_read_cb(uvmsg, msg, size);
+}
+
+int uv_msg_set_ownership(uv_msg_t *uvmsg, int enabled) {
+   if( !uvmsg ) return UV_EINVAL;
+   uvmsg->owned = enabled ? 1 : 0;
+   return 0;
+}
+
+/* how many bytes can be read past the end of the current message, using the
+   free space of the buffer. 0 = read each message up to its end only (default) */
+int uv_msg_set_read_ahead(uv_msg_t *uvmsg, int size) {
+   if( !uvmsg || size < UV_MSG_READ_AHEAD_ALL ) return UV_EINVAL;
+   uvmsg->read_ahead = size;
+   return 0;
+}
+
+/* the capture callback receives the bytes read from the socket and the
+   messages accepted for sending. see uv_msg_capture.c */
+int uv_msg_set_capture(uv_msg_t *uvmsg, uv_msg_capture_cb capture_cb, void *capture_data) {
+   if( !uvmsg ) return UV_EINVAL;
+   uvmsg->capture_cb = capture_cb;
+   uvmsg->capture_data = capture_data;
+   return 0;
+}
+
+void uv_stream_msg_free_buffer(uv_msg_t *uvmsg) {
+   if( uvmsg->buf ){
+      UV_MSG_PROBE2(buffer_free, uvmsg, uvmsg->alloc_size);
+   }
+#ifdef __linux__
+   if( uvmsg->buf_mapped ){
+      munmap(uvmsg->buf, uvmsg->alloc_size);
+      uvmsg->buf_mapped = 0;
+   } else
+#endif
+   if( uvmsg->free_cb ) uvmsg->free_cb((uv_handle_t*)uvmsg, uvmsg->buf);
+   uvmsg->buf = 0;
+   uvmsg->alloc_size = 0;
+}
+
+static void uv_stream_msg_free_frame(uv_msg_t *uvmsg) {
+   if( uvmsg->frame && uvmsg->free_cb ) uvmsg->free_cb((uv_handle_t*)uvmsg, uvmsg->frame);
+   uvmsg->frame = NULL;
+}
+
+#ifdef __linux__
+/* big buffers are mapped directly from the OS, so they can grow without copying
+   the received data and their memory is returned as soon as they are released */
+static int uv_stream_msg_map(uv_msg_t *uvmsg, size_t size) {
+   size_t page = sysconf(_SC_PAGESIZE);
+   char *ptr;
+
+   size = (size + page - 1) & ~(page - 1);
+   if( size > 0x7fffffff ) return 0;
+
+   if( uvmsg->buf_mapped ){
+      ptr = mremap(uvmsg->buf, uvmsg->alloc_size, size, MREMAP_MAYMOVE);
+      if( ptr==MAP_FAILED ) return 0;
+   } else {
+      ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if( ptr==MAP_FAILED ) return 0;
+      if( uvmsg->buf ){
+         memcpy(ptr, uvmsg->buf, uvmsg->filled);
+         if( uvmsg->free_cb ) uvmsg->free_cb((uv_handle_t*)uvmsg, uvmsg->buf);
+      }
+   }
+#ifdef MADV_HUGEPAGE
+   if( uvmsg->mmap_flags & UV_MSG_MMAP_HUGEPAGES ) madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+   uvmsg->buf = ptr;
+   uvmsg->alloc_size = size;
+   uvmsg->buf_mapped = 1;
+   return 1;
+}
+#endif
+
+int uv_msg_set_mmap_threshold(uv_msg_t *uvmsg, size_t threshold, int flags) {
+   if( !uvmsg ) return UV_EINVAL;
+#ifdef __linux__
+   uvmsg->mmap_threshold = threshold;
+   uvmsg->mmap_flags = flags;
+   return 0;
+#else
+   return UV_ENOTSUP;
+#endif
+}
+
+int uv_stream_msg_realloc(uv_handle_t *handle, size_t suggested_size) {
+   uv_msg_t *uvmsg = (uv_msg_t*) handle;
+   uv_buf_t buf = {0};
+   UV_MSG_PROBE3(buffer_realloc, uvmsg, uvmsg->alloc_size, suggested_size);
+#ifdef __linux__
+   if( uvmsg->buf_mapped || (uvmsg->mmap_threshold && suggested_size >= uvmsg->mmap_threshold) ){
+      return uv_stream_msg_map(uvmsg, suggested_size);
+   }
+#endif
+   uvmsg->alloc_cb(handle, suggested_size, &buf);
+   if( buf.base==0 || buf.len < suggested_size ) return 0;  //! if buf.len < suggested_size and buf.base is valid it will be lost here (the allocated memory)
+   memcpy(buf.base, uvmsg->buf, uvmsg->filled);
+   if( uvmsg->free_cb ) uvmsg->free_cb(handle, uvmsg->buf);
+   uvmsg->buf = buf.base;
+   uvmsg->alloc_size = buf.len;
+   return 1;
+}
+
+/* moves the incomplete message from the shared buffer to its own buffer.
+   returns 0 if there is no incomplete message with a known length */
+static int uv_stream_msg_own_frame(uv_msg_t *uvmsg) {
+   uv_buf_t buf = {0};
+   int msg_size;
+
+   if( uvmsg->filled < 4 ) return 0;
+   if( UV_MSG_IS_CONTROL(uvmsg->buf) ) return 0;
+   if( uv_stream_msg_peeking(uvmsg) ) return 0;
+   msg_size = UV_MSG_FRAME_SIZE(uvmsg->buf);
+   if( uvmsg->filled >= msg_size + 4 ) return 0;
+   /* a message that fits on the buffer is read together with the next ones */
+   if( uvmsg->read_ahead != 0 && msg_size + 4 <= uvmsg->alloc_size ) return 0;
+
+   uvmsg->alloc_cb((uv_handle_t*)uvmsg, msg_size, &buf);
+   if( buf.base==0 || buf.len < (size_t)msg_size ){
+      if( buf.base && uvmsg->free_cb ) uvmsg->free_cb((uv_handle_t*)uvmsg, buf.base);
+      return 0;
+   }
+   UV_MSG_PROBE2(buffer_alloc, uvmsg, buf.len);
+   uvmsg->frame = buf.base;
+   uvmsg->frame_size = msg_size;
+   uvmsg->frame_filled = uvmsg->filled - 4;
+   memcpy(uvmsg->frame, uvmsg->buf + 4, uvmsg->frame_filled);
+
+   uvmsg->filled = 0;
+   uv_stream_msg_free_buffer(uvmsg);
+   return 1;
+}
+
+void uv_stream_msg_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *stream_buf) {
+   uv_msg_t *uvmsg = (uv_msg_t*) handle;
+
+   UVTRACE(("stream_msg_alloc  uvmsg=%p\n", uvmsg));
+   if( uvmsg==0 ) return;
+
+   if( uvmsg->owned && (uvmsg->frame || uv_stream_msg_own_frame(uvmsg)) ){
+      /* read only up to the end of this message, directly on its own buffer */
+      stream_buf->base = uvmsg->frame + uvmsg->frame_filled;
+      stream_buf->len = uvmsg->frame_size - uvmsg->frame_filled;
+      return;
+   }
+
+   if( uvmsg->owned && uvmsg->read_ahead == 0 && uvmsg->buf==0 && !uvmsg->peek_cb ){
+      /* read only the length of the next message, so it is read on its own buffer */
+      stream_buf->base = (char*) &uvmsg->frame_header + uvmsg->frame_header_filled;
+      stream_buf->len = 4 - uvmsg->frame_header_filled;
+      return;
+   }
+
+   if( uvmsg->buf==0 ){
+      uv_buf_t buf = {0};
+      uvmsg->alloc_cb(handle, suggested_size, &buf);
+      uvmsg->buf = buf.base;
+      if( uvmsg->buf==0 ) return;
+      uvmsg->alloc_size = buf.len;
+      UV_MSG_PROBE2(buffer_alloc, uvmsg, buf.len);
+   }
+
+   UVTRACE(("stream_msg_alloc  uvmsg->buf=%p  filled=%d\n", uvmsg->buf, uvmsg->filled));
+
+   if( uvmsg->filled >= 4 ){
+      int msg_size = UV_MSG_FRAME_SIZE(uvmsg->buf);
+      int entire_msg_size = msg_size + 4;
+      UVTRACE(("stream_msg_alloc  msg_size=%d\n", msg_size));
+      if( uvmsg->alloc_size < entire_msg_size && uv_stream_msg_peeking(uvmsg) ){
+         /* only the bytes for the peek callback are needed until the message is accepted */
+         int peek_msg_size = 4 + (msg_size < uvmsg->peek_size ? msg_size : uvmsg->peek_size);
+         if( uvmsg->alloc_size < peek_msg_size && !uv_stream_msg_realloc(handle, peek_msg_size) ){
+            stream_buf->base = 0;
+            return;
+         }
+         stream_buf->base = uvmsg->buf + uvmsg->filled;
+         stream_buf->len = uvmsg->alloc_size - uvmsg->filled;
+         return;
+      }
+      if( uvmsg->alloc_size < entire_msg_size ){
+         /* here the suggested size is exactly what it's needed to read the entire message */
+         if( !uv_stream_msg_realloc(handle, entire_msg_size) ){
+            stream_buf->base = 0;
+            return;
+         }
+      }
+      stream_buf->len = entire_msg_size - uvmsg->filled;
+      if( uvmsg->read_ahead != 0 ){
+         /* also read the next messages that are already waiting on the socket */
+         int space = uvmsg->alloc_size - entire_msg_size;
+         if( uvmsg->read_ahead > 0 && space > uvmsg->read_ahead ) space = uvmsg->read_ahead;
+         stream_buf->len += space;
+      }
+   } else {
+      if( uvmsg->alloc_size < 4 ){
+         /* There is no enough space for the message length. Allocate the default size */
+         UVTRACE(("calling realloc - alloc_size: %d, filled: %d\n", uvmsg->alloc_size, uvmsg->filled));
+         if( !uv_stream_msg_realloc(handle, 64 * 1024) ){
+            stream_buf->base = 0;
+            return;
+         }
+      }
+      stream_buf->len = uvmsg->alloc_size - uvmsg->filled;
+   }
+
+   stream_buf->base = uvmsg->buf + uvmsg->filled;
+   UVTRACE(("stream_msg_alloc  base=%p  len=%d\n", stream_buf->base, stream_buf->len));
+}
+
+static void uv_msg_defer(uv_msg_t *socket);
+static int uv_msg_rate_recv_check(uv_msg_t *socket);
+
+/* whether one more message can be delivered on this parse. otherwise the
+   socket is deferred, or waits for tokens on the recv_rate */
+static int uv_msg_budget_check(uv_msg_t *uvmsg, int budgeted, int delivered, uint64_t deadline) {
+   if( !budgeted ) return 1;
+   if( delivered > 0 &&
+       ((uvmsg->budget_msgs && delivered >= uvmsg->budget_msgs) ||
+        (deadline && uv_hrtime() >= deadline)) ){
+      uv_msg_defer(uvmsg);
+      return 0;
+   }
+   return uv_msg_rate_recv_check(uvmsg);
+}
+
+/* delivers the complete messages on the buffer. with a budget the remaining
+   ones are deferred to the next loop iteration, and without tokens on the
+   recv_rate they wait for the timer */
+static void uv_stream_msg_parse(uv_msg_t *uvmsg, int budgeted) {
+   char *ptr = uvmsg->buf;
+   int delivered = 0;
+   uint64_t deadline = 0;
+
+   if( uvmsg->frame ){
+      /* a message read on its own buffer. it is the only one of the read, so
+         it is within the budget */
+      char *frame = uvmsg->frame;
+      if( uvmsg->frame_filled < uvmsg->frame_size ) return;
+      if( budgeted && !uv_msg_rate_recv_check(uvmsg) ) return;
+      uvmsg->frame = NULL;
+      uvmsg->peeked = 0;
+      uvmsg->activity++;
+      UV_MSG_PROBE3(frame_parsed, uvmsg, uvmsg->frame_size, 0);
+      UV_MSG_PROBE2(frame_delivered, uvmsg, uvmsg->frame_size);
+      /* the ownership of the buffer is transferred to the application */
+      uvmsg->msg_read_cb(uvmsg, frame, uvmsg->frame_size);
+      uv_msg_credit_consumed(uvmsg, uvmsg->frame_size);
+      uv_msg_rate_use(&uvmsg->recv_rate, uvmsg->frame_size);
+      uvmsg->recv_seq++;
+      uv_msg_ack_flush(uvmsg);
+      return;
+   }
+
+   if( budgeted && uvmsg->budget_usecs ) deadline = uv_hrtime() + (uint64_t)uvmsg->budget_usecs * 1000;
+
+   while( uvmsg->filled >= 4 ){
+      int msg_size = UV_MSG_FRAME_SIZE(ptr);
+      int entire_msg = msg_size + 4;
+      UVTRACE(("msg_size: %d, entire_msg: %d\n", msg_size, entire_msg));
+      if( uvmsg->peek_cb && !uvmsg->peeked && !UV_MSG_IS_CONTROL(ptr) ){
+         int len = msg_size < uvmsg->peek_size ? msg_size : uvmsg->peek_size;
+         int action;
+         if( uvmsg->filled < len + 4 ) break;
+         action = uvmsg->peek_cb(uvmsg, msg_size, ptr + 4, len);
+         if( action == UV_MSG_CLOSE ){
+            uv_stream_msg_abort(uvmsg);
+            return;
+         }
+         if( action == UV_MSG_SKIP ){
+            /* the sender still counts it */
+            uv_msg_credit_consumed(uvmsg, msg_size);
+            uvmsg->recv_seq++;
+            if( uvmsg->filled < entire_msg ){
+               /* the rest is drained as it arrives */
+               uvmsg->skip = entire_msg - uvmsg->filled;
+               uvmsg->filled = 0;
+               break;
+            }
+            if( uvmsg->filled > entire_msg ){
+               ptr += entire_msg;
+            }
+            uvmsg->filled -= entire_msg;
+            continue;
+         }
+         uvmsg->peeked = 1;
+      }
+      if( uvmsg->filled >= entire_msg ){
+         UV_MSG_PROBE3(frame_parsed, uvmsg, msg_size, UV_MSG_IS_CONTROL(ptr));
+         if( UV_MSG_IS_CONTROL(ptr) ){
+            if( msg_size >= 1 && ptr[4] == UV_MSG_CONTROL_BATCH ){
+               int left = uv_msg_on_batch(uvmsg, ptr + 5, msg_size - 1, budgeted, &delivered, deadline);
+               if( left < 0 ) return;
+               if( left > 0 ){
+                  /* the records left stay on the buffer as a smaller batch,
+                     written over the delivered ones */
+                  int consumed = msg_size - 1 - left;
+                  unsigned int header = htonl(UV_MSG_CONTROL_FLAG | (left + 1));
+                  ptr += consumed;
+                  uvmsg->filled -= consumed;
+                  memcpy(ptr, &header, 4);
+                  ptr[4] = UV_MSG_CONTROL_BATCH;
+                  break;
+               }
+            } else {
+               uv_msg_on_control(uvmsg, ptr + 4, msg_size);
+            }
+         } else {
+            if( !uv_msg_budget_check(uvmsg, budgeted, delivered, deadline) ) break;
+            uvmsg->peeked = 0;
+            uv_msg_deliver(uvmsg, ptr + 4, msg_size);
+            uv_msg_credit_consumed(uvmsg, msg_size);
+            uv_msg_rate_use(&uvmsg->recv_rate, msg_size);
+            uvmsg->recv_seq++;
+            delivered++;
+         }
+         if( uvmsg->filled > entire_msg ){
+            ptr += entire_msg;
+         }
+         uvmsg->filled -= entire_msg;
+      } else {
+         break;
+      }
+   }
+
+   if( ptr > uvmsg->buf && uvmsg->filled > 0 ){
+      UVTRACE(("moving the buffer\n"));
+      UV_MSG_PROBE2(buffer_move, uvmsg, uvmsg->filled);
+      memmove(uvmsg->buf, ptr, uvmsg->filled);
+#ifdef __linux__
+      /* return the memory used by the big message */
+      if( uvmsg->buf_mapped && (size_t)uvmsg->alloc_size > uvmsg->mmap_threshold ){
+         uv_stream_msg_map(uvmsg, uvmsg->filled);
+      }
+#endif
+   } else if( uvmsg->filled == 0 ){
+      UVTRACE(("releasing the buffer\n"));
+      uv_stream_msg_free_buffer(uvmsg);
+   }
+
+   uv_msg_ack_flush(uvmsg);
+}
+
+/* the length of the next message was read on the handle. a message is then
+   read on its own buffer, and a control frame on the read buffer */
+static void uv_stream_msg_read_header(uv_msg_t *uvmsg, int nread) {
+   char *header = (char*) &uvmsg->frame_header;
+   int msg_size;
+   uv_buf_t buf = {0};
+
+   uvmsg->frame_header_filled += nread;
+   if( uvmsg->frame_header_filled < 4 ) return;
+   uvmsg->frame_header_filled = 0;
+   msg_size = UV_MSG_FRAME_SIZE(header);
+
+   if( !UV_MSG_IS_CONTROL(header) && msg_size > 0 ){
+      uvmsg->alloc_cb((uv_handle_t*)uvmsg, msg_size, &buf);
+      if( buf.base && buf.len >= (size_t)msg_size ){
+         UV_MSG_PROBE2(buffer_alloc, uvmsg, buf.len);
+         uvmsg->frame = buf.base;
+         uvmsg->frame_size = msg_size;
+         uvmsg->frame_filled = 0;
+         return;
+      }
+      if( buf.base && uvmsg->free_cb ) uvmsg->free_cb((uv_handle_t*)uvmsg, buf.base);
+      buf.base = 0;
+   }
+
+   /* also used when there is no memory for the message, so it fails as usual */
+   uvmsg->alloc_cb((uv_handle_t*)uvmsg, 64 * 1024, &buf);
+   if( buf.base==0 || buf.len < 4 ){
+      if( buf.base && uvmsg->free_cb ) uvmsg->free_cb((uv_handle_t*)uvmsg, buf.base);
+      uvmsg->msg_read_cb(uvmsg, NULL, UV_ENOBUFS);
+      return;
+   }
+   UV_MSG_PROBE2(buffer_alloc, uvmsg, buf.len);
+   uvmsg->buf = buf.base;
+   uvmsg->alloc_size = buf.len;
+   memcpy(uvmsg->buf, header, 4);
+   uvmsg->filled = 4;
+   uv_stream_msg_parse(uvmsg, 1);
+}
+
+void uv_stream_msg_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+   uv_msg_t *uvmsg = (uv_msg_t*) stream;
+
+   UVTRACE(("uv_stream_msg_read: received %d bytes\n", nread));
+   UVTRACE(("uvmsg: %p  uvmsg->buf: %p  buf->base: %p\n", uvmsg, uvmsg->buf, buf->base));
+
+   if (uvmsg == 0) return;
+
+   if (nread == 0) {
+      /* Nothing read */
+      //! does it should release the ->buf here?
+      //uv_stream_msg_free_buffer(uvmsg);
+      return;
+   }
+
+   if (nread < 0) {
+      /* Error */
+      if (uvmsg->deferred) {
+         /* the messages received before the error are delivered first */
+         uv_msg_deferred_remove(uvmsg);
+         uv_stream_msg_parse(uvmsg, 0);
+         if (uvmsg->skip < 0) return;
+      }
+      uv_stream_msg_free_buffer(uvmsg);
+      uv_stream_msg_free_frame(uvmsg);
+      uvmsg->frame_header_filled = 0;
+      uvmsg->msg_read_cb((uv_msg_t*)stream, NULL, nread);
+      return;
+   }
+
+   if (uvmsg->capture_cb) uvmsg->capture_cb(uvmsg, UV_MSG_CAPTURE_READ, buf->base, nread);
+
+   if (uvmsg->frame) {
+      /* reading a message on its own buffer. it goes through the same limits */
+      uvmsg->frame_filled += nread;
+      uv_stream_msg_parse(uvmsg, 1);
+      return;
+   }
+
+   if (buf->base == (char*) &uvmsg->frame_header + uvmsg->frame_header_filled) {
+      uv_stream_msg_read_header(uvmsg, nread);
+      return;
+   }
+
+#ifdef TESTING_UV_MSG_FRAMING
+   assert(buf->base == uvmsg->buf + uvmsg->filled);
+   print_bytes("received", buf->base, nread);
+#endif
+
+   uvmsg->filled += nread;
+
+   if (uvmsg->skip > 0) {
+      /* drain the discarded message. the next ones can follow it */
+      int drained = uvmsg->filled < uvmsg->skip ? uvmsg->filled : uvmsg->skip;
+      uvmsg->skip -= drained;
+      uvmsg->filled -= drained;
+      if (uvmsg->filled > 0) {
+         UV_MSG_PROBE2(buffer_move, uvmsg, uvmsg->filled);
+         memmove(uvmsg->buf, uvmsg->buf + drained, uvmsg->filled);
+      }
+   }
+
+   UVTRACE(("alloc_size: %d, received: %d, filled: %d\n", uvmsg->alloc_size, nread, uvmsg->filled));
+
+   uv_stream_msg_parse(uvmsg, 1);
+
+#ifdef TESTING_UV_MSG_FRAMING
+   uv_async_send(&async_next_step);
+#endif
+}
+
+/* Delivery Budget ***********************************************************/
+
+/* A single read can bring thousands of small messages. With a budget each read
+   delivers at most max_messages or runs for at most max_usecs, then the socket
+   stops reading and the remaining messages are delivered on the next loop
+   iterations, after the I/O of the other sockets. The reading is resumed once
+   the buffer has no complete messages left. */
+
+static void uv_msg_deferred_run(uv_idle_t *idle);
+
+static void uv_msg_defer(uv_msg_t *socket) {
+   struct uv_msg_loop_s *ctx = socket->msg_loop;
+
+   if (socket->deferred || uv_is_closing((uv_handle_t*) socket)) return;
+   uv_read_stop((uv_stream_t*) socket);
+   if (!ctx->deferred) uv_idle_start(&ctx->idle, uv_msg_deferred_run);
+   socket->deferred = 1;
+   socket->deferred_next = ctx->deferred;
+   ctx->deferred = socket;
+}
+
+static void uv_msg_deferred_remove(uv_msg_t *socket) {
+   uv_msg_t **psocket;
+
+   if (!socket->deferred) return;
+   for (psocket = &socket->msg_loop->deferred; *psocket; psocket = &(*psocket)->deferred_next) {
+      if (*psocket == socket) { *psocket = socket->deferred_next; break; }
+   }
+   socket->deferred = 0;
+   socket->deferred_next = NULL;
+   if (!socket->msg_loop->deferred) uv_idle_stop(&socket->msg_loop->idle);
+}
+
+/* restarts the reading stopped while there were messages to deliver */
+static void uv_stream_msg_resume(uv_msg_t *socket) {
+   if (!socket->deferred && !socket->rate_paused && !socket->read_paused &&
+       socket->memory_state == 0 && socket->skip >= 0 &&
+       !uv_is_active((uv_handle_t*) socket) && !uv_is_closing((uv_handle_t*) socket)) {
+      uv_read_start((uv_stream_t*) socket, uv_stream_msg_alloc, uv_stream_msg_read);
+   }
+}
+
+/* runs on the idle phase, so the loop polls for I/O without blocking */
+static void uv_msg_deferred_run(uv_idle_t *idle) {
+   uv_msg_loop_t *ctx = idle->data;
+   uv_msg_t *socket = ctx->deferred;
+
+   /* the sockets deferred again go to the next iteration */
+   ctx->deferred = NULL;
+   while (socket) {
+      uv_msg_t *next = socket->deferred_next;
+      socket->deferred = 0;
+      socket->deferred_next = NULL;
+      if (!uv_is_closing((uv_handle_t*) socket)) {
+         uv_stream_msg_parse(socket, 1);
+         uv_stream_msg_resume(socket);
+      }
+      socket = next;
+   }
+   if (!ctx->deferred) uv_idle_stop(&ctx->idle);
+}
+
+int uv_msg_set_read_budget(uv_msg_t *socket, int max_messages, unsigned int max_usecs) {
+   int rc;
+
+   if (!socket || max_messages < 0) return UV_EINVAL;
+   if (((uv_handle_t*)socket)->type == UV_UDP || socket->shm) return UV_EINVAL;
+
+   if (max_messages > 0 || max_usecs > 0) {
+      rc = uv_msg_loop_attach(socket);
+      if (rc) return rc;
+   }
+
+   socket->budget_msgs = max_messages;
+   socket->budget_usecs = max_usecs;
+   return 0;
+}
+
+/* Rate Limits ***************************************************************/
+
+/* Token buckets limit the messages and bytes per second received and sent by
+   a socket. Each bucket holds up to one second of tokens. A message is
+   delivered or written while there are tokens, even if it is bigger than
+   them, and the deficit is paid with the next ones. Without tokens the socket
+   stops reading, or keeps the messages on its send queue, and waits on a
+   timer shared by the sockets of the loop. */
+
+#define UV_MSG_RATE_MAX_ELAPSED  1000000   /* milliseconds */
+
+static uint64_t uv_msg_rate_now(uv_msg_t *socket) {
+   return uv_now(((uv_handle_t*)socket)->loop);
+}
+
+static int uv_msg_rate_active(struct uv_msg_rate_s *rate) {
+   return rate->msgs_per_sec > 0 || rate->bytes_per_sec > 0;
+}
+
+static void uv_msg_rate_reset(struct uv_msg_rate_s *rate, unsigned int msgs_per_sec,
+                              unsigned int bytes_per_sec, uint64_t now) {
+   rate->msgs_per_sec = msgs_per_sec;
+   rate->bytes_per_sec = bytes_per_sec;
+   rate->msgs = (int64_t) msgs_per_sec * 1000;
+   rate->bytes = (int64_t) bytes_per_sec * 1000;
+   rate->updated = now;
+}
+
+/* refills the bucket and returns if it has tokens */
+static int uv_msg_rate_available(struct uv_msg_rate_s *rate, uint64_t now) {
+   uint64_t elapsed;
+
+   if (!uv_msg_rate_active(rate)) return 1;
+   elapsed = now - rate->updated;
+   if (elapsed > UV_MSG_RATE_MAX_ELAPSED) elapsed = UV_MSG_RATE_MAX_ELAPSED;
+   rate->updated = now;
+
+   rate->msgs += (int64_t) rate->msgs_per_sec * elapsed;
+   if (rate->msgs > (int64_t) rate->msgs_per_sec * 1000) rate->msgs = (int64_t) rate->msgs_per_sec * 1000;
+   rate->bytes += (int64_t) rate->bytes_per_sec * elapsed;
+   if (rate->bytes > (int64_t) rate->bytes_per_sec * 1000) rate->bytes = (int64_t) rate->bytes_per_sec * 1000;
+
+   return (rate->msgs_per_sec == 0 || rate->msgs > 0) &&
+          (rate->bytes_per_sec == 0 || rate->bytes > 0);
+}
+
+static void uv_msg_rate_use(struct uv_msg_rate_s *rate, int size) {
+   if (rate->msgs_per_sec) rate->msgs -= 1000;
+   if (rate->bytes_per_sec) rate->bytes -= (int64_t) size * 1000;
+}
+
+/* milliseconds until the bucket has tokens again */
+static uint64_t uv_msg_rate_delay(struct uv_msg_rate_s *rate) {
+   uint64_t delay = 0, wait;
+
+   if (rate->msgs_per_sec && rate->msgs <= 0) {
+      delay = (uint64_t)(-rate->msgs) / rate->msgs_per_sec + 1;
+   }
+   if (rate->bytes_per_sec && rate->bytes <= 0) {
+      wait = (uint64_t)(-rate->bytes) / rate->bytes_per_sec + 1;
+      if (wait > delay) delay = wait;
+   }
+   return delay;
+}
+
+static void uv_msg_rate_run(uv_timer_t *timer);
+
+/* the socket is checked again after the delay, or earlier if it was
+   already waiting */
+static void uv_msg_rate_wait(uv_msg_t *socket, uint64_t delay) {
+   struct uv_msg_loop_s *ctx = socket->msg_loop;
+   uint64_t wake;
+
+   if (!ctx || uv_is_closing((uv_handle_t*) socket)) return;
+   wake = uv_msg_rate_now(socket) + delay;
+
+   if (socket->rate_waiting) {
+      if (wake >= socket->rate_wake) return;
+   } else {
+      socket->rate_waiting = 1;
+      socket->rate_next = ctx->rate_waiting;
+      ctx->rate_waiting = socket;
+   }
+   socket->rate_wake = wake;
+
+   if (!uv_is_active((uv_handle_t*) &ctx->rate_timer) || wake < ctx->rate_due) {
+      ctx->rate_due = wake;
+      uv_timer_start(&ctx->rate_timer, uv_msg_rate_run, delay, 0);
+   }
+}
+
+static void uv_msg_rate_remove(uv_msg_t *socket) {
+   struct uv_msg_loop_s *ctx = socket->msg_loop;
+   uv_msg_t **psocket;
+
+   socket->rate_paused = 0;
+   if (!socket->rate_waiting) return;
+   for (psocket = &ctx->rate_waiting; *psocket; psocket = &(*psocket)->rate_next) {
+      if (*psocket == socket) { *psocket = socket->rate_next; break; }
+   }
+   socket->rate_waiting = 0;
+   socket->rate_next = NULL;
+   if (!ctx->rate_waiting) uv_timer_stop(&ctx->rate_timer);
+}
+
+static void uv_msg_rate_resume(uv_msg_t *socket) {
+   if (uv_is_closing((uv_handle_t*) socket)) return;
+   if (socket->rate_paused) {
+      socket->rate_paused = 0;
+      uv_stream_msg_parse(socket, 1);
+      uv_stream_msg_resume(socket);
+   }
+   uv_msg_queue_flush(socket);
+}
+
+static void uv_msg_rate_run(uv_timer_t *timer) {
+   struct uv_msg_loop_s *ctx = timer->data;
+   uv_msg_t *socket = ctx->rate_waiting;
+   uint64_t now = uv_now(ctx->loop);
+
+   /* the sockets still without tokens wait again */
+   ctx->rate_waiting = NULL;
+   while (socket) {
+      uv_msg_t *next = socket->rate_next;
+      socket->rate_waiting = 0;
+      socket->rate_next = NULL;
+      if (socket->rate_wake > now) {
+         uv_msg_rate_wait(socket, socket->rate_wake - now);
+      } else {
+         uv_msg_rate_resume(socket);
+      }
+      socket = next;
+   }
+}
+
+/* returns 0 if there are no tokens to deliver the next message. the reading
+   is stopped until there are */
+static int uv_msg_rate_recv_check(uv_msg_t *socket) {
+   if (uv_msg_rate_available(&socket->recv_rate, uv_msg_rate_now(socket))) return 1;
+   if (!socket->rate_paused) {
+      uv_read_stop((uv_stream_t*) socket);
+      socket->rate_paused = 1;
+   }
+   uv_msg_rate_wait(socket, uv_msg_rate_delay(&socket->recv_rate));
+   return 0;
+}
+
+/* returns 0 if there are no tokens to write the next message. the socket
+   is woken up when there are */
+static int uv_msg_rate_send_available(uv_msg_t *socket) {
+   if (uv_msg_rate_available(&socket->send_rate, uv_msg_rate_now(socket))) return 1;
+   uv_msg_rate_wait(socket, uv_msg_rate_delay(&socket->send_rate));
+   return 0;
+}
+
+/* 0 = no limit. the buckets start full */
+int uv_msg_set_recv_rate(uv_msg_t *socket, unsigned int msgs_per_sec, unsigned int bytes_per_sec) {
+   int rc;
+
+   if (!socket) return UV_EINVAL;
+   if (((uv_handle_t*)socket)->type == UV_UDP || socket->shm) return UV_EINVAL;
+
+   if (msgs_per_sec > 0 || bytes_per_sec > 0) {
+      rc = uv_msg_loop_attach(socket);
+      if (rc) return rc;
+   }
+
+   uv_msg_rate_reset(&socket->recv_rate, msgs_per_sec, bytes_per_sec, uv_msg_rate_now(socket));
+   /* the held messages are delivered with the new limit */
+   if (socket->rate_paused) uv_msg_rate_wait(socket, 0);
+   return 0;
+}
+
+int uv_msg_set_send_rate(uv_msg_t *socket, unsigned int msgs_per_sec, unsigned int bytes_per_sec) {
+   int rc;
+
+   if (!socket) return UV_EINVAL;
+   if (((uv_handle_t*)socket)->type == UV_UDP || socket->shm) return UV_EINVAL;
+
+   if (msgs_per_sec > 0 || bytes_per_sec > 0) {
+      rc = uv_msg_loop_attach(socket);
+      if (rc) return rc;
+   }
+
+   uv_msg_rate_reset(&socket->send_rate, msgs_per_sec, bytes_per_sec, uv_msg_rate_now(socket));
+   /* without a limit the queued messages are released */
+   uv_msg_queue_flush(socket);
+   return 0;
+}
+
+
+/* Datagram Reading **********************************************************/
+
+/* With recvmmsg the buffer is split in 64KB chunks, one datagram per chunk */
+#define UV_MSG_UDP_MMSG_CHUNKS  8
+
+void uv_udp_msg_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *udp_buf) {
+   uv_msg_t *uvmsg = (uv_msg_t*) handle;
+
+   if( uvmsg->buf==0 ){
+      uv_buf_t buf = {0};
+#if UV_VERSION_HEX >= 0x012800
+      if( uv_udp_using_recvmmsg((uv_udp_t*)handle) ) suggested_size *= UV_MSG_UDP_MMSG_CHUNKS;
+#endif
+      uvmsg->alloc_cb(handle, suggested_size, &buf);
+      uvmsg->buf = buf.base;
+      uvmsg->alloc_size = buf.base ? buf.len : 0;
+   }
+
+   udp_buf->base = uvmsg->buf;
+   udp_buf->len = uvmsg->alloc_size;
+}
+
+void uv_udp_msg_read(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
+   uv_msg_t *uvmsg = (uv_msg_t*) handle;
+   char *ptr = buf->base;
+
+   UVTRACE(("uv_udp_msg_read: received %d bytes  flags=%u\n", nread, flags));
+
+   if (nread < 0) {
+      /* Error */
+      uv_stream_msg_free_buffer(uvmsg);
+      uvmsg->msg_read_cb(uvmsg, NULL, nread);
+      return;
+   }
+
+   if (addr == NULL) {
+      /* Nothing more to read now, or the recvmmsg batch was fully delivered */
+      uv_stream_msg_free_buffer(uvmsg);
+      return;
+   }
+
+   if (uvmsg->capture_cb) uvmsg->capture_cb(uvmsg, UV_MSG_CAPTURE_READ, buf->base, nread);
+
+   /* the datagram can contain many packed messages. a truncated or corrupted
+      one is dropped together with the rest of the datagram */
+   uvmsg->addr = addr;
+   while( nread >= 4 ){
+      int msg_size = ntohl(*(int*)ptr);
+      if( msg_size < 0 || msg_size > nread - 4 ) break;
+      uv_msg_deliver(uvmsg, ptr + 4, msg_size);
+      ptr += msg_size + 4;
+      nread -= msg_size + 4;
+   }
+   uvmsg->addr = NULL;
+}
+
+int uv_msg_read_start(uv_msg_t* stream, uv_alloc_cb alloc_cb, uv_msg_read_cb msg_read_cb, uv_free_cb free_cb) {
+
+   stream->msg_read_cb = msg_read_cb;
+   stream->alloc_cb = alloc_cb;
+   stream->free_cb = free_cb;
+
+   /* the connection was rejected by the peek callback */
+   if (stream->skip < 0) return UV_ECONNABORTED;
+
+   if (stream->udp.type == UV_UDP) {
+      return uv_udp_recv_start((uv_udp_t*)stream, uv_udp_msg_alloc, uv_udp_msg_read);
+   }
+
+#ifndef _WIN32
+   if (stream->shm) {
+      int rc = uv_msg_shm_start(stream);
+      if (rc) return rc;
+      return uv_read_start((uv_stream_t*)stream, uv_msg_shm_alloc, uv_msg_shm_read);
+   }
+#endif
+
+   return uv_read_start((uv_stream_t*)stream, uv_stream_msg_alloc, uv_stream_msg_read);
+
+}
+
+/* stops reading from the socket until it is called with paused = 0. the
+   reading stopped by the memory limits, the delivery budget or the rate limits
+   restarts only when neither of them holds it. the messages already on the
+   read buffer can still be delivered */
+int uv_msg_read_pause(uv_msg_t *stream, int paused) {
+
+   if (!stream || stream->shm) return UV_EINVAL;
+
+   if (paused) {
+      if (stream->read_paused) return 0;
+      stream->read_paused = 1;
+      if (stream->udp.type == UV_UDP) {
+         uv_udp_recv_stop(&stream->udp);
+      } else {
+         uv_read_stop((uv_stream_t*)stream);
+      }
+      return 0;
+   }
+
+   if (!stream->read_paused) return 0;
+   stream->read_paused = 0;
+   if (!stream->msg_read_cb || stream->deferred || stream->rate_paused || stream->memory_state != 0 ||
+       uv_is_closing((uv_handle_t*)stream)) return 0;
+   return uv_msg_read_start(stream, stream->alloc_cb, stream->msg_read_cb, stream->free_cb);
+
+}
+
+
+/* Connection Migration ******************************************************/
+
+/* A stream socket can be moved to another loop, running on another thread.
+   uv_msg_export() takes the state of the socket, including the partially read
+   message and the send queue, duplicates its descriptor and closes the handle.
+   The migration can then be passed to the other thread and opened there with
+   uv_msg_import(). The messages already handed to the transport must have been
+   written and their callbacks called, otherwise UV_EBUSY is returned and the
+   export can be retried later.
+   The callbacks of the queued messages are called on the new loop. */
+
+struct uv_msg_migration_s {
+   uv_msg_t state;                /* only the message framing fields are used */
+   int fd;
+   int type;
+   int reading;
+   uv_msg_balancer_t *balancer;
+   uv_msg_migration_t *next;
+};
+
+static uv_msg_balancer_t * uv_msg_balancer_of(uv_msg_t *socket);
+static void uv_msg_balancer_remove(uv_msg_t *socket);
+
+static void uv_msg_move_state(uv_msg_t *dst, uv_msg_t *src) {
+   int prio;
+
+   dst->buf = src->buf;
+   dst->alloc_size = src->alloc_size;
+   dst->filled = src->filled;
+   dst->buf_mapped = src->buf_mapped;
+   dst->frame = src->frame;
+   dst->frame_size = src->frame_size;
+   dst->frame_filled = src->frame_filled;
+   dst->frame_header = src->frame_header;
+   dst->frame_header_filled = src->frame_header_filled;
+   src->buf = NULL;
+   src->alloc_size = 0;
+   src->filled = 0;
+   src->buf_mapped = 0;
+   src->frame = NULL;
+   src->frame_header_filled = 0;
+
+   for (prio = 0; prio < UV_MSG_PRIORITIES; prio++) {
+      dst->queue[prio] = src->queue[prio];
+      dst->queue_tail[prio] = src->queue_tail[prio];
+      src->queue[prio] = src->queue_tail[prio] = NULL;
+   }
+   dst->queued = src->queued;
+   dst->queued_bytes = src->queued_bytes;
+   src->queued = 0;
+   src->queued_bytes = 0;
+
+   dst->alloc_cb = src->alloc_cb;
+   dst->free_cb = src->free_cb;
+   dst->msg_read_cb = src->msg_read_cb;
+   dst->max_inflight = src->max_inflight;
+   dst->send_timeout = src->send_timeout;
+   dst->write_failed = src->write_failed;
+   dst->owned = src->owned;
+   dst->capture_cb = src->capture_cb;
+   dst->capture_data = src->capture_data;
+   dst->read_ahead = src->read_ahead;
+   dst->mmap_threshold = src->mmap_threshold;
+   dst->mmap_flags = src->mmap_flags;
+   dst->autocork = src->autocork;
+   dst->zerocopy = src->zerocopy;
+   dst->zc_seq = src->zc_seq;
+   dst->credit_window_msgs = src->credit_window_msgs;
+   dst->credit_window_bytes = src->credit_window_bytes;
+   dst->credit_msgs = src->credit_msgs;
+   dst->credit_bytes = src->credit_bytes;
+   dst->consumed_msgs = src->consumed_msgs;
+   dst->consumed_bytes = src->consumed_bytes;
+   dst->batch_max_msg = src->batch_max_msg;
+   dst->batch_max_size = src->batch_max_size;
+   dst->budget_msgs = src->budget_msgs;
+   dst->budget_usecs = src->budget_usecs;
+   dst->recv_rate = src->recv_rate;
+   dst->send_rate = src->send_rate;
+   dst->acks = src->acks;
+   dst->recv_seq = src->recv_seq;
+   dst->acked_seq = src->acked_seq;
+   dst->ack_cb = src->ack_cb;
+   dst->ack_data = src->ack_data;
+   /* the acks belong to the new socket, so closing the old one does not report it */
+   src->ack_cb = NULL;
+   src->ack_data = NULL;
+   dst->peek_cb = src->peek_cb;
+   dst->peek_size = src->peek_size;
+   dst->peeked = src->peeked;
+   dst->skip = src->skip;
+   dst->read_paused = src->read_paused;
+   dst->activity = src->activity;
+   dst->data = src->data;
+}
+
+#ifndef _WIN32
+
+int uv_msg_export(uv_msg_t *socket, uv_close_cb close_cb, uv_msg_migration_t **pmigration) {
+   uv_stream_t *stream = (uv_stream_t*) socket;
+   uv_msg_migration_t *migration;
+   uv_os_fd_t fd;
+   int rc;
+
+   if (!socket || !pmigration) return UV_EINVAL;
+   if ((stream->type != UV_TCP && stream->type != UV_NAMED_PIPE) || socket->shm) return UV_EINVAL;
+   if (uv_is_closing((uv_handle_t*) socket)) return UV_EINVAL;
+
+   uv_msg_batch_flush(socket);
+   if (socket->inflight > 0 || uv_stream_get_write_queue_size(stream) > 0 || socket->zc_queue) return UV_EBUSY;
+
+   rc = uv_fileno((uv_handle_t*) socket, &fd);
+   if (rc) return rc;
+
+   migration = malloc(sizeof(uv_msg_migration_t));
+   if (!migration) return UV_ENOMEM;
+   migration->fd = dup(fd);
+   if (migration->fd < 0) {
+      rc = -errno;
+      free(migration);
+      return rc;
+   }
+   migration->type = stream->type;
+   migration->reading = uv_is_active((uv_handle_t*) socket) || socket->deferred || socket->rate_paused ||
+                        socket->memory_state == UV_MSG_MEMORY_PAUSED;
+   migration->balancer = uv_msg_balancer_of(socket);
+   migration->next = NULL;
+
+   if (socket->corked) uv_msg_cork(socket, 0);
+   if (socket->msg_loop) {
+      uv_msg_deferred_remove(socket);
+      uv_msg_rate_remove(socket);
+   }
+   uv_msg_balancer_remove(socket);
+   uv_msg_move_state(&migration->state, socket);
+
+   uv_read_stop(stream);
+   uv_msg_close(socket, close_cb);
+
+   *pmigration = migration;
+   return 0;
+}
+
+/* opens the migrated socket on the given loop. the migration is released */
+int uv_msg_import(uv_loop_t *loop, uv_msg_t *socket, uv_msg_migration_t *migration) {
+   uv_msg_send_t *req;
+   int prio, rc;
+
+   if (!loop || !socket || !migration) return UV_EINVAL;
+
+   rc = uv_msg_init(loop, socket, migration->type);
+   if (rc) {
+      uv_msg_migration_free(migration);
+      return rc;
+   }
+   if (migration->type == UV_TCP) {
+      rc = uv_tcp_open(&socket->tcp, migration->fd);
+   } else {
+      rc = uv_pipe_open(&socket->pipe, migration->fd);
+   }
+   if (rc) {
+      /* the handle must still be closed by the caller */
+      uv_msg_migration_free(migration);
+      return rc;
+   }
+
+   uv_msg_move_state(socket, &migration->state);
+   for (prio = 0; prio < UV_MSG_PRIORITIES; prio++) {
+      for (req = socket->queue[prio]; req; req = req->next) req->socket = socket;
+   }
+   if (socket->autocork || socket->batch_max_msg ||
+       socket->budget_msgs || socket->budget_usecs ||
+       uv_msg_rate_active(&socket->recv_rate) || uv_msg_rate_active(&socket->send_rate)) {
+      rc = uv_msg_loop_attach(socket);
+   }
+#ifdef UV_MSG_HAVE_ZEROCOPY
+   if (rc == 0 && socket->zerocopy) rc = uv_msg_zc_open(socket);
+#endif
+   if (rc == 0 && migration->balancer) {
+      /* it is not balanced if this loop did not join the balancer */
+      uv_msg_balancer_add(migration->balancer, socket);
+   }
+   if (rc == 0 && migration->reading) {
+      rc = uv_msg_read_start(socket, socket->alloc_cb, socket->msg_read_cb, socket->free_cb);
+      /* the messages left by the delivery budget */
+      if (rc == 0 && socket->msg_loop && socket->filled >= 4 &&
+          socket->filled >= UV_MSG_FRAME_SIZE(socket->buf) + 4) uv_msg_defer(socket);
+   }
+   free(migration);
+
+   /* the messages that were waiting for credits or for the inflight limit */
+   if (rc == 0) {
+      uv_msg_queue_flush(socket);
+      uv_msg_deadline_update(socket);
+   }
+   return rc;
+}
+
+/* releases a migration that will not be imported, closing the connection */
+void uv_msg_migration_free(uv_msg_migration_t *migration) {
+   uv_msg_t *state = &migration->state;
+
+   if( state->buf ) uv_stream_msg_free_buffer(state);
+   uv_stream_msg_free_frame(state);
+   uv_msg_queue_cancel(state, UV_ECANCELED);
+   if (migration->fd >= 0) close(migration->fd);
+   free(migration);
+}
+
+#else
+
+int uv_msg_export(uv_msg_t *socket, uv_close_cb close_cb, uv_msg_migration_t **pmigration) {
+   return UV_ENOTSUP;
+}
+
+int uv_msg_import(uv_loop_t *loop, uv_msg_t *socket, uv_msg_migration_t *migration) {
+   return UV_ENOTSUP;
+}
+
+void uv_msg_migration_free(uv_msg_migration_t *migration) {}
+
+#endif
+
+
+/* Load Balancing ************************************************************/
+
+/* The loops that joined a balancer measure their load, as the messages sent
+   and received by the sockets added to the balancer. On each interval a loop
+   with a load above the average (by the threshold) moves its busiest socket to
+   the loop with the lowest load, if that does not just swap their roles. The
+   old handle is closed with the close_cb and the arrive_cb is called on the
+   new loop, where the application imports the migration on a new uv_msg_t
+   (its data member is kept). */
+
+struct uv_msg_balancer_loop_s {
+   uv_msg_balancer_t *balancer;
+   uv_loop_t *loop;
+   uv_timer_t timer;               /* measures the load */
+   uv_async_t async;               /* receives the migrated sockets */
+   int handles;
+   unsigned int load;              /* protected by the mutex */
+   uv_msg_migration_t *inbox;      /* protected by the mutex */
+   uv_msg_t *sockets;              /* used only by its loop */
+   struct uv_msg_balancer_loop_s *next;
+};
+
+static uv_msg_balancer_t * uv_msg_balancer_of(uv_msg_t *socket) {
+   return socket->balancer_loop ? socket->balancer_loop->balancer : NULL;
+}
+
+static void uv_msg_balancer_remove(uv_msg_t *socket) {
+   uv_msg_t **psocket;
+
+   if (!socket->balancer_loop) return;
+   for (psocket = &socket->balancer_loop->sockets; *psocket; psocket = &(*psocket)->balancer_next) {
+      if (*psocket == socket) { *psocket = socket->balancer_next; break; }
+   }
+   socket->balancer_loop = NULL;
+   socket->balancer_next = NULL;
+}
+
+/* the loop with the lowest load other than this one. the mutex is held */
+static struct uv_msg_balancer_loop_s * uv_msg_balancer_target(struct uv_msg_balancer_loop_s *node) {
+   struct uv_msg_balancer_loop_s *other, *target = NULL;
+
+   for (other = node->balancer->loops; other; other = other->next) {
+      if (other != node && (!target || other->load < target->load)) target = other;
+   }
+   return target;
+}
+
+static void uv_msg_balancer_measure(uv_timer_t *timer) {
+   struct uv_msg_balancer_loop_s *node = timer->data, *target, *other;
+   uv_msg_balancer_t *balancer = node->balancer;
+   uv_msg_migration_t *migration = NULL;
+   uv_msg_t *socket, *busiest = NULL;
+   unsigned int load = 0, moved = 0;
+   uint64_t total = 0;
+   int count = 0;
+
+   for (socket = node->sockets; socket; socket = socket->balancer_next) {
+      load += socket->activity;
+      if (!busiest || socket->activity > busiest->activity) busiest = socket;
+   }
+
+   uv_mutex_lock(&balancer->mutex);
+   node->load = load;
+   for (other = balancer->loops; other; other = other->next) {
+      total += other->load;
+      count++;
+   }
+   target = uv_msg_balancer_target(node);
+   if (target && busiest && busiest->activity > 0 &&
+       (uint64_t) load * count * 100 > total * (100 + balancer->threshold) &&
+       busiest->activity < load - target->load) {
+      moved = busiest->activity;
+   }
+   uv_mutex_unlock(&balancer->mutex);
+
+   for (socket = node->sockets; socket; socket = socket->balancer_next) {
+      socket->activity = 0;
+   }
+
+   /* the export closes the handle, running application code, so it is done
+      without holding the mutex */
+   if (moved == 0 || uv_msg_export(busiest, balancer->close_cb, &migration) != 0) return;
+
+   uv_mutex_lock(&balancer->mutex);
+   /* the target may have left in the meantime. without other loops the
+      socket comes back to this one */
+   for (other = balancer->loops; other && other != target; other = other->next);
+   if (!other) target = uv_msg_balancer_target(node);
+   if (!target) target = node;
+   migration->next = target->inbox;
+   target->inbox = migration;
+   node->load -= moved;
+   target->load += moved;
+   uv_async_send(&target->async);
+   uv_mutex_unlock(&balancer->mutex);
+}
+
+static void uv_msg_balancer_deliver(struct uv_msg_balancer_loop_s *node, uv_msg_migration_t *migration) {
+   while (migration) {
+      uv_msg_migration_t *next = migration->next;
+      migration->next = NULL;
+      node->balancer->arrive_cb(node->loop, migration);
+      migration = next;
+   }
+}
+
+static void uv_msg_balancer_arrive(uv_async_t *async) {
+   struct uv_msg_balancer_loop_s *node = async->data;
+   uv_msg_migration_t *migration;
+
+   uv_mutex_lock(&node->balancer->mutex);
+   migration = node->inbox;
+   node->inbox = NULL;
+   uv_mutex_unlock(&node->balancer->mutex);
+
+   uv_msg_balancer_deliver(node, migration);
+}
+
+static void uv_msg_balancer_loop_free(uv_handle_t *handle) {
+   struct uv_msg_balancer_loop_s *node = handle->data;
+   if (--node->handles == 0) free(node);
+}
+
+int uv_msg_balancer_init(uv_msg_balancer_t *balancer, unsigned int interval, int threshold, uv_msg_arrive_cb arrive_cb, uv_close_cb close_cb) {
+   if (!balancer || interval == 0 || threshold < 0 || !arrive_cb) return UV_EINVAL;
+   balancer->interval = interval;
+   balancer->threshold = threshold;
+   balancer->arrive_cb = arrive_cb;
+   balancer->close_cb = close_cb;
+   balancer->loops = NULL;
+   return uv_mutex_init(&balancer->mutex);
+}
+
+/* must be called on the thread running the loop */
+int uv_msg_balancer_join(uv_msg_balancer_t *balancer, uv_loop_t *loop) {
+   struct uv_msg_balancer_loop_s *node;
+   int rc;
+
+   if (!balancer || !loop) return UV_EINVAL;
+
+   node = malloc(sizeof(struct uv_msg_balancer_loop_s));
+   if (!node) return UV_ENOMEM;
+   rc = uv_async_init(loop, &node->async, uv_msg_balancer_arrive);
+   if (rc) {
+      free(node);
+      return rc;
+   }
+   uv_unref((uv_handle_t*) &node->async);
+   node->async.data = node;
+   uv_timer_init(loop, &node->timer);
+   uv_unref((uv_handle_t*) &node->timer);
+   node->timer.data = node;
+   node->handles = 2;
+   node->balancer = balancer;
+   node->loop = loop;
+   node->load = 0;
+   node->inbox = NULL;
+   node->sockets = NULL;
+
+   uv_mutex_lock(&balancer->mutex);
+   node->next = balancer->loops;
+   balancer->loops = node;
+   uv_mutex_unlock(&balancer->mutex);
+
+   uv_timer_start(&node->timer, uv_msg_balancer_measure, balancer->interval, balancer->interval);
+   return 0;
+}
+
+/* must be called on the thread running the loop. the sockets that were on
+   their way to this loop are still delivered to it */
+void uv_msg_balancer_leave(uv_msg_balancer_t *balancer, uv_loop_t *loop) {
+   struct uv_msg_balancer_loop_s **pnode, *node = NULL;
+   uv_msg_migration_t *migration = NULL;
+
+   uv_mutex_lock(&balancer->mutex);
+   for (pnode = &balancer->loops; *pnode; pnode = &(*pnode)->next) {
+      if ((*pnode)->loop == loop) {
+         node = *pnode;
+         *pnode = node->next;
+         migration = node->inbox;
+         node->inbox = NULL;
+         break;
+      }
+   }
+   uv_mutex_unlock(&balancer->mutex);
+   if (!node) return;
+
+   while (node->sockets) uv_msg_balancer_remove(node->sockets);
+   uv_msg_balancer_deliver(node, migration);
+
+   uv_close((uv_handle_t*) &node->timer, uv_msg_balancer_loop_free);
+   uv_close((uv_handle_t*) &node->async, uv_msg_balancer_loop_free);
+}
+
+/* the socket can be moved to another loop. must be called on its loop thread */
+int uv_msg_balancer_add(uv_msg_balancer_t *balancer, uv_msg_t *socket) {
+   struct uv_msg_balancer_loop_s *node;
+   uv_loop_t *loop;
+
+   if (!balancer || !socket) return UV_EINVAL;
+   loop = ((uv_handle_t*)socket)->loop;
+
+   uv_mutex_lock(&balancer->mutex);
+   for (node = balancer->loops; node; node = node->next) {
+      if (node->loop == loop) break;
+   }
+   uv_mutex_unlock(&balancer->mutex);
+   if (!node) return UV_EINVAL;
+
+   uv_msg_balancer_remove(socket);
+   socket->balancer_loop = node;
+   socket->balancer_next = node->sockets;
+   node->sockets = socket;
+   return 0;
+}
+
+/* all the loops must have left the balancer */
+void uv_msg_balancer_free(uv_msg_balancer_t *balancer) {
+   uv_mutex_destroy(&balancer->mutex);
+}
+
+
+
+/* Closing *******************************************************************/
+
+static void uv_msg_on_close(uv_handle_t *handle) {
+   uv_msg_t *socket = (uv_msg_t*) handle;
+
+#ifdef UV_MSG_HAVE_ZEROCOPY
+   if (socket->zc_queue) {
+      uv_msg_zc_linger(socket);
+      return;
+   }
+#endif
+   if( socket->buf ) uv_stream_msg_free_buffer(socket);
+   uv_stream_msg_free_frame(socket);
+   socket->filled = 0;
+   uv_msg_queue_cancel(socket, UV_ECANCELED);
+   uv_msg_deadline_release(socket);
+   uv_msg_zc_release(socket);
+#ifndef _WIN32
+   if( socket->shm ) uv_msg_shm_release(socket);
+#endif
+   uv_msg_loop_detach(socket);
+   uv_msg_balancer_remove(socket);
+
+   if( socket->close_cb ) socket->close_cb(handle);
+}
 
+/* closes the handle releasing the memory used by the message framing */
+void uv_msg_close(uv_msg_t *socket, uv_close_cb close_cb) {
+   /* the batched messages are written before closing */
+   uv_msg_batch_flush(socket);
+   uv_msg_ack_close(socket);
+   socket->close_cb = close_cb;
+   uv_close((uv_handle_t*) socket, uv_msg_on_close);
 }
@@ -9,6 +9,42 @@ extern "C" {
 
 typedef struct uv_msg_s        uv_msg_t;
 typedef struct uv_msg_send_s   uv_msg_send_t;
+typedef struct uv_msg_loop_s   uv_msg_loop_t;
+typedef struct uv_msg_migration_s  uv_msg_migration_t;
+typedef struct uv_msg_balancer_s   uv_msg_balancer_t;
+typedef struct uv_msg_hook_s   uv_msg_hook_t;
+
+
+/* Stream type for same-host peers using shared memory over a Unix socket */
+
+#define UV_MSG_SHM                (UV_HANDLE_TYPE_MAX + 1)
+#define UV_MSG_SHM_DEFAULT_SIZE   (4 * 1024 * 1024)
+#define UV_MSG_SHM_NAME_LEN       32
+
+
+/* Message Priorities */
+
+#define UV_MSG_PRIO_HIGH     0
+#define UV_MSG_PRIO_NORMAL   1
+#define UV_MSG_PRIO_BULK     2
+#define UV_MSG_PRIORITIES    3
+
+
+/* Read-ahead: use all the free space of the buffer */
+
+#define UV_MSG_READ_AHEAD_ALL  (-1)
+
+
+/* Return values of the peek callback */
+
+#define UV_MSG_DELIVER  0    /* read the message and deliver it */
+#define UV_MSG_SKIP     1    /* discard the message without buffering it */
+#define UV_MSG_CLOSE    2    /* stop reading. the read callback receives UV_ECONNABORTED */
+
+
+/* Flags for uv_msg_set_mmap_threshold */
+
+#define UV_MSG_MMAP_HUGEPAGES  1   /* use transparent huge pages */
 
 
 /* Stream Initialization */
@@ -22,13 +58,128 @@ typedef void (*uv_free_cb)(uv_handle_t* handle, void* ptr);
 
 typedef void (*uv_msg_read_cb)(uv_msg_t* stream, void *msg, int size);
 
+typedef void (*uv_msg_capture_cb)(uv_msg_t* stream, int type, const char *data, int size);
+
+#define UV_MSG_CAPTURE_READ   1    /* bytes as read from the socket */
+#define UV_MSG_CAPTURE_SEND   2    /* a message accepted for sending */
+
+typedef void (*uv_msg_arrive_cb)(uv_loop_t* loop, uv_msg_migration_t* migration);
+
+typedef void (*uv_msg_ack_cb)(uv_msg_t* stream, uint64_t seq);
+
+/* passed to the ack_cb when the socket is closed, after that it is not called */
+#define UV_MSG_SEQ_CLOSED     UINT64_MAX
+
+typedef int (*uv_msg_peek_cb)(uv_msg_t* stream, int size, const char *data, int len);
+
+typedef void (*uv_msg_hook_cb)(uv_msg_hook_t* hook);
+
 
 /* Functions */
 
 int uv_msg_read_start(uv_msg_t* stream, uv_alloc_cb alloc_cb, uv_msg_read_cb msg_read_cb, uv_free_cb free_cb);
 
+int uv_msg_read_pause(uv_msg_t* stream, int paused);
+
 int uv_msg_send(uv_msg_send_t* req, uv_msg_t* stream, void* msg, int size, uv_write_cb write_cb);
 
+int uv_msg_send_frame(uv_msg_send_t* req, uv_msg_t* stream, void* frame, int size, uv_write_cb write_cb);
+
+int uv_msg_send_prio(uv_msg_send_t* req, uv_msg_t* stream, int priority, void* msg, int size, uv_write_cb write_cb);
+
+int uv_msg_send_frame_prio(uv_msg_send_t* req, uv_msg_t* stream, int priority, void* frame, int size, uv_write_cb write_cb);
+
+int uv_msg_send_rest(uv_msg_send_t* req, uv_msg_t* stream, void* msg, int size, int written, uv_write_cb write_cb);
+
+int uv_msg_set_max_inflight(uv_msg_t* handle, size_t max_inflight);
+
+int uv_msg_set_send_timeout(uv_msg_t* handle, unsigned int timeout);
+
+int uv_msg_send_timeout(uv_msg_send_t* req, unsigned int timeout);
+
+int uv_msg_send_cancel(uv_msg_send_t* req);
+
+int uv_msg_set_ownership(uv_msg_t* handle, int enabled);
+
+int uv_msg_set_capture(uv_msg_t* handle, uv_msg_capture_cb capture_cb, void *capture_data);
+
+int uv_msg_set_read_ahead(uv_msg_t* handle, int size);
+
+int uv_msg_set_mmap_threshold(uv_msg_t* handle, size_t threshold, int flags);
+
+int uv_msg_set_autocork(uv_msg_t* handle, int enabled);
+
+int uv_msg_set_zerocopy(uv_msg_t* handle, size_t threshold);
+
+int uv_msg_set_credits(uv_msg_t* handle, int max_messages, int max_bytes);
+
+int uv_msg_set_batching(uv_msg_t* handle, int max_msg_size, int max_batch_size);
+
+int uv_msg_set_memory_limit(uv_loop_t* loop, size_t soft_limit, size_t hard_limit);
+
+int uv_msg_memory_check(uv_msg_t* handle);
+
+int uv_msg_set_read_budget(uv_msg_t* handle, int max_messages, unsigned int max_usecs);
+
+int uv_msg_set_acks(uv_msg_t* handle, int enabled);
+
+int uv_msg_set_ack_cb(uv_msg_t* handle, uv_msg_ack_cb ack_cb, void *ack_data);
+
+int uv_msg_send_sequence(uv_msg_t* handle, uint64_t seq);
+
+int uv_msg_set_peek(uv_msg_t* handle, uv_msg_peek_cb peek_cb, int peek_size);
+
+int uv_msg_set_recv_rate(uv_msg_t* handle, unsigned int msgs_per_sec, unsigned int bytes_per_sec);
+
+int uv_msg_set_send_rate(uv_msg_t* handle, unsigned int msgs_per_sec, unsigned int bytes_per_sec);
+
+int uv_msg_set_udp_packing(uv_msg_t* handle, int max_datagram);
+
+int uv_msg_set_shm_size(uv_msg_t* handle, unsigned int size);
+
+/* releases a partially received message. the handles using a feature linked
+   to the loop (memory limits, autocork, zero copy, batching, read budget, rate
+   limits, flow control, shared memory, migration, balancer, hooks) must be
+   closed with this function, not with uv_close */
+void uv_msg_close(uv_msg_t* handle, uv_close_cb close_cb);
+
+
+/* Connection Migration */
+
+int uv_msg_export(uv_msg_t* handle, uv_close_cb close_cb, uv_msg_migration_t** migration);
+
+int uv_msg_import(uv_loop_t* loop, uv_msg_t* handle, uv_msg_migration_t* migration);
+
+void uv_msg_migration_free(uv_msg_migration_t* migration);
+
+int uv_msg_balancer_init(uv_msg_balancer_t* balancer, unsigned int interval, int threshold, uv_msg_arrive_cb arrive_cb, uv_close_cb close_cb);
+
+int uv_msg_balancer_join(uv_msg_balancer_t* balancer, uv_loop_t* loop);
+
+void uv_msg_balancer_leave(uv_msg_balancer_t* balancer, uv_loop_t* loop);
+
+int uv_msg_balancer_add(uv_msg_balancer_t* balancer, uv_msg_t* handle);
+
+void uv_msg_balancer_free(uv_msg_balancer_t* balancer);
+
+
+/* Loop Hooks, for the modules built on the framing */
+
+uv_msg_hook_t* uv_msg_hook_get(uv_msg_t* handle, uv_msg_hook_cb flush_cb, uv_msg_hook_cb free_cb, size_t size);
+
+void uv_msg_hook_flush(uv_msg_hook_t* hook);
+
+
+/* Token Bucket */
+
+struct uv_msg_rate_s {
+   unsigned int msgs_per_sec;   /* 0 = no limit */
+   unsigned int bytes_per_sec;  /* 0 = no limit */
+   int64_t msgs;                /* available tokens, in thousandths */
+   int64_t bytes;
+   uint64_t updated;            /* loop time of the last refill */
+};
+
 
 /* Message Read Structure */
 
@@ -36,6 +187,7 @@ struct uv_msg_s {
    union {
       uv_tcp_t tcp;
       uv_pipe_t pipe;
+      uv_udp_t udp;
       void *data;
    };
    char *buf;
@@ -44,6 +196,127 @@ struct uv_msg_s {
    uv_alloc_cb alloc_cb;
    uv_free_cb free_cb;
    uv_msg_read_cb msg_read_cb;
+   /* datagram transport (UV_UDP) */
+   const struct sockaddr *addr;   /* sender of the message being delivered */
+   int max_datagram;              /* 0 = one message per datagram */
+   int udp_sending;               /* datagrams handed to uv_udp_send */
+   uv_msg_send_t *udp_queue;      /* messages waiting to be packed */
+   uv_msg_send_t *udp_queue_tail;
+   /* shared memory transport (UV_MSG_SHM) */
+   struct uv_msg_shm_s *shm;
+   uv_close_cb close_cb;
+   /* messages waiting to be handed to the transport, by priority */
+   uv_msg_send_t *queue[UV_MSG_PRIORITIES];
+   uv_msg_send_t *queue_tail[UV_MSG_PRIORITIES];
+   int queued;
+   size_t inflight;       /* bytes handed to the transport */
+   size_t max_inflight;   /* 0 = no limit, no queueing */
+   unsigned int send_timeout;  /* ms a message can wait on the queue. 0 = no limit */
+   uv_timer_t *send_timer;     /* expires the queued messages */
+   uint64_t send_due;          /* when the timer runs */
+   int write_failed;           /* a frame was written partially. the writes fail */
+   /* messages delivered on their own buffers */
+   int owned;
+   char *frame;           /* message being read on its own buffer */
+   int frame_size;
+   int frame_filled;
+   int frame_header;      /* length of the next message, read without read-ahead */
+   int frame_header_filled;
+   /* traffic capture */
+   uv_msg_capture_cb capture_cb;
+   void *capture_data;
+   /* bytes read past the end of the current message. 0 = disabled, the default */
+   int read_ahead;
+   /* big read buffers mapped from the OS (Linux) */
+   size_t mmap_threshold;  /* 0 = always use the alloc_cb */
+   int mmap_flags;
+   int buf_mapped;
+   /* state shared with the other sockets of the same loop */
+   uv_msg_loop_t *msg_loop;
+   /* adaptive corking (UV_TCP) */
+   int autocork;
+   int corked;
+   int burst;             /* messages written on this loop iteration */
+   int burst_avg;         /* recent messages per iteration, x16 */
+   uv_msg_t *written_next;
+   /* zerocopy sending (Linux, UV_TCP) */
+   size_t zerocopy;       /* minimum message size. 0 = disabled */
+   unsigned int zc_seq;   /* next zerocopy send */
+   int zc_copied;         /* completions where the kernel copied the data */
+   int zc_closed;         /* the close waits for the completions */
+   uv_msg_send_t *zc_queue;        /* messages waiting for the completion */
+   uv_msg_send_t *zc_queue_tail;
+   uv_poll_t *zc_poll;             /* watches the error queue */
+   /* credit based flow control */
+   int credit_window_msgs;    /* granted to the peer. 0 = disabled */
+   int credit_window_bytes;
+   int credit_msgs;           /* granted by the peer */
+   int64_t credit_bytes;
+   int consumed_msgs;         /* delivered since the last grant */
+   int consumed_bytes;
+   /* small messages packed in batch frames */
+   struct uv_msg_batch_s *batch;   /* batch being built */
+   int batch_max_msg;     /* 0 = disabled */
+   int batch_max_size;
+   int batch_msgs;        /* messages batched on this tick */
+   uv_msg_t *batch_next;
+   /* load balancing between loops */
+   unsigned int activity;   /* messages sent and received since the last measurement */
+   struct uv_msg_balancer_loop_s *balancer_loop;
+   uv_msg_t *balancer_next;
+   /* memory accounting of the loop */
+   size_t queued_bytes;   /* on the send queue */
+   size_t memory_used;    /* on the last measurement */
+   int memory_state;      /* reading paused or stopped by the limits */
+   uv_msg_t *memory_next;
+   uv_msg_t *memory_prev;
+   /* delivery budget of each read */
+   int budget_msgs;             /* 0 = no limit */
+   unsigned int budget_usecs;   /* 0 = no limit */
+   int deferred;                /* complete messages left on the buffer */
+   uv_msg_t *deferred_next;
+   /* acknowledgements */
+   int acks;              /* acknowledge the received messages to the peer */
+   uint64_t recv_seq;     /* sequence number of the message being delivered */
+   uint64_t acked_seq;    /* last acknowledgement sent */
+   uv_msg_ack_cb ack_cb;  /* receives the acknowledgements of the peer */
+   void *ack_data;
+   /* messages accepted or discarded by their first bytes */
+   uv_msg_peek_cb peek_cb;
+   int peek_size;         /* bytes of the message passed to the peek_cb */
+   int peeked;            /* the message being read was accepted */
+   int skip;              /* bytes of a discarded message still to be read. -1 = stopped */
+   int read_paused;       /* the reading was stopped by uv_msg_read_pause */
+   /* rate limits */
+   struct uv_msg_rate_s recv_rate;
+   struct uv_msg_rate_s send_rate;
+   int rate_paused;       /* the reading was stopped by the recv_rate */
+   int rate_waiting;      /* waiting for tokens on the timer of the loop */
+   uint64_t rate_wake;    /* loop time when the buckets are checked again */
+   uv_msg_t *rate_next;
+};
+
+
+/* State of a module for each loop. It is followed by the data of the module */
+
+struct uv_msg_hook_s {
+   uv_msg_hook_cb flush_cb;   /* at the end of the tick, after uv_msg_hook_flush() */
+   uv_msg_hook_cb free_cb;    /* when the loop context is released */
+   uv_msg_loop_t *msg_loop;
+   int pending;
+   uv_msg_hook_t *next;
+};
+
+
+/* Load Balancer, shared by the loops of different threads */
+
+struct uv_msg_balancer_s {
+   uv_mutex_t mutex;
+   unsigned int interval;   /* milliseconds between the measurements */
+   int threshold;           /* load above the average, in percent, to move a connection */
+   uv_msg_arrive_cb arrive_cb;
+   uv_close_cb close_cb;
+   struct uv_msg_balancer_loop_s *loops;
 };
 
 
@@ -52,10 +325,21 @@ struct uv_msg_s {
 struct uv_msg_send_s {
    union {
       uv_write_t req;
+      uv_udp_send_t udp_req;
       void *data;
    };
    uv_buf_t buf[2];
    int msg_size;     /* in network order! */
+   uv_write_cb write_cb;   /* used with UV_UDP, UV_MSG_SHM and batching */
+   uv_msg_send_t *next;    /* used with UV_UDP, UV_MSG_SHM, batching, zerocopy and the send queue */
+   uv_msg_send_t *prev;    /* used with the send and zerocopy queues */
+   int queue_prio;         /* used with the send queue. -1 when not on it */
+   uv_write_cb send_cb;    /* used with the send queue */
+   uv_msg_t *socket;       /* used with the send queue */
+   uint64_t deadline;      /* used with the send queue. loop time in ms, 0 = none */
+   unsigned int zc_seq;    /* used with zerocopy */
+   int zc_pending;
+   int zc_status;
 };
 
 
@@ -0,0 +1,337 @@
+/* Persistent outbound journal for at-least-once delivery.
+
+   The messages sent with msg_journal_send() are appended to a segment file
+   mapped in memory, numbered, and sent from the mapping without copies. The
+   peer acknowledges them (it must call uv_msg_set_acks on its socket) and the
+   acknowledged ones are dropped from the journal. When the connection is lost
+   the messages keep being appended, and when a new connection is attached the
+   ones not acknowledged are sent again straight from the mapping, preceded by
+   the sequence number of the first one. The receiver can find the number of
+   the message being delivered on socket->recv_seq to discard duplicates.
+
+   The journal survives the process: opening an existing file keeps its
+   messages. The file is used as a ring: when the messages reach the end of
+   the file they continue from the beginning, on the space of the ones already
+   acknowledged.
+
+   File format:
+
+     header                   see msg_journal_header_t
+     records:
+       seq (8 bytes)
+       size (4 bytes)
+       reserved (4 bytes)
+       message (size bytes), padded to 8 bytes
+
+   A record with size 0, or the end of the file, marks where the records
+   continue from the beginning. The records are checked when the journal is
+   opened and attached, and a corrupted file is refused with UV_EINVAL.
+
+   The acknowledgements count every message received on the socket, so the
+   attached socket must not be used to send other messages: they would be
+   taken as journal messages and acknowledge ones the peer did not receive.
+
+   The attached socket must be reading, to receive the acknowledgements. It is
+   detached when it is closed with uv_msg_close(), or with msg_journal_detach().
+
+   This module uses the send_message() function from uv_send_message.c and
+   works on POSIX systems only. The socket must be detached or closed before
+   the journal is closed.
+*/
+
+#define MSG_JOURNAL_MAGIC    "UVMSGJNL"
+#define MSG_JOURNAL_VERSION  1
+
+typedef struct msg_journal_header_s {
+   char magic[8];
+   unsigned int version;
+   unsigned int reserved;
+   uint64_t next_seq;     /* of the next appended message */
+   uint64_t tail_seq;     /* of the first message not acknowledged */
+   uint64_t tail;         /* offset of the first message not acknowledged */
+   uint64_t head;         /* offset of the end of the messages. it is before
+                             the tail when they continue from the beginning */
+} msg_journal_header_t;
+
+typedef struct msg_journal_record_s {
+   uint64_t seq;
+   unsigned int size;
+   unsigned int reserved;
+   char msg[];
+} msg_journal_record_t;
+
+typedef struct msg_journal_s {
+   int fd;
+   char *map;
+   size_t capacity;
+   msg_journal_header_t *header;
+   uv_msg_t *socket;
+   int inflight;          /* writes still using the mapping */
+   int closed;            /* released when the writes complete */
+} msg_journal_t;
+
+#define MSG_JOURNAL_RECORD_SIZE(size)  ((sizeof(msg_journal_record_t) + (size) + 7) & ~(size_t)7)
+
+static msg_journal_record_t * msg_journal_record(msg_journal_t *journal, uint64_t offset) {
+   return (msg_journal_record_t *) (journal->map + offset);
+}
+
+/* the offset of the record at offset, continuing from the beginning at the
+   end of the file */
+static uint64_t msg_journal_wrap(msg_journal_t *journal, uint64_t offset) {
+   if (offset + sizeof(msg_journal_record_t) > journal->capacity ||
+       msg_journal_record(journal, offset)->size == 0) {
+      return sizeof(msg_journal_header_t);
+   }
+   return offset;
+}
+
+/* the offset after the record at offset, or 0 if the record is corrupted */
+static uint64_t msg_journal_next(msg_journal_t *journal, uint64_t offset) {
+   msg_journal_record_t *record = msg_journal_record(journal, offset);
+   if ((offset & 7) != 0 || record->size == 0 ||
+       offset + MSG_JOURNAL_RECORD_SIZE(record->size) > journal->capacity) return 0;
+   return offset + MSG_JOURNAL_RECORD_SIZE(record->size);
+}
+
+/* walks the messages not acknowledged, checking that they are numbered in
+   order and that they end on the head */
+static int msg_journal_check(msg_journal_t *journal) {
+   msg_journal_header_t *header = journal->header;
+   uint64_t offset = header->tail;
+   uint64_t seq = header->tail_seq;
+   size_t count = 0;
+
+   while (offset != header->head) {
+      offset = msg_journal_wrap(journal, offset);
+      if (msg_journal_record(journal, offset)->seq != seq) return UV_EINVAL;
+      offset = msg_journal_next(journal, offset);
+      if (offset == 0 || ++count > journal->capacity / sizeof(msg_journal_record_t)) return UV_EINVAL;
+      seq++;
+   }
+   return seq == header->next_seq ? 0 : UV_EINVAL;
+}
+
+static void msg_journal_free(msg_journal_t *journal) {
+   munmap(journal->map, journal->capacity);
+   close(journal->fd);
+   free(journal);
+}
+
+static void msg_journal_sent(send_message_t *req, int status) {
+   msg_journal_t *journal = (msg_journal_t *) req->data;
+   journal->inflight--;
+   if (journal->closed && journal->inflight == 0) msg_journal_free(journal);
+}
+
+static void msg_journal_write(msg_journal_t *journal, msg_journal_record_t *record) {
+   journal->inflight++;
+   if (send_message(journal->socket, record->msg, record->size, UV_MSG_STATIC, msg_journal_sent, journal) != 0) {
+      /* it stays on the journal and it is sent again on the next connection */
+      journal->inflight--;
+   }
+}
+
+static void msg_journal_on_ack(uv_msg_t *socket, uint64_t seq) {
+   msg_journal_t *journal = (msg_journal_t *) socket->ack_data;
+   msg_journal_header_t *header = journal->header;
+
+   if (seq == UV_MSG_SEQ_CLOSED) {
+      /* the socket is being closed. a socket the journal was moved from
+         (uv_msg_export) does not detach it */
+      if (journal->socket == socket) journal->socket = NULL;
+      return;
+   }
+
+   while (header->tail != header->head) {
+      uint64_t offset = msg_journal_wrap(journal, header->tail);
+      msg_journal_record_t *record = msg_journal_record(journal, offset);
+      if (record->seq >= seq) {
+         header->tail = offset;
+         break;
+      }
+      header->tail = msg_journal_next(journal, offset);
+      if (header->tail == 0) {
+         /* the file was corrupted after it was opened: the messages cannot
+            be found anymore */
+         header->tail = header->head;
+         break;
+      }
+   }
+   header->tail_seq = header->tail != header->head ?
+                      msg_journal_record(journal, msg_journal_wrap(journal, header->tail))->seq :
+                      header->next_seq;
+}
+
+/* maps the file, keeping the messages of an existing journal */
+static int msg_journal_map(msg_journal_t *journal, size_t capacity) {
+   msg_journal_header_t *header;
+   struct stat st;
+   int existing;
+
+   if (fstat(journal->fd, &st) != 0) return -errno;
+
+   existing = st.st_size >= (off_t) sizeof(msg_journal_header_t);
+   if (existing) {
+      capacity = st.st_size;
+   } else {
+      if (capacity < sizeof(msg_journal_header_t) + MSG_JOURNAL_RECORD_SIZE(1)) return UV_EINVAL;
+      if (ftruncate(journal->fd, capacity) != 0) return -errno;
+   }
+
+   journal->map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+   if (journal->map == MAP_FAILED) return -errno;
+   journal->capacity = capacity;
+   journal->header = header = (msg_journal_header_t *) journal->map;
+
+   if (!existing) {
+      memcpy(header->magic, MSG_JOURNAL_MAGIC, 8);
+      header->version = MSG_JOURNAL_VERSION;
+      header->next_seq = 0;
+      header->tail_seq = 0;
+      header->tail = header->head = sizeof(msg_journal_header_t);
+   } else if (memcmp(header->magic, MSG_JOURNAL_MAGIC, 8) != 0 || header->version != MSG_JOURNAL_VERSION ||
+              header->tail < sizeof(msg_journal_header_t) || header->tail > capacity ||
+              header->head < sizeof(msg_journal_header_t) || header->head > capacity ||
+              (header->tail & 7) != 0 || (header->head & 7) != 0 ||
+              msg_journal_check(journal) != 0) {
+      munmap(journal->map, capacity);
+      return UV_EINVAL;
+   }
+   return 0;
+}
+
+/* opens or creates the journal file. the capacity is used only when it is
+   created */
+int msg_journal_open(msg_journal_t **pjournal, const char *path, size_t capacity) {
+   msg_journal_t *journal;
+   int rc;
+
+   if (!pjournal || !path) return UV_EINVAL;
+
+   journal = malloc(sizeof(msg_journal_t));
+   if (!journal) return UV_ENOMEM;
+   memset(journal, 0, sizeof(msg_journal_t));
+
+   journal->fd = open(path, O_RDWR | O_CREAT, 0600);
+   if (journal->fd < 0) {
+      rc = -errno;
+      free(journal);
+      return rc;
+   }
+
+   rc = msg_journal_map(journal, capacity);
+   if (rc) {
+      close(journal->fd);
+      free(journal);
+      return rc;
+   }
+
+   *pjournal = journal;
+   return 0;
+}
+
+/* the offset where a record of this size is appended, or 0 if it does not
+   fit. the head never reaches the tail from behind, so they are equal only
+   when the journal is empty */
+static uint64_t msg_journal_reserve(msg_journal_t *journal, size_t record_size) {
+   msg_journal_header_t *header = journal->header;
+   uint64_t start = sizeof(msg_journal_header_t);
+   uint64_t offset = header->head;
+
+   if (offset < header->tail) {
+      return offset + record_size < header->tail ? offset : 0;
+   }
+   if (offset + record_size <= journal->capacity) return offset;
+
+   /* continues from the beginning, on the acknowledged messages */
+   if (start + record_size >= header->tail) return 0;
+   if (offset + sizeof(msg_journal_record_t) <= journal->capacity) {
+      msg_journal_record(journal, offset)->size = 0;
+   }
+   return start;
+}
+
+/* appends the message and sends it if there is a connection. returns
+   UV_ENOBUFS when the journal is full */
+int msg_journal_send(msg_journal_t *journal, char *msg, int size) {
+   msg_journal_header_t *header;
+   msg_journal_record_t *record;
+   size_t record_size;
+   uint64_t offset;
+
+   if (!journal || !msg || size <= 0) return UV_EINVAL;
+   header = journal->header;
+
+   /* everything was acknowledged: start again from the beginning */
+   if (header->tail == header->head && journal->inflight == 0) {
+      header->tail = header->head = sizeof(msg_journal_header_t);
+   }
+
+   record_size = MSG_JOURNAL_RECORD_SIZE(size);
+   offset = msg_journal_reserve(journal, record_size);
+   if (offset == 0) return UV_ENOBUFS;
+
+   record = msg_journal_record(journal, offset);
+   record->seq = header->next_seq++;
+   record->size = size;
+   record->reserved = 0;
+   memcpy(record->msg, msg, size);
+   header->head = offset + record_size;
+
+   if (journal->socket) {
+      msg_journal_write(journal, record);
+   }
+   return 0;
+}
+
+/* uses the connection to send the messages, starting with the ones that were
+   not acknowledged. a socket imported with uv_msg_import() takes the journal
+   from the exported one */
+int msg_journal_attach(msg_journal_t *journal, uv_msg_t *socket) {
+   msg_journal_header_t *header;
+   uint64_t offset;
+   int rc;
+
+   if (!journal || !socket) return UV_EINVAL;
+   if (journal->socket && socket->ack_data != journal) return UV_EINVAL;
+   header = journal->header;
+   if (msg_journal_check(journal) != 0) return UV_EINVAL;
+
+   rc = uv_msg_send_sequence(socket, header->tail_seq);
+   if (rc) return rc;
+   uv_msg_set_ack_cb(socket, msg_journal_on_ack, journal);
+   journal->socket = socket;
+
+   for (offset = header->tail; offset != header->head; ) {
+      msg_journal_record_t *record = msg_journal_record(journal, msg_journal_wrap(journal, offset));
+      msg_journal_write(journal, record);
+      offset = msg_journal_next(journal, (char *) record - journal->map);
+   }
+   return 0;
+}
+
+/* stops using the attached socket. it is not needed if the socket is closed
+   with uv_msg_close() */
+void msg_journal_detach(msg_journal_t *journal) {
+   if (!journal || !journal->socket) return;
+   uv_msg_set_ack_cb(journal->socket, NULL, NULL);
+   journal->socket = NULL;
+}
+
+/* the number of messages not acknowledged */
+int msg_journal_pending(msg_journal_t *journal) {
+   return (int) (journal->header->next_seq - journal->header->tail_seq);
+}
+
+/* the socket must be detached or closed before. the mapping is released when
+   the writes using it complete */
+void msg_journal_close(msg_journal_t *journal) {
+   if (!journal) return;
+   journal->socket = NULL;
+   if (journal->inflight > 0) {
+      journal->closed = 1;
+      return;
+   }
+   msg_journal_free(journal);
+}
@@ -0,0 +1,369 @@
+/* Topic based publish/subscribe on top of the message framing.
+
+   Each message starts with a type byte followed by the topic, terminated by
+   a null byte. Publish messages carry the payload after the topic:
+
+     'S' topic \0            subscribe
+     'U' topic \0            unsubscribe
+     'P' topic \0 payload    publish
+
+   The broker keeps a hash table of topics, each one with its list of
+   subscribers, and a hash table of subscriptions by (socket, topic) so that
+   subscribing, unsubscribing and removing a connection take constant time
+   per subscription. A publication is matched once and the same copy of it is
+   sent to all the subscribers.
+
+   This module uses the broadcast_message() function from uv_send_message.c */
+
+#define PUBSUB_SUBSCRIBE    'S'
+#define PUBSUB_UNSUBSCRIBE  'U'
+#define PUBSUB_PUBLISH      'P'
+
+typedef struct pubsub_s        pubsub_t;
+typedef struct pubsub_topic_s  pubsub_topic_t;
+typedef struct pubsub_sub_s    pubsub_sub_t;
+
+struct pubsub_topic_s {
+   pubsub_topic_t *hash_next;
+   unsigned int hash;
+   pubsub_sub_t *subs;           /* subscribers of this topic */
+   int count;
+   char name[];
+};
+
+struct pubsub_sub_s {
+   uv_msg_t *socket;
+   pubsub_topic_t *topic;
+   pubsub_sub_t *prev, *next;            /* subscribers of the same topic */
+   pubsub_sub_t *conn_prev, *conn_next;  /* subscriptions of the same socket */
+   pubsub_sub_t *hash_next;
+};
+
+struct pubsub_s {
+   pubsub_topic_t **topics;      /* hash table of topics */
+   int topics_size;
+   int topics_count;
+   pubsub_sub_t **subs;          /* hash table of subscriptions by (socket, topic) */
+   int subs_size;
+   int subs_count;
+   uv_msg_t **targets;           /* used to route a publication */
+   int targets_size;
+   size_t max_backlog;           /* skip slow subscribers. 0 = no limit */
+};
+
+/****************************************************************************/
+
+static unsigned int pubsub_hash_topic(const char *topic) {
+   unsigned int hash = 2166136261u;
+   while (*topic) {
+      hash ^= (unsigned char) *topic++;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+static unsigned int pubsub_hash_sub(uv_msg_t *socket, pubsub_topic_t *topic) {
+   uintptr_t key = (uintptr_t) socket ^ ((uintptr_t) topic >> 4);
+   key ^= key >> 15;
+   key *= 0x2c1b3c6d;
+   key ^= key >> 12;
+   return (unsigned int) key;
+}
+
+/* the head of the list of subscriptions of a socket uses the topic NULL */
+static pubsub_sub_t ** pubsub_find_sub(pubsub_t *ps, uv_msg_t *socket, pubsub_topic_t *topic) {
+   pubsub_sub_t **psub = &ps->subs[pubsub_hash_sub(socket, topic) & (ps->subs_size - 1)];
+   while (*psub && ((*psub)->socket != socket || (*psub)->topic != topic)) {
+      psub = &(*psub)->hash_next;
+   }
+   return psub;
+}
+
+static pubsub_topic_t ** pubsub_find_topic(pubsub_t *ps, const char *name, unsigned int hash) {
+   pubsub_topic_t **ptopic = &ps->topics[hash & (ps->topics_size - 1)];
+   while (*ptopic && ((*ptopic)->hash != hash || strcmp((*ptopic)->name, name) != 0)) {
+      ptopic = &(*ptopic)->hash_next;
+   }
+   return ptopic;
+}
+
+static int pubsub_grow_topics(pubsub_t *ps) {
+   int i, size = ps->topics_size * 2;
+   pubsub_topic_t **topics = calloc(size, sizeof(pubsub_topic_t*));
+   if (!topics) return UV_ENOMEM;
+   for (i = 0; i < ps->topics_size; i++) {
+      pubsub_topic_t *topic, *next;
+      for (topic = ps->topics[i]; topic; topic = next) {
+         next = topic->hash_next;
+         topic->hash_next = topics[topic->hash & (size - 1)];
+         topics[topic->hash & (size - 1)] = topic;
+      }
+   }
+   free(ps->topics);
+   ps->topics = topics;
+   ps->topics_size = size;
+   return 0;
+}
+
+static int pubsub_grow_subs(pubsub_t *ps) {
+   int i, size = ps->subs_size * 2;
+   pubsub_sub_t **subs = calloc(size, sizeof(pubsub_sub_t*));
+   if (!subs) return UV_ENOMEM;
+   for (i = 0; i < ps->subs_size; i++) {
+      pubsub_sub_t *sub, *next;
+      for (sub = ps->subs[i]; sub; sub = next) {
+         unsigned int slot = pubsub_hash_sub(sub->socket, sub->topic) & (size - 1);
+         next = sub->hash_next;
+         sub->hash_next = subs[slot];
+         subs[slot] = sub;
+      }
+   }
+   free(ps->subs);
+   ps->subs = subs;
+   ps->subs_size = size;
+   return 0;
+}
+
+/* inserts a subscription (or the head of a socket list) in the hash table */
+static pubsub_sub_t * pubsub_new_sub(pubsub_t *ps, uv_msg_t *socket, pubsub_topic_t *topic) {
+   pubsub_sub_t *sub, **psub;
+
+   if (ps->subs_count >= ps->subs_size && pubsub_grow_subs(ps)) return NULL;
+
+   sub = calloc(1, sizeof(pubsub_sub_t));
+   if (!sub) return NULL;
+   sub->socket = socket;
+   sub->topic = topic;
+   psub = &ps->subs[pubsub_hash_sub(socket, topic) & (ps->subs_size - 1)];
+   sub->hash_next = *psub;
+   *psub = sub;
+   ps->subs_count++;
+   return sub;
+}
+
+static void pubsub_delete_sub(pubsub_t *ps, pubsub_sub_t *sub) {
+   pubsub_sub_t **psub = pubsub_find_sub(ps, sub->socket, sub->topic);
+   *psub = sub->hash_next;
+   ps->subs_count--;
+   free(sub);
+}
+
+static void pubsub_unlink(pubsub_t *ps, pubsub_sub_t *sub) {
+   pubsub_topic_t *topic = sub->topic;
+
+   /* remove from the list of the topic */
+   if (sub->prev) sub->prev->next = sub->next; else topic->subs = sub->next;
+   if (sub->next) sub->next->prev = sub->prev;
+   /* remove from the list of the socket. the head is never removed here */
+   sub->conn_prev->conn_next = sub->conn_next;
+   if (sub->conn_next) sub->conn_next->conn_prev = sub->conn_prev;
+
+   pubsub_delete_sub(ps, sub);
+
+   if (--topic->count == 0) {
+      pubsub_topic_t **ptopic = pubsub_find_topic(ps, topic->name, topic->hash);
+      *ptopic = topic->hash_next;
+      ps->topics_count--;
+      free(topic);
+   }
+}
+
+/* Broker *******************************************************************/
+
+int pubsub_init(pubsub_t *ps) {
+   memset(ps, 0, sizeof(pubsub_t));
+   ps->topics_size = 64;
+   ps->subs_size = 64;
+   ps->topics = calloc(ps->topics_size, sizeof(pubsub_topic_t*));
+   ps->subs = calloc(ps->subs_size, sizeof(pubsub_sub_t*));
+   if (!ps->topics || !ps->subs) {
+      free(ps->topics);
+      free(ps->subs);
+      return UV_ENOMEM;
+   }
+   return 0;
+}
+
+int pubsub_subscribe(pubsub_t *ps, uv_msg_t *socket, const char *name) {
+   unsigned int hash = pubsub_hash_topic(name);
+   pubsub_topic_t **ptopic, *topic;
+   pubsub_sub_t *head, *sub;
+
+   ptopic = pubsub_find_topic(ps, name, hash);
+   topic = *ptopic;
+   if (topic && *pubsub_find_sub(ps, socket, topic)) return 0;   /* already subscribed */
+
+   head = *pubsub_find_sub(ps, socket, NULL);
+   if (!head) {
+      head = pubsub_new_sub(ps, socket, NULL);
+      if (!head) return UV_ENOMEM;
+   }
+
+   if (!topic) {
+      if (ps->topics_count >= ps->topics_size) {
+         if (pubsub_grow_topics(ps)) return UV_ENOMEM;
+         ptopic = pubsub_find_topic(ps, name, hash);
+      }
+      topic = malloc(sizeof(pubsub_topic_t) + strlen(name) + 1);
+      if (!topic) return UV_ENOMEM;
+      strcpy(topic->name, name);
+      topic->hash = hash;
+      topic->subs = NULL;
+      topic->count = 0;
+      topic->hash_next = NULL;
+      *ptopic = topic;
+      ps->topics_count++;
+   }
+
+   sub = pubsub_new_sub(ps, socket, topic);
+   if (!sub) {
+      if (topic->count == 0) {
+         *pubsub_find_topic(ps, name, hash) = topic->hash_next;
+         ps->topics_count--;
+         free(topic);
+      }
+      return UV_ENOMEM;
+   }
+
+   sub->next = topic->subs;
+   if (topic->subs) topic->subs->prev = sub;
+   topic->subs = sub;
+   topic->count++;
+
+   sub->conn_prev = head;
+   sub->conn_next = head->conn_next;
+   if (head->conn_next) head->conn_next->conn_prev = sub;
+   head->conn_next = sub;
+
+   return 0;
+}
+
+int pubsub_unsubscribe(pubsub_t *ps, uv_msg_t *socket, const char *name) {
+   pubsub_topic_t *topic = *pubsub_find_topic(ps, name, pubsub_hash_topic(name));
+   pubsub_sub_t *sub;
+
+   if (!topic) return 0;
+   sub = *pubsub_find_sub(ps, socket, topic);
+   if (sub) pubsub_unlink(ps, sub);
+   return 0;
+}
+
+/* removes all the subscriptions of a socket. call it when it is closed */
+void pubsub_remove(pubsub_t *ps, uv_msg_t *socket) {
+   pubsub_sub_t *head = *pubsub_find_sub(ps, socket, NULL);
+
+   if (!head) return;
+   while (head->conn_next) {
+      pubsub_unlink(ps, head->conn_next);
+   }
+   pubsub_delete_sub(ps, head);
+}
+
+/* sends a message, already in the publish format, to the subscribers of the
+   topic. returns the number of subscribers it was sent to */
+int pubsub_route(pubsub_t *ps, const char *name, char *msg, int size) {
+   pubsub_topic_t *topic = *pubsub_find_topic(ps, name, pubsub_hash_topic(name));
+   pubsub_sub_t *sub;
+   int count = 0;
+
+   if (!topic) return 0;
+
+   if (ps->targets_size < topic->count) {
+      uv_msg_t **targets = realloc(ps->targets, topic->count * sizeof(uv_msg_t*));
+      if (!targets) return UV_ENOMEM;
+      ps->targets = targets;
+      ps->targets_size = topic->count;
+   }
+   for (sub = topic->subs; sub; sub = sub->next) {
+      ps->targets[count++] = sub->socket;
+   }
+
+   return broadcast_message(ps->targets, count, msg, size, UV_MSG_TRANSIENT, ps->max_backlog);
+}
+
+/* processes a message received by the broker */
+int pubsub_on_message(pubsub_t *ps, uv_msg_t *socket, char *msg, int size) {
+   char *topic = msg + 1;
+   char *end;
+
+   if (size < 2) return UV_EPROTO;
+   end = memchr(topic, 0, size - 1);
+   if (!end || end == topic) return UV_EPROTO;
+
+   switch (msg[0]) {
+   case PUBSUB_SUBSCRIBE:
+      return pubsub_subscribe(ps, socket, topic);
+   case PUBSUB_UNSUBSCRIBE:
+      return pubsub_unsubscribe(ps, socket, topic);
+   case PUBSUB_PUBLISH: {
+      int rc = pubsub_route(ps, topic, msg, size);
+      return rc < 0 ? rc : 0;
+   }
+   default:
+      return UV_EPROTO;
+   }
+}
+
+void pubsub_free(pubsub_t *ps) {
+   int i;
+   for (i = 0; i < ps->subs_size; i++) {
+      pubsub_sub_t *sub, *next;
+      for (sub = ps->subs[i]; sub; sub = next) {
+         next = sub->hash_next;
+         free(sub);
+      }
+   }
+   for (i = 0; i < ps->topics_size; i++) {
+      pubsub_topic_t *topic, *next;
+      for (topic = ps->topics[i]; topic; topic = next) {
+         next = topic->hash_next;
+         free(topic);
+      }
+   }
+   free(ps->subs);
+   free(ps->topics);
+   free(ps->targets);
+   memset(ps, 0, sizeof(pubsub_t));
+}
+
+/* Client *******************************************************************/
+
+static int pubsub_send(uv_msg_t *socket, char type, const char *topic, char *msg, int size) {
+   int topic_len = strlen(topic) + 1;
+   int total = 1 + topic_len + size;
+   char *frame = malloc(total);
+   int rc;
+
+   if (!frame) return UV_ENOMEM;
+   frame[0] = type;
+   memcpy(frame + 1, topic, topic_len);
+   if (size > 0) memcpy(frame + 1 + topic_len, msg, size);
+
+   rc = send_message(socket, frame, total, free, 0, 0);
+   if (rc) free(frame);
+   return rc;
+}
+
+int pubsub_send_subscribe(uv_msg_t *socket, const char *topic) {
+   return pubsub_send(socket, PUBSUB_SUBSCRIBE, topic, NULL, 0);
+}
+
+int pubsub_send_unsubscribe(uv_msg_t *socket, const char *topic) {
+   return pubsub_send(socket, PUBSUB_UNSUBSCRIBE, topic, NULL, 0);
+}
+
+int pubsub_send_publish(uv_msg_t *socket, const char *topic, char *msg, int size) {
+   return pubsub_send(socket, PUBSUB_PUBLISH, topic, msg, size);
+}
+
+/* splits a received publication in topic and payload */
+int pubsub_parse(char *msg, int size, char **topic, char **payload, int *payload_size) {
+   char *end;
+   if (size < 2 || msg[0] != PUBSUB_PUBLISH) return UV_EPROTO;
+   end = memchr(msg + 1, 0, size - 1);
+   if (!end) return UV_EPROTO;
+   *topic = msg + 1;
+   *payload = end + 1;
+   *payload_size = size - (end + 1 - msg);
+   return 0;
+}
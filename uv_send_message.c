@@ -2,11 +2,20 @@
    reserved for libuv, which does not handle memory management for requests.
    This module allocates and releases memory used for the requests. */
 
+#ifndef UV_MSG_INLINE_SIZE
+#define UV_MSG_INLINE_SIZE  256
+#endif
+
+#ifndef SEND_MESSAGE_POOL_SIZE
+#define SEND_MESSAGE_POOL_SIZE  256   /* released requests kept on each loop */
+#endif
+
 typedef void (*uv_free_fn) (void *ptr);
 #define UV_MSG_STATIC     ((uv_free_fn)0)
 #define UV_MSG_TRANSIENT  ((uv_free_fn)-1)
 
 typedef struct send_message_s send_message_t;
+typedef struct send_message_loop_s send_message_loop_t;
 
 typedef void (*send_message_cb) (send_message_t *req, int status);
 
@@ -18,6 +27,12 @@ struct send_message_s {
    void *msg;
    uv_free_fn free_fn;
    send_message_cb msg_send_cb;
+   int status;
+   send_message_loop_t *ctx;
+   send_message_t **handle;   /* of a cancellable message, cleared on completion */
+   /* small transient messages are copied here, right after their length */
+   int inline_hdr;
+   char inline_msg[UV_MSG_INLINE_SIZE];
 };
 
 /****************************************************************************/
@@ -31,9 +46,123 @@ static void * memdup(void *source, int size) {
   return ptr;
 }
 
+/* Requests and Completions *************************************************/
+
+/* With send_message_use_pool() the requests of the socket come from a pool
+   kept for each loop, on a hook of the loop context. The finished writes are
+   recorded there and processed together at the end of the tick: first the user
+   callbacks, then the release of the messages, and then the requests go back to
+   the pool. Without it the requests are allocated and completed one by one, and
+   the socket is not linked to the loop context. */
+
+struct send_message_loop_s {
+   uv_msg_hook_t hook;
+   send_message_t **completed;
+   int completed_count;
+   int completed_alloc;
+   send_message_t *pool;      /* released requests, linked by their first member */
+   int pooled;
+};
+
+static void send_message_complete_all(uv_msg_hook_t *hook);
+
+static void send_message_loop_free(uv_msg_hook_t *hook) {
+   send_message_loop_t *ctx = (send_message_loop_t *) hook;
+   while (ctx->pool) {
+      send_message_t *next = *(send_message_t**) ctx->pool;
+      free(ctx->pool);
+      ctx->pool = next;
+   }
+   free(ctx->completed);
+}
+
+/* the pool of the loop, if the socket uses it */
+static send_message_loop_t * send_message_loop(uv_msg_t *socket) {
+   return (send_message_loop_t *) uv_msg_hook_get(socket, send_message_complete_all, NULL, 0);
+}
+
+/* the socket must then be closed with uv_msg_close */
+int send_message_use_pool(uv_msg_t *socket) {
+   if (!socket) return UV_EINVAL;
+   if (!uv_msg_hook_get(socket, send_message_complete_all, send_message_loop_free,
+                        sizeof(send_message_loop_t))) return UV_ENOMEM;
+   return 0;
+}
+
+static send_message_t * send_message_alloc(uv_msg_t *socket) {
+   send_message_loop_t *ctx = send_message_loop(socket);
+   send_message_t *req;
+
+   if (ctx && ctx->pool) {
+      req = ctx->pool;
+      ctx->pool = *(send_message_t**) req;
+      ctx->pooled--;
+   } else {
+      req = malloc(sizeof(send_message_t));
+      if (!req) return NULL;
+   }
+   req->req.socket = socket;
+   req->ctx = ctx;
+   req->handle = NULL;
+   return req;
+}
+
+static void send_message_release(send_message_t *req) {
+   send_message_loop_t *ctx = req->ctx;
+   if (ctx && ctx->pooled < SEND_MESSAGE_POOL_SIZE) {
+      *(send_message_t**) req = ctx->pool;
+      ctx->pool = req;
+      ctx->pooled++;
+   } else {
+      free(req);
+   }
+}
+
+static void send_message_complete_all(uv_msg_hook_t *hook) {
+   send_message_loop_t *ctx = (send_message_loop_t *) hook;
+   send_message_t *req;
+   int i;
+
+   /* the requests completed by the callbacks are included in this pass */
+   for (i = 0; i < ctx->completed_count; i++) {
+      req = ctx->completed[i];
+      if (req->msg_send_cb) req->msg_send_cb(req, req->status);
+   }
+   for (i = 0; i < ctx->completed_count; i++) {
+      req = ctx->completed[i];
+      if (req->free_fn) req->free_fn(req->msg);
+   }
+   for (i = 0; i < ctx->completed_count; i++) {
+      send_message_release(ctx->completed[i]);
+   }
+   ctx->completed_count = 0;
+}
+
+static int send_message_record(send_message_t *req) {
+   send_message_loop_t *ctx = req->ctx;
+
+   if (!ctx) return 0;
+   if (ctx->completed_count == ctx->completed_alloc) {
+      int alloc = ctx->completed_alloc ? ctx->completed_alloc * 2 : 64;
+      send_message_t **completed = realloc(ctx->completed, alloc * sizeof(send_message_t*));
+      if (!completed) return 0;
+      ctx->completed = completed;
+      ctx->completed_alloc = alloc;
+   }
+
+   if (ctx->completed_count == 0) uv_msg_hook_flush(&ctx->hook);
+   ctx->completed[ctx->completed_count++] = req;
+   return 1;
+}
+
 static void send_message_completed(uv_write_t *wreq, int status) {
    send_message_t *req = (send_message_t *) wreq;
 
+   /* it can no longer be cancelled */
+   if (req->handle) *req->handle = NULL;
+   req->status = status;
+   if (send_message_record(req)) return;
+
    /* call the callback function */
    if (req->msg_send_cb) req->msg_send_cb(req, status);
 
@@ -41,18 +170,100 @@ static void send_message_completed(uv_write_t *wreq, int status) {
    if (req->free_fn) req->free_fn(req->msg);
 
    /* release the write request */
-   free(req);
+   send_message_release(req);
 }
 
-int send_message(uv_msg_t *socket, char *msg, int size, uv_free_fn free_fn, send_message_cb send_cb, void *user_data) {
-   send_message_t *req = malloc(sizeof(send_message_t));
+/****************************************************************************/
+
+/* the header and the message are written directly to the socket when there is
+   nothing queued on it. returns the number of bytes written. an entire message
+   is accounted like the ones accepted by uv_msg_send */
+static int try_write_message(uv_msg_t *socket, char *msg, int size) {
+   uv_stream_t *stream = (uv_stream_t*) socket;
+   int msg_size = htonl(size);
+   uv_buf_t buf[2];
+   int rc;
+
+   if (stream->type == UV_UDP || socket->shm || socket->queued > 0 || socket->write_failed ||
+       socket->max_inflight > 0 || socket->credit_window_msgs > 0 || uv_msg_rate_active(&socket->send_rate) ||
+       socket->batch || size <= socket->batch_max_msg ||
+       (socket->zerocopy && (size_t) size + 4 >= socket->zerocopy) ||
+       uv_stream_get_write_queue_size(stream) > 0) return 0;
+
+   buf[0] = uv_buf_init((char*) &msg_size, 4);
+   buf[1] = uv_buf_init(msg, size);
+   uv_msg_autocork_write(socket);
+   rc = uv_try_write(stream, buf, 2);
+   if (rc == size + 4) {
+      socket->activity++;
+      if (socket->capture_cb) socket->capture_cb(socket, UV_MSG_CAPTURE_SEND, msg, size);
+   }
+   return rc > 0 ? rc : 0;
+}
+
+static int send_message_submit(uv_msg_t *socket, int priority, char *msg, int size, uv_free_fn free_fn,
+                               send_message_cb send_cb, void *user_data, send_message_t **preq) {
+   send_message_t *req;
+   int written, rc;
+
+   if (preq) *preq = NULL;
+   if (!socket || !msg || size <= 0) return UV_EINVAL;
+
+   /* the loop is above its memory limit */
+   rc = uv_msg_memory_check(socket);
+   if (rc) return rc;
+
+   /* fast path: the entire message was written. a request is needed only to
+      report it, on the completion pass of the pool. without the pool a message
+      to report is left to uv_write, which also writes it right away but calls
+      back on the next loop iteration */
+   if ((!send_cb && (free_fn == UV_MSG_STATIC || free_fn == UV_MSG_TRANSIENT)) || send_message_loop(socket))
+      written = try_write_message(socket, msg, size);
+   else
+      written = 0;
+   if (written == size + 4) {
+      UV_MSG_PROBE3(write_queued, socket, size, socket->queued_bytes);
+      UV_MSG_PROBE3(write_completed, socket, size, 0);
+      if (!send_cb && (free_fn == UV_MSG_STATIC || free_fn == UV_MSG_TRANSIENT)) return 0;
+   }
 
-   if (!req) return UV_ENOMEM;
+   req = send_message_alloc(socket);
+   if (!req && written == size + 4) {
+      /* the message was sent, so it is reported before returning */
+      send_message_t sent;
+      memset(&sent, 0, sizeof(sent));
+      sent.req.socket = socket;
+      sent.msg = msg;
+      sent.data = user_data;
+      sent.free_fn = (free_fn == UV_MSG_TRANSIENT) ? UV_MSG_STATIC : free_fn;
+      sent.msg_send_cb = send_cb;
+      if (send_cb) send_cb(&sent, 0);
+      if (sent.free_fn) sent.free_fn(msg);
+      return 0;
+   }
+   if (!req) {
+      /* the start of the message is on the stream without its rest */
+      if (written > 0) uv_msg_write_fail(socket);
+      return UV_ENOMEM;
+   }
+   if (written == size + 4) {
+      memset(&req->req, 0, sizeof(uv_msg_send_t));
+      req->req.socket = socket;
+   }
 
    /* check if we need a copy of the message and save the free function pointer */
-   if (free_fn == UV_MSG_TRANSIENT) {
+   if (free_fn == UV_MSG_TRANSIENT && size <= UV_MSG_INLINE_SIZE) {
+      req->inline_hdr = htonl(size);
+      memcpy(req->inline_msg, msg, size);
+      msg = req->inline_msg;
+      req->free_fn = UV_MSG_STATIC;
+   } else if (free_fn == UV_MSG_TRANSIENT) {
       msg = memdup(msg, size);
-      if (!msg) { free(req); return UV_ENOMEM; };
+      if (!msg) {
+         if (written > 0 && written < size + 4) uv_msg_write_fail(socket);
+         send_message_release(req);
+         return UV_ENOMEM;
+      }
       req->free_fn = free;
    } else {
       req->free_fn = free_fn;
@@ -67,6 +278,160 @@ int send_message(uv_msg_t *socket, char *msg, int size, uv_free_fn free_fn, send
    /* the user callback is optional */
    req->msg_send_cb = send_cb;
 
-   /* send the message */
-   return uv_msg_send((uv_msg_send_t*)req, socket, msg, size, send_message_completed);
+   if (written == size + 4) {
+      send_message_completed((uv_write_t*) req, 0);
+      return 0;
+   } else if (written > 0) {
+      /* a partial write: send only the remaining bytes */
+      rc = uv_msg_send_rest((uv_msg_send_t*)req, socket, msg, size, written, send_message_completed);
+   } else if (msg == req->inline_msg) {
+      /* the length and the message are contiguous: send them as a single buffer */
+      rc = uv_msg_send_frame_prio((uv_msg_send_t*)req, socket, priority, &req->inline_hdr, size + 4, send_message_completed);
+   } else {
+      /* send the message */
+      rc = uv_msg_send_prio((uv_msg_send_t*)req, socket, priority, msg, size, send_message_completed);
+   }
+
+   if (rc) {
+      if (free_fn == UV_MSG_TRANSIENT && msg != req->inline_msg) free(msg);
+      send_message_release(req);
+   } else if (preq && written == 0 && req->req.queue_prio >= 0) {
+      *preq = req;
+      req->handle = preq;
+   }
+   return rc;
+}
+
+int send_message_prio(uv_msg_t *socket, int priority, char *msg, int size, uv_free_fn free_fn, send_message_cb send_cb, void *user_data) {
+   return send_message_submit(socket, priority, msg, size, free_fn, send_cb, user_data, NULL);
+}
+
+int send_message(uv_msg_t *socket, char *msg, int size, uv_free_fn free_fn, send_message_cb send_cb, void *user_data) {
+   return send_message_prio(socket, UV_MSG_PRIO_NORMAL, msg, size, free_fn, send_cb, user_data);
+}
+
+/* Cancellation *************************************************************/
+
+/* The messages held on the send queue of the socket (see uv_msg_set_max_inflight
+   and uv_msg_set_credits) can be cancelled or given a timeout until they are
+   handed to the transport. The request is stored on preq while it is on the
+   queue, and preq is set to NULL when it is written or cancelled, so preq must
+   stay valid until the callback is called and the same location is given to
+   send_message_cancel() and send_message_timeout(). A callback is required. */
+
+int send_message_cancellable(uv_msg_t *socket, int priority, char *msg, int size, uv_free_fn free_fn,
+                             send_message_cb send_cb, void *user_data, send_message_t **preq) {
+   if (!send_cb || !preq) return UV_EINVAL;
+   return send_message_submit(socket, priority, msg, size, free_fn, send_cb, user_data, preq);
+}
+
+/* the callback is called with UV_ECANCELED. returns UV_ENOENT if the message
+   was already written or cancelled, and UV_EBUSY if it is being written */
+int send_message_cancel(send_message_t **preq) {
+   if (!preq) return UV_EINVAL;
+   if (!*preq) return UV_ENOENT;
+   return uv_msg_send_cancel(&(*preq)->req);
+}
+
+/* the message is dropped with UV_ETIMEDOUT if it is still queued after the
+   timeout, in milliseconds */
+int send_message_timeout(send_message_t **preq, unsigned int timeout) {
+   if (!preq) return UV_EINVAL;
+   if (!*preq) return UV_ENOENT;
+   return uv_msg_send_timeout(&(*preq)->req, timeout);
+}
+
+/* Broadcast ****************************************************************/
+
+/* The same message is sent to many sockets sharing a single copy of it. The
+   message is released when the last write is completed. */
+
+typedef struct broadcast_s {
+   int refcount;
+   void *msg;
+   uv_free_fn free_fn;
+   int msg_size;     /* in network order, followed by the copy of the message */
+   char copy[];
+} broadcast_t;
+
+static void broadcast_release(void *ptr) {
+   broadcast_t *shared = (broadcast_t *) ptr;
+
+   if (--shared->refcount > 0) return;
+
+   if (shared->free_fn) shared->free_fn(shared->msg);
+   free(shared);
+}
+
+/* the number of bytes waiting to be written on the socket */
+static size_t message_backlog(uv_msg_t *socket) {
+   if (socket->udp.type == UV_UDP) return uv_udp_get_send_queue_size(&socket->udp);
+   return uv_stream_get_write_queue_size((uv_stream_t*) socket);
+}
+
+/* returns the number of sockets the message was sent to. the sockets with more
+   than max_backlog bytes waiting to be written are skipped (0 = no limit) */
+int broadcast_message(uv_msg_t **sockets, int count, char *msg, int size, uv_free_fn free_fn, size_t max_backlog) {
+   broadcast_t *shared;
+   int i, sent = 0;
+
+   if (!sockets || count < 0 || !msg || size <= 0) return UV_EINVAL;
+
+   if (free_fn == UV_MSG_TRANSIENT) {
+      /* a single copy, right after the length */
+      shared = malloc(sizeof(broadcast_t) + size);
+      if (!shared) return UV_ENOMEM;
+      memcpy(shared->copy, msg, size);
+      shared->msg = shared->copy;
+      shared->free_fn = UV_MSG_STATIC;
+   } else {
+      shared = malloc(sizeof(broadcast_t));
+      if (!shared) return UV_ENOMEM;
+      shared->msg = msg;
+      shared->free_fn = free_fn;
+   }
+   shared->msg_size = htonl(size);
+   /* this reference is held until all the writes are queued */
+   shared->refcount = 1;
+
+   for (i = 0; i < count; i++) {
+      uv_msg_t *socket = sockets[i];
+      send_message_t *req;
+      int written, rc;
+
+      if (!socket || uv_is_closing((uv_handle_t*) socket)) continue;
+      if (max_backlog > 0 && message_backlog(socket) > max_backlog) continue;
+      if (uv_msg_memory_check(socket)) continue;
+
+      written = try_write_message(socket, shared->msg, size);
+      if (written == size + 4) { sent++; continue; }
+
+      req = send_message_alloc(socket);
+      if (!req) {
+         if (written > 0) uv_msg_write_fail(socket);
+         break;
+      }
+      req->msg = shared;
+      req->free_fn = broadcast_release;
+      req->msg_send_cb = NULL;
+      req->data = NULL;
+
+      if (written > 0) {
+         rc = uv_msg_send_rest((uv_msg_send_t*)req, socket, shared->msg, size, written, send_message_completed);
+      } else if (shared->msg == shared->copy) {
+         rc = uv_msg_send_frame((uv_msg_send_t*)req, socket, &shared->msg_size, size + 4, send_message_completed);
+      } else {
+         rc = uv_msg_send((uv_msg_send_t*)req, socket, shared->msg, size, send_message_completed);
+      }
+
+      if (rc) {
+         send_message_release(req);
+         continue;
+      }
+      shared->refcount++;
+      sent++;
+   }
+
+   broadcast_release(shared);
+   return sent;
 }